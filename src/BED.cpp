@@ -10,37 +10,60 @@
 #include <sstream>
 #include <exception>
 #include <stdexcept>
+#include <cstring>
 
 using std::ifstream;
 using std::string;
 
 namespace rnaseqc {
-    ifstream& extractBED(ifstream &input, Feature &out)
+    // Parses one BED line into the feature. Returns false for comment lines
+    bool parseBED(const string &line, Feature &out)
     {
         try
         {
-            string line;
-            while(getline(input, line))
-            {
-                if(line[0] == '#') continue; //Do beds even have comment lines?
-                std::istringstream tokenizer(line);
-                string buffer;
-                tokenizer >> buffer; //chromosome name
-                out.chromosome = chromosomeMap(buffer);
-                tokenizer >> buffer; //start
-                out.start = std::stoull(buffer) + 1;
-                tokenizer >> buffer; //stop
-                out.end = std::stoull(buffer) + 1;
-                out.feature_id = line; // add a dummy exon_id for mapping interval intersections later
-                out.type = FeatureType::Exon;
-                break;
-            }
+            if(line[0] == '#') return false; //Do beds even have comment lines?
+            std::istringstream tokenizer(line);
+            string buffer;
+            tokenizer >> buffer; //chromosome name
+            out.chromosome = chromosomeMap(buffer);
+            tokenizer >> buffer; //start
+            out.start = std::stoull(buffer) + 1;
+            tokenizer >> buffer; //stop
+            out.end = std::stoull(buffer) + 1;
+            out.feature_id = line; // add a dummy exon_id for mapping interval intersections later
+            out.type = FeatureType::Exon;
         }
         catch (std::exception &e)
         {
             throw bedException(std::string("Encountered an unknown error while parsing the BED: ") + e.what());
         }
+        return true;
+    }
+
+    ifstream& extractBED(ifstream &input, Feature &out)
+    {
+        string line;
+        while(getline(input, line)) if (parseBED(line, out)) break;
         return input;
     }
 
+    BEDReader::BEDReader(const string &filename, unsigned int threads) : file(filename, threads), offset(0)
+    {
+    }
+
+    bool BEDReader::next(Feature &out)
+    {
+        const char *data = this->file.data();
+        const std::size_t length = this->file.size();
+        while (this->offset < length)
+        {
+            const char *line = data + this->offset;
+            const char *newline = static_cast<const char*>(memchr(line, '\n', length - this->offset));
+            const char *end = newline != nullptr ? newline : data + length;
+            this->offset = (end - data) + 1;
+            if (parseBED(string(line, end), out)) return true;
+        }
+        return false;
+    }
+
 }
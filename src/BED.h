@@ -18,5 +18,17 @@ namespace rnaseqc {
     };
     
     std::ifstream& extractBED(std::ifstream&, Feature&);
+
+    class BEDReader {
+        // Reads intervals out of the BED, which may also be gzip or BGZF compressed
+        MappedFile file;
+        std::size_t offset;
+    public:
+        BEDReader(const std::string&, unsigned int = 1);
+        bool is_open() const {
+            return this->file.is_open();
+        }
+        bool next(Feature&); // Returns false at the end of the file
+    };
 }
 #endif /* BED_h */
@@ -7,12 +7,21 @@
 //
 
 #include "BamReader.h"
+#include <thread>
+#include <boost/filesystem.hpp>
 
 namespace rnaseqc {
+    bool isStream(const std::string &filepath)
+    {
+        if (filepath == "-") return true;
+        boost::system::error_code error;
+        const boost::filesystem::file_status status = boost::filesystem::status(filepath, error);
+        return !error && (status.type() == boost::filesystem::fifo_file || status.type() == boost::filesystem::character_file);
+    }
+    
     bool SeqlibReader::next(SeqLib::BamRecord &read)
     {
-        // Must uncomment before adding multithreading
-        //    std::lock_guard<SeqlibReader> guard(*this);
+        // Readers aren't shared between threads, so this doesn't lock. Code which shares a reader must hold its lock around next()
         try {
             bool ok = this->bam.GetNextRecord(read);
             if (ok) this->read_count++;
@@ -25,4 +34,74 @@ namespace rnaseqc {
         return false; // No way to get here
         
     }
+    
+    const unsigned int BATCH_QUEUE_SPINS = 1000u; // Yields before blocking. The other side usually catches up within that
+
+    // Spins for a bounded time, then blocks until the other side notifies
+    template <typename Ready> void waitFor(std::mutex &lock, std::condition_variable &changed, Ready ready)
+    {
+        for (unsigned int spin = 0; spin < BATCH_QUEUE_SPINS; ++spin)
+        {
+            if (ready()) return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, ready);
+    }
+
+    void BatchQueue::notify()
+    {
+        // Taking the lock orders the update before a waiter's final check, so the notification can't be missed
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+        }
+        this->changed.notify_all();
+    }
+
+    std::vector<Alignment>* BatchQueue::acquire()
+    {
+        const size_t slot = this->tail.load(std::memory_order_relaxed);
+        waitFor(this->lock, this->changed, [this, slot]() {
+            return this->cancelled.load(std::memory_order_acquire) || slot - this->head.load(std::memory_order_acquire) < this->batches.size();
+        });
+        return this->cancelled.load(std::memory_order_acquire) ? nullptr : &this->batches[slot % this->batches.size()];
+    }
+    
+    void BatchQueue::publish(size_t count)
+    {
+        const size_t slot = this->tail.load(std::memory_order_relaxed);
+        this->counts[slot % this->batches.size()] = count;
+        this->tail.store(slot + 1, std::memory_order_release);
+        this->notify();
+    }
+    
+    void BatchQueue::close()
+    {
+        this->closed.store(true, std::memory_order_release);
+        this->notify();
+    }
+    
+    std::vector<Alignment>* BatchQueue::next(size_t &count)
+    {
+        const size_t slot = this->head.load(std::memory_order_relaxed);
+        waitFor(this->lock, this->changed, [this, slot]() {
+            return slot != this->tail.load(std::memory_order_acquire) || this->closed.load(std::memory_order_acquire);
+        });
+        // Check the tail again after seeing the closed flag, in case a final batch was published in between
+        if (slot == this->tail.load(std::memory_order_acquire)) return nullptr;
+        count = this->counts[slot % this->batches.size()];
+        return &this->batches[slot % this->batches.size()];
+    }
+    
+    void BatchQueue::release()
+    {
+        this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        this->notify();
+    }
+    
+    void BatchQueue::cancel()
+    {
+        this->cancelled.store(true, std::memory_order_release);
+        this->notify();
+    }
 }
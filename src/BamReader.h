@@ -12,11 +12,16 @@
 #include "Fasta.h"
 #include <stdio.h>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <string>
 #include <set>
+#include <vector>
 #include <SeqLib/BamReader.h>
 #include <SeqLib/BamHeader.h>
 #include <SeqLib/BamRecord.h>
+#include <SeqLib/GenomicRegion.h>
+#include <SeqLib/ThreadPool.h>
 #include <htslib/cram/cram.h> // I really don't like using unofficial APIs, but not much choice here.
 
 namespace rnaseqc {
@@ -52,14 +57,19 @@ namespace rnaseqc {
         }
     };
     
+    // True for stdin ("-") and named pipes, which can only be read once, front to back
+    bool isStream(const std::string&);
+    
     class SeqlibReader : public SynchronizedReader {
         SeqLib::BamReader bam;
         std::string reference_path;
         std::set<chrom> valid_chroms;
         bool user_cram_reference;
+        bool streamed;
+        SeqLib::ThreadPool decode_pool;
     public:
         
-        SeqlibReader() : reference_path(), valid_chroms(), user_cram_reference(false) {}
+        SeqlibReader() : reference_path(), valid_chroms(), user_cram_reference(false), streamed(false), decode_pool() {}
         
         bool next(SeqLib::BamRecord&);
         
@@ -68,8 +78,12 @@ namespace rnaseqc {
         }
         
         bool open(std::string filepath) {
-            if (this->reference_path.length()) {
+            this->streamed = rnaseqc::isStream(filepath);
+            // A stream can't be opened twice, so the reference can't be checked ahead of time
+            if (this->reference_path.length() && this->streamed) this->bam.SetCramReference(this->reference_path);
+            else if (this->reference_path.length()) {
                 auto htsfile = hts_open(filepath.c_str(), "r");
+                if (this->decode_pool.IsOpen()) hts_set_thread_pool(htsfile, this->decode_pool.p.get());
                 hts_set_fai_filename(htsfile, this->reference_path.c_str());
                 if (htsfile->format.format == htsExactFormat::cram) {
                     this->user_cram_reference = true;
@@ -88,13 +102,33 @@ namespace rnaseqc {
                 hts_close(htsfile);
             }
             this->bam.Open(filepath);
+            if (this->bam.IsOpen() && this->decode_pool.IsOpen()) this->bam.SetThreadPool(this->decode_pool);
             return this->bam.IsOpen();
         }
         
+        bool isStream() const {
+            return this->streamed;
+        }
+        
+        // Restricts reading to a single region. Requires an index
+        bool setRegion(const SeqLib::GenomicRegion &region) {
+            return this->bam.SetRegion(region);
+        }
+        
         void addReference(std::string filepath) {
             this->reference_path = filepath;
         }
         
+        // Offloads BGZF inflate/CRAM decode to a pool of htslib threads. Must be set before open()
+        // Pools can be shared between readers
+        void setThreadPool(const SeqLib::ThreadPool &pool) {
+            this->decode_pool = pool;
+        }
+        
+        const SeqLib::ThreadPool& getThreadPool() const {
+            return this->decode_pool;
+        }
+        
         inline bool validateChromosome(const chrom c) {
             // For crams, we only validate chromosomes which matched our reference. Otherwise yes!
             return this->user_cram_reference ? this->valid_chroms.count(c) > 0 : true;
@@ -103,6 +137,32 @@ namespace rnaseqc {
     };
     
     typedef SeqLib::BamRecord Alignment;
+    
+    class BatchQueue {
+        // Bounded ring of reusable alignment batches between exactly one producer and one consumer
+        // The batch vectors and their BamRecord wrappers are reused, but SeqLib still allocates each record's payload per read
+        // A side which has to wait spins briefly, then sleeps until the other side makes progress
+        std::vector<std::vector<Alignment> > batches;
+        std::vector<size_t> counts;
+        std::atomic<size_t> head, tail; // Next batch to consume, and next batch to fill
+        std::atomic<bool> closed, cancelled;
+        std::mutex lock;
+        std::condition_variable changed;
+        BatchQueue(const BatchQueue&) = delete;
+        void notify(); // Wakes the other side, if it's asleep
+    public:
+        BatchQueue(size_t depth, size_t batchSize) : batches(depth, std::vector<Alignment>(batchSize)), counts(depth, 0), head(0), tail(0), closed(false), cancelled(false), lock(), changed() {}
+        
+        // Producer side
+        std::vector<Alignment>* acquire(); // Waits for an empty batch. Returns nullptr if the consumer gave up
+        void publish(size_t); // Hands the acquired batch (with this many records filled) to the consumer
+        void close(); // No more batches will be published
+        
+        // Consumer side
+        std::vector<Alignment>* next(size_t&); // Waits for a filled batch. Returns nullptr once the queue is closed and drained
+        void release(); // Returns the batch from next() to the producer
+        void cancel(); // Stops the producer
+    };
 }
 
 #endif /* BamReader_h */
@@ -0,0 +1,340 @@
+//
+//  Collapse.cpp
+//  RNA-SeQC
+//
+//  Collapses a transcript annotation into the single-transcript gene model RNA-SeQC expects
+//  Produces the same GTF as collapse_annotation.py from the GTEx pipeline
+//
+
+#include "Collapse.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+
+namespace rnaseqc {
+    const char WHITESPACE[] = " \t\n\r\v\f";
+    const string COLLAPSED_HEADER = "##collapsed version generated by GTEx pipeline\n";
+    const string RETAINED_INTRON = "retained_intron", READTHROUGH_TRANSCRIPT = "readthrough_transcript";
+
+    struct OverlapSegment {
+        coord start, end;
+        coord reach; // Furthest end of any segment up to and including this one, in order of start
+        std::size_t gene;
+    };
+
+    bool isWhitespace(char c)
+    {
+        return c != '\0' && strchr(WHITESPACE, c) != nullptr;
+    }
+
+    // Same as python's str.strip()
+    void trimWhitespace(const char *&begin, const char *&end)
+    {
+        while (begin < end && isWhitespace(*begin)) ++begin;
+        while (end > begin && isWhitespace(end[-1])) --end;
+    }
+
+    // Same as python's str.split()
+    vector<string> splitWords(const string &text)
+    {
+        vector<string> words;
+        for (string::size_type start = text.find_first_not_of(WHITESPACE); start != string::npos; start = text.find_first_not_of(WHITESPACE, start))
+        {
+            const string::size_type stop = text.find_first_of(WHITESPACE, start);
+            words.push_back(text.substr(start, stop == string::npos ? string::npos : stop - start));
+            start = stop;
+        }
+        return words;
+    }
+
+    // Ensembl names its types *_biotype. They're read (and written) as *_type
+    string renameBiotypes(string attributes)
+    {
+        for (string::size_type pos = attributes.find("_biotype"); pos != string::npos; pos = attributes.find("_biotype", pos + 5)) attributes.replace(pos, 8, "_type");
+        return attributes;
+    }
+
+    // Reads the attribute column the way the GTEx script does: quotes are dropped, and anything after the last ';' is ignored
+    // Values are the first word after the key. Tags can repeat, so they're collected separately
+    void splitAttributes(const char *begin, const char *end, std::unordered_map<string, string> &attributes, vector<string> &tags)
+    {
+        string text;
+        text.reserve(end - begin);
+        for (const char *c = begin; c < end; ++c) if (*c != '"') text.push_back(*c);
+        text = renameBiotypes(text);
+        for (string::size_type start = 0, stop = text.find(';'); stop != string::npos; start = stop + 1, stop = text.find(';', start))
+        {
+            const char *field = text.data() + start, *fieldEnd = text.data() + stop;
+            trimWhitespace(field, fieldEnd);
+            const char *space = static_cast<const char*>(memchr(field, ' ', fieldEnd - field));
+            if (space == nullptr) throw gtfException("Invalid GTF attribute: " + string(field, fieldEnd));
+            const char *valueEnd = static_cast<const char*>(memchr(space + 1, ' ', fieldEnd - space - 1));
+            string key(field, space), value(space + 1, valueEnd != nullptr ? valueEnd : fieldEnd);
+            if (key == "tag") tags.push_back(value);
+            else attributes[key] = value;
+        }
+    }
+
+    const string& requireAttribute(const std::unordered_map<string, string> &attributes, const string &key, const string &context)
+    {
+        auto value = attributes.find(key);
+        if (value == attributes.end()) throw gtfException("Missing " + key + " attribute: " + context);
+        return value->second;
+    }
+
+    // Merges overlapping exons into disjoint segments, ordered by start. Adjacent exons stay separate
+    void mergeSegments(vector<Segment> &segments)
+    {
+        std::stable_sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+            return a.first < b.first;
+        });
+        vector<Segment> merged;
+        for (auto segment = segments.begin(); segment != segments.end(); ++segment)
+        {
+            if (merged.size() && segment->first <= merged.back().second) merged.back().second = std::max(merged.back().second, segment->second);
+            else merged.push_back(*segment);
+        }
+        segments.swap(merged);
+    }
+
+    // Removes every part of a gene's segments which is covered by another gene. Then drops genes which are left with single base exons only
+    void removeOverlaps(vector<CollapsedGene> &genes, bool stranded)
+    {
+        typedef std::pair<chrom, string> GroupKey; // Overlaps are only searched within a contig (and strand)
+        std::map<GroupKey, vector<OverlapSegment> > groups;
+        for (std::size_t i = 0; i < genes.size(); ++i)
+        {
+            vector<OverlapSegment> &group = groups[GroupKey(genes[i].feature.chromosome, stranded ? genes[i].strand : "")];
+            for (auto segment = genes[i].exons.begin(); segment != genes[i].exons.end(); ++segment) group.push_back({segment->first, segment->second, 0, i});
+        }
+        for (auto group = groups.begin(); group != groups.end(); ++group)
+        {
+            std::sort(group->second.begin(), group->second.end(), [](const OverlapSegment &a, const OverlapSegment &b) {
+                return a.start < b.start;
+            });
+            coord reach = 0;
+            for (auto segment = group->second.begin(); segment != group->second.end(); ++segment)
+            {
+                reach = segment == group->second.begin() ? segment->end : std::max(reach, segment->end);
+                segment->reach = reach;
+            }
+        }
+        vector<vector<Segment> > remaining(genes.size());
+        vector<Segment> others;
+        for (std::size_t i = 0; i < genes.size(); ++i)
+        {
+            const vector<OverlapSegment> &group = groups[GroupKey(genes[i].feature.chromosome, stranded ? genes[i].strand : "")];
+            for (auto segment = genes[i].exons.begin(); segment != genes[i].exons.end(); ++segment)
+            {
+                // Segments of other genes which overlap this one. Everything past the upper bound starts after it
+                others.clear();
+                auto other = std::upper_bound(group.begin(), group.end(), segment->second, [](coord end, const OverlapSegment &s) {
+                    return end < s.start;
+                });
+                while (other != group.begin())
+                {
+                    --other;
+                    if (other->reach < segment->first) break;
+                    if (other->end >= segment->first && other->gene != i) others.push_back(Segment(other->start, other->end));
+                }
+                std::sort(others.begin(), others.end());
+                coord cursor = segment->first;
+                for (auto overlap = others.begin(); overlap != others.end() && cursor <= segment->second; ++overlap)
+                {
+                    if (overlap->first > cursor) remaining[i].push_back(Segment(cursor, overlap->first - 1));
+                    cursor = std::max(cursor, overlap->second + 1);
+                }
+                if (cursor <= segment->second) remaining[i].push_back(Segment(cursor, segment->second));
+            }
+        }
+        for (std::size_t i = 0; i < genes.size(); ++i)
+        {
+            if (std::all_of(remaining[i].begin(), remaining[i].end(), [](const Segment &s) { return s.second == s.first; })) remaining[i].clear();
+            genes[i].exons.swap(remaining[i]);
+        }
+    }
+
+    std::unordered_set<string> readTranscriptBlacklist(const string &filename)
+    {
+        std::ifstream input(filename);
+        if (!input.is_open()) throw fileException("Unable to open transcript blacklist: " + filename);
+        std::unordered_set<string> blacklist;
+        string line;
+        getline(input, line); // Header
+        while (getline(input, line)) if (line.size()) blacklist.insert(line.substr(0, line.find('\t')));
+        return blacklist;
+    }
+
+    void collapseAnnotation(const string &input, const string &output, const CollapseOptions &options)
+    {
+        MappedFile file(input);
+        if (!file.is_open()) throw fileException("Unable to open GTF file: " + input);
+        vector<CollapsedGene> genes;
+        std::unordered_set<string> geneIds;
+        std::unordered_map<string, string> attributes;
+        vector<string> tags;
+        string header; // Leading comment lines are copied to the output
+        bool inHeader = true, inTranscript = false, keepTranscript = false;
+        std::size_t transcriptGene = 0;
+        if (options.verbosity) cout << "Parsing GTF..." << endl;
+        const char *data = file.data();
+        const std::size_t length = file.size();
+        for (std::size_t offset = 0; offset < length;)
+        {
+            const char *line = data + offset;
+            const char *newline = static_cast<const char*>(memchr(line, '\n', length - offset));
+            const char *end = newline != nullptr ? newline : data + length;
+            offset = (end - data) + 1;
+            if (inHeader && line[0] == '#')
+            {
+                header.append(line, newline != nullptr ? newline + 1 : end);
+                continue;
+            }
+            inHeader = false;
+            trimWhitespace(line, end);
+            if (line == end || line[0] == '#') continue;
+            const char *cursor = line, *begin[9], *last[9];
+            for (unsigned int column = 0; column < 9; ++column)
+                if (!nextColumn(cursor, end, begin[column], last[column])) throw gtfException("Invalid GTF line: " + string(line, end));
+            const string type(begin[2], last[2]);
+            try {
+                if (type == "gene")
+                {
+                    attributes.clear();
+                    tags.clear();
+                    splitAttributes(begin[8], last[8], attributes, tags);
+                    const string &id = requireAttribute(attributes, "gene_id", string(line, end));
+                    if (!geneIds.insert(id).second) throw gtfException("Detected non-unique Gene ID: " + id);
+                    genes.emplace_back();
+                    CollapsedGene &gene = genes.back();
+                    gene.contig.assign(begin[0], last[0]);
+                    gene.source.assign(begin[1], last[1]);
+                    gene.strand.assign(begin[6], last[6]);
+                    gene.phase.assign(begin[7], last[7]);
+                    gene.attributes = renameBiotypes(string(begin[8], last[8]));
+                    gene.feature.chromosome = chromosomeMap(gene.contig);
+                    gene.feature.type = FeatureType::Gene;
+                    gene.feature.start = std::stoll(string(begin[3], last[3]));
+                    gene.feature.end = std::stoll(string(begin[4], last[4]));
+                    gene.feature.strand = gene.strand == "+" ? Strand::Forward : (gene.strand == "-" ? Strand::Reverse : Strand::Unknown);
+                    gene.feature.feature_id = gene.feature.gene_id = id;
+                }
+                else if (type == "transcript")
+                {
+                    if (genes.empty()) throw gtfException("Transcript precedes any gene: " + string(line, end));
+                    attributes.clear();
+                    tags.clear();
+                    splitAttributes(begin[8], last[8], attributes, tags);
+                    const string &id = requireAttribute(attributes, "transcript_id", string(line, end));
+                    const string &transcriptType = requireAttribute(attributes, "transcript_type", string(line, end));
+                    // Retained introns and readthroughs would merge unrelated exons into the gene model
+                    keepTranscript = !options.blacklist.count(id) && transcriptType != RETAINED_INTRON
+                        && std::find(tags.begin(), tags.end(), RETAINED_INTRON) == tags.end()
+                        && std::find(tags.begin(), tags.end(), READTHROUGH_TRANSCRIPT) == tags.end();
+                    transcriptGene = genes.size() - 1;
+                    inTranscript = true;
+                }
+                else if (type == "exon")
+                {
+                    if (!inTranscript) throw gtfException("Exon precedes any transcript: " + string(line, end));
+                    const coord start = std::stoll(string(begin[3], last[3])), stop = std::stoll(string(begin[4], last[4]));
+                    if (keepTranscript) genes[transcriptGene].exons.push_back(Segment(start, stop));
+                }
+            }
+            catch (std::invalid_argument &e) {
+                throw gtfException(std::string("GTF is in an invalid format: ") + e.what());
+            }
+            catch (std::out_of_range &e) {
+                throw gtfException(std::string("GTF is in an invalid format: ") + e.what());
+            }
+        }
+
+        if (options.verbosity) cout << "Collapsing transcripts of " << genes.size() << " genes..." << endl;
+        for (auto gene = genes.begin(); gene != genes.end(); ++gene) mergeSegments(gene->exons);
+        if (!options.collapseOnly) removeOverlaps(genes, options.stranded);
+
+        std::ofstream writer(output);
+        if (!writer.is_open()) throw fileException("Unable to open output file: " + output);
+        writer << header << COLLAPSED_HEADER;
+        unsigned long written = 0;
+        for (auto gene = genes.begin(); gene != genes.end(); ++gene)
+        {
+            if (gene->exons.empty()) continue;
+            coord start = gene->exons.front().first, stop = gene->exons.front().second;
+            for (auto exon = gene->exons.begin(); exon != gene->exons.end(); ++exon)
+            {
+                start = std::min(start, exon->first);
+                stop = std::max(stop, exon->second);
+            }
+            const string attributeColumn = gene->attributes.find("transcript_id") != string::npos ? gene->attributes : addTranscriptAttributes(gene->attributes);
+            const string prefix = gene->contig + "\t" + gene->source + "\t", suffix = "\t.\t" + gene->strand + "\t" + gene->phase + "\t" + attributeColumn;
+            writer << prefix << "gene\t" << start << "\t" << stop << suffix << "\n";
+            writer << prefix << "transcript\t" << start << "\t" << stop << suffix << "\n";
+            if (gene->strand == "-") std::reverse(gene->exons.begin(), gene->exons.end());
+            unsigned int number = 0;
+            for (auto exon = gene->exons.begin(); exon != gene->exons.end(); ++exon)
+            {
+                ++number;
+                // The closing quote of exon_id is misplaced, exactly as in the GTEx script. RNA-SeQC reads the ID correctly
+                writer << prefix << "exon\t" << exon->first << "\t" << exon->second << suffix << " exon_id \"" << gene->feature.feature_id << "_" << number << "; exon_number " << number << "\";\n";
+            }
+            ++written;
+        }
+        if (!writer) throw fileException("Unable to write output file: " + output);
+        if (options.verbosity) cout << "Wrote " << written << " collapsed genes to " << output << endl;
+    }
+
+    // Same as add_transcript_attributes in the GTEx script: rewrites the attributes of a gene line in GENCODE order,
+    // copying transcript attributes from their gene counterparts
+    string addTranscriptAttributes(const string &attributes)
+    {
+        vector<string> order, added;
+        if (attributes.find("gene_status") != string::npos) // status fields were dropped in GENCODE 26
+        {
+            order = {"gene_id", "transcript_id", "gene_type", "gene_status", "gene_name", "transcript_type", "transcript_status", "transcript_name"};
+            added = {"transcript_id", "transcript_type", "transcript_status", "transcript_name"};
+        }
+        else
+        {
+            order = {"gene_id", "transcript_id", "gene_type", "gene_name", "transcript_type", "transcript_name"};
+            added = {"transcript_id", "transcript_type", "transcript_name"};
+        }
+        if (attributes.find("level") != string::npos) order.push_back("level");
+        const string::size_type first = attributes.find_first_not_of(';'), last = attributes.find_last_not_of(';');
+        const string stripped = first == string::npos ? "" : attributes.substr(first, last + 1 - first);
+        std::unordered_map<string, string> values;
+        vector<string> optional;
+        for (string::size_type start = 0, stop = 0; stop != string::npos; start = stop + 2)
+        {
+            stop = stripped.find("; ", start);
+            const string field = stripped.substr(start, stop == string::npos ? string::npos : stop - start);
+            const vector<string> words = splitWords(field);
+            if (words.empty()) throw gtfException("Invalid gene attributes: " + attributes);
+            if (std::find(order.begin(), order.end(), words[0]) == order.end()) optional.push_back(field);
+            else if (words.size() < 2) throw gtfException("Invalid gene attributes: " + attributes);
+            else
+            {
+                string value = words[1];
+                value.erase(std::remove(value.begin(), value.end(), ';'), value.end());
+                values[words[0]] = value;
+            }
+        }
+        if (!values.count("gene_name")) values["gene_name"] = requireAttribute(values, "gene_id", attributes);
+        if (!values.count("transcript_id")) values["transcript_id"] = requireAttribute(values, "gene_id", attributes);
+        for (auto key = added.begin(); key != added.end(); ++key)
+            if (!values.count(*key)) values[*key] = requireAttribute(values, "gene" + key->substr(10), attributes);
+        string result;
+        for (auto key = order.begin(); key != order.end(); ++key) result += (result.size() ? "; " : "") + *key + " " + requireAttribute(values, *key, attributes);
+        for (auto field = optional.begin(); field != optional.end(); ++field) result += "; " + *field;
+        return result + ";";
+    }
+}
@@ -0,0 +1,38 @@
+//
+//  Collapse.h
+//  RNA-SeQC
+//
+//  Collapses a transcript annotation into the single-transcript gene model RNA-SeQC expects
+//  Produces the same GTF as collapse_annotation.py from the GTEx pipeline
+//
+
+#ifndef Collapse_h
+#define Collapse_h
+
+#include "GTF.h"
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+namespace rnaseqc {
+    typedef std::pair<coord, coord> Segment; // Closed interval [first, second]
+
+    struct CollapsedGene {
+        Feature feature; // Position of the gene line. feature_id is the gene_id
+        std::string contig, source, strand, phase, attributes; // Copied to the output as they are
+        std::vector<Segment> exons; // Exons of the transcripts which were kept. Replaced by the collapsed model
+    };
+
+    struct CollapseOptions {
+        std::unordered_set<std::string> blacklist; // Transcript IDs to leave out of the gene models
+        bool collapseOnly; // Keep exon segments shared by other genes
+        bool stranded; // Only remove segments shared by genes on the same strand
+        int verbosity;
+    };
+
+    std::unordered_set<std::string> readTranscriptBlacklist(const std::string&); // First column of a tab delimited table, after its header
+    void collapseAnnotation(const std::string&, const std::string&, const CollapseOptions&); // Input GTF, output GTF
+    std::string addTranscriptAttributes(const std::string&); // Fills in the transcript attributes of a gene line
+}
+
+#endif /* Collapse_h */
@@ -0,0 +1,795 @@
+//
+//  Engine.cpp
+//  RNA-SeQC
+//
+//  Runs alignments through the metrics, either serially or one contig per worker thread
+//
+
+#include "Engine.h"
+#include "Serialize.h"
+#include <htslib/sam.h>
+#include <zlib.h>
+#include <iostream>
+#include <sstream>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace rnaseqc {
+
+    const string NM = "NM";
+
+    ReadProcessor::ReadProcessor(const QCOptions &opts, Fasta &fasta, const SeqLib::HeaderSequenceVector &header, const string &coverageFile, bool writeCoverage, const string &exonFile, bool gcContent) : options(opts), fastaReader(fasta), sequences(header), worker(false), features(), bedFeatures(), bias(opts.biasOffset, opts.biasWindow, opts.biasLength, opts.detectionThreshold), baseCoverage(fasta, coverageFile, exonFile, opts.coverageMask, writeCoverage, gcContent, bias), counter(), counts(), doFragmentSize(0u), fragmentSizeFragmentTracker(), gcContentFragmentTracker(), fragmentSizes(), fragmentSamples(), gcBins(), read_lengths(), alignmentCount(0ull), readLength(0), current_chrom(0), last_position(0), anchored(false), classified(false), classifiedEnd(-1), finishedContigs()
+    {
+        counts.coverAll();
+    }
+
+    ReadProcessor::ReadProcessor(const QCOptions &opts, Fasta &fasta, const SeqLib::HeaderSequenceVector &header) : options(opts), fastaReader(fasta), sequences(header), worker(true), features(), bedFeatures(), bias(opts.biasOffset, opts.biasWindow, opts.biasLength, opts.detectionThreshold), baseCoverage(fasta, opts.coverageMask, opts.outputCoverage, bias), counter(), counts(), doFragmentSize(0u), fragmentSizeFragmentTracker(), gcContentFragmentTracker(), fragmentSizes(), fragmentSamples(), gcBins(), read_lengths(), alignmentCount(0ull), readLength(0), current_chrom(0), last_position(0), anchored(false), classified(false), classifiedEnd(-1), finishedContigs()
+    {
+
+    }
+
+    // Runs one alignment through all of the metrics
+    void ReadProcessor::process(Alignment &alignment)
+    {
+        ++alignmentCount;
+        string trash;
+        //count metrics based on basic read data
+        if (alignment.SecondaryFlag()) counter.increment(MetricKey::AlternativeAlignments);
+        else if (alignment.QCFailFlag()) counter.increment(MetricKey::FailedVendorQC);
+        else if (alignment.MapQuality() < options.mappingQuality) counter.increment(MetricKey::LowMappingQuality);
+        if (alignment.SupplementaryFlag() && !(options.legacy || readStringTag(alignment, options.chimericTag, trash)))
+        {
+            counter.increment(MetricKey::ChimericFragmentsAuto);
+            if(options.excludeChimeric) return;
+        }
+        if (alignment.SecondaryFlag() || alignment.QCFailFlag() || alignment.SupplementaryFlag()) return;
+        counter.increment(MetricKey::UniqueMappingQCPassedReads);
+
+        unsigned read_len = alignment.Sequence().length();
+        read_lengths.add(read_len);
+
+        //raw counts:
+        if (!alignment.PairedFlag()) counter.increment(MetricKey::UnpairedReads);
+        if (!alignment.MappedFlag()) return;
+        counter.increment(MetricKey::MappedReads);
+
+        if (alignment.DuplicateFlag()) counter.increment(MetricKey::MappedDuplicateReads);
+        else counter.increment(MetricKey::MappedUniqueReads);
+        //check length against max read length
+        unsigned int alignmentSize = alignment.PositionEnd() - alignment.Position();
+        if (options.legacy && alignmentSize > LEGACY_MAX_READ_LENGTH) return;
+        if (!readLength)
+        {
+            // Workers only see their own contig, so they leave current_chrom unset and let the first counted read switch onto it
+            if (!worker) current_chrom = chromosomeMap(sequences[alignment.ChrID()].Name);
+            anchored = true;
+        }
+        if (alignmentSize > readLength) readLength = alignment.Length();
+        if (!options.legacy && readStringTag(alignment, options.chimericTag, trash))
+        {
+            if (alignment.FirstFlag()) counter.increment(MetricKey::ChimericFragmentsTag);
+            if(options.excludeChimeric) return;
+        }
+        if (alignment.PairedFlag() && alignment.MateMappedFlag() )
+        {
+            if (alignment.FirstFlag()) counter.increment(MetricKey::TotalMappedPairs);
+            if (alignment.ChrID() != alignment.MateChrID() || abs(alignment.Position() - alignment.MatePosition()) > options.chimericDistance || (options.legacy && alignment.ChrID() > 127))
+            {
+                if (alignment.FirstFlag()) counter.increment(MetricKey::ChimericFragmentsAuto);
+                if(options.excludeChimeric) return;
+            }
+        }
+        //Get tag data
+        int32_t mismatches = 0;
+        if (alignment.GetIntTag(NM, mismatches))
+        {
+            if (alignment.PairedFlag())
+            {
+                if (alignment.FirstFlag())
+                {
+                    counter.increment(MetricKey::End1MappedReads);
+                    counter.increment(MetricKey::End1Mismatches, mismatches);
+                    counter.increment(MetricKey::End1Bases, alignment.Length());
+                    if (alignment.DuplicateFlag())counter.increment(MetricKey::DuplicatePairs);
+                    else counter.increment(MetricKey::UniqueFragments);
+                }
+                else
+                {
+                    counter.increment(MetricKey::End2MappedReads);
+                    counter.increment(MetricKey::End2Mismatches, mismatches);
+                    counter.increment(MetricKey::End2Bases, alignment.Length());
+                }
+
+            }
+            counter.increment(MetricKey::MismatchedBases, mismatches);
+        }
+        counter.increment(MetricKey::TotalBases, alignment.Length());
+        //generic filter tags:
+        bool discard = false;
+        for (auto tag = options.tags.begin(); tag != options.tags.end(); ++tag)
+        {
+            if (alignment.GetTag(tag->c_str(), trash))
+            {
+                discard = true;
+                counter.increment("Filtered by tag: "+*tag);
+            }
+        }
+        if (discard) return;
+
+        // just rely on mapping quality to determine whether highQuality or not. // bhaas
+        bool highQuality = (alignment.MapQuality() >= options.mappingQuality);
+
+        //now record intron/exon metrics by intersecting filtered reads with the list of features
+        if (alignment.ChrID() < 0 || alignment.ChrID() >= static_cast<int32_t>(sequences.size()))
+        {
+            //The read had an unrecognized RefID (one not defined in the bam's header)
+            if (options.verbosity) cerr << "Unrecognized RefID on alignment: " << alignment.Qname() <<endl;
+            return;
+        }
+        classified = true;
+        if (alignment.PositionEnd() > classifiedEnd) classifiedEnd = alignment.PositionEnd();
+        if (highQuality) counter.increment(MetricKey::HighQualityReads);
+        else counter.increment(MetricKey::LowQualityReads);
+        counter.increment(MetricKey::ReadsUsedForCounts);
+        vector<Feature> blocks;
+        string chrName = sequences[alignment.ChrID()].Name;
+        chrom chr = chromosomeMap(chrName); //parse out a chromosome shorthand
+        if (chr != current_chrom)
+        {
+            const bool revisited = finishedContigs.count(chr);
+            if (!options.unsorted)
+            {
+                if (revisited) unsorted(alignment);
+                dropFeatures(features[current_chrom], baseCoverage, counts);
+                fragmentSizeFragmentTracker.clear();
+                gcContentFragmentTracker.clear();
+            }
+            finishedContigs.insert(current_chrom);
+            current_chrom = chr;
+            if (!revisited && fastaReader.isOpen() && !fastaReader.hasContig(chr)) {
+                cerr << "Warning: Provided Fasta does not contain chromosome " << chrName << ". No GC statistics will be collected for this chromosome" << endl;
+            }
+        }
+        else if (last_position > alignment.Position() && !options.unsorted) unsorted(alignment);
+        last_position = alignment.Position();
+        if (!options.unsorted)
+        {
+            // Any mate upstream of this read has already been seen, so first mates still waiting on one can be dropped
+            fragmentSizeFragmentTracker.evict(alignment.Position());
+            gcContentFragmentTracker.evict(alignment.Position());
+        }
+
+        //extract each cigar block from the alignment
+        unsigned int length = extractBlocks(alignment, blocks, chr, options.legacy);
+        counter.increment(MetricKey::AlignmentBlocks, blocks.size());
+        trimFeatures(alignment, features[chr], baseCoverage, counts); //drop features that appear before this read
+
+        //run the read through exon metrics
+        if (options.legacy) legacyExonAlignmentMetrics(LEGACY_SPLIT_DISTANCE, features, counter, counts, blocks, alignment, sequences, length, options.orientation, baseCoverage, highQuality, options.unpaired);
+        else {
+            double gcContent = exonAlignmentMetrics(features, counter, counts, blocks, alignment, sequences, length, options.orientation, baseCoverage, highQuality, options.unpaired, gcContentFragmentTracker, fastaReader);
+            if (gcContent != -1 && static_cast<unsigned int>(gcContent * 100.0) == 0) cout << "0:0\t" << alignment.Qname() <<"\t" << gcContent<< endl;
+            if (gcContent != -1) gcBins[static_cast<unsigned int>(gcContent * 100.0)]++;
+        }
+
+        //if fragment size calculations were requested, we still have samples to take, and the chromosome exists within the provided bed
+        if (highQuality && doFragmentSize && alignment.PairedFlag() && bedFeatures.find(chr) != bedFeatures.end())
+        {
+            const unsigned int remaining = doFragmentSize;
+            fragmentSizeMetrics(doFragmentSize, bedFeatures, fragmentSizeFragmentTracker, fragmentSizes, blocks, alignment, sequences);
+            if (worker && doFragmentSize < remaining) fragmentSamples.push_back(abs(alignment.InsertSize()));
+            if (!doFragmentSize && !worker && options.verbosity > 1) cout << "Completed taking fragment size samples" << endl;
+        }
+    }
+
+    void ReadProcessor::unsorted(Alignment &alignment)
+    {
+        if (options.requireSorted) throw unsortedException("The input bam is not coordinate sorted. Encountered at alignment: " + alignment.Qname());
+        cerr << "Warning: The input bam does not appear to be sorted. An unsorted bam will yield incorrect results" << endl;
+    }
+
+    void ReadProcessor::finish()
+    {
+        for (auto feats = features.begin(); feats != features.end(); ++feats)
+            if (feats->second.size()) dropFeatures(feats->second, baseCoverage, counts);
+    }
+
+    void ReadProcessor::merge(ReadProcessor &other)
+    {
+        counter.merge(other.counter);
+        counts.merge(other.counts);
+        bias.merge(other.bias);
+        baseCoverage.merge(other.baseCoverage);
+        for (unsigned int i = 0; i < 100; ++i) gcBins[i] += other.gcBins[i];
+        read_lengths.merge(other.read_lengths);
+        alignmentCount += other.alignmentCount;
+        if (other.readLength > readLength) readLength = other.readLength;
+        // Workers each sample independently. Merging in contig order keeps the same samples a serial run would have taken
+        for (auto sample = other.fragmentSamples.begin(); doFragmentSize && sample != other.fragmentSamples.end(); ++sample)
+        {
+            if (worker) fragmentSamples.push_back(*sample);
+            else fragmentSizes[*sample] += 1;
+            --doFragmentSize;
+            if (!doFragmentSize && !worker && options.verbosity > 1) cout << "Completed taking fragment size samples" << endl;
+        }
+    }
+
+    void ReadProcessor::save(ostream &stream) const
+    {
+        counter.save(stream);
+        counts.save(stream);
+        bias.save(stream);
+        baseCoverage.save(stream);
+        for (unsigned int i = 0; i < 100; ++i) writeBinary(stream, gcBins[i]);
+        read_lengths.save(stream);
+        writeBinary(stream, alignmentCount);
+        writeBinary(stream, readLength);
+        writeBinary(stream, fragmentSamples);
+    }
+
+    void ReadProcessor::load(istream &stream)
+    {
+        counter.load(stream);
+        counts.load(stream);
+        bias.load(stream);
+        baseCoverage.load(stream);
+        for (unsigned int i = 0; i < 100; ++i) readBinary(stream, gcBins[i]);
+        read_lengths.load(stream);
+        readBinary(stream, alignmentCount);
+        readBinary(stream, readLength);
+        readBinary(stream, fragmentSamples);
+    }
+
+    struct ContigJob {
+        // A run of reads from one contig: those which start within [begin, end)
+        int32_t tid; // HTS_IDX_NOCOOR for reads without coordinates
+        chrom chr;
+        int32_t begin, end;
+        coord nextStart; // Start of the first feature in the following chunk. Reads reaching it invalidate this chunk
+        bool first; // First chunk of the contig
+        FeatureList features, bedFeatures;
+        unique_ptr<ReadProcessor> result;
+        CoverageRows retired, dropped; // Coverage rows written while reading, and once the chunk was finished
+    };
+
+    // Cut a contig into chunks of roughly the target size, only at positions which no gene, exon, or BED interval spans
+    // Each cut is placed right after the furthest end seen so far, so every feature before it will have been trimmed by the first read after it
+    void splitContig(vector<ContigJob> &jobs, int32_t tid, chrom chr, int32_t length, const FeatureList &features, const FeatureList &bedFeatures, int32_t target)
+    {
+        jobs.emplace_back();
+        jobs.back().tid = tid;
+        jobs.back().chr = chr;
+        jobs.back().begin = 0;
+        jobs.back().first = true;
+        const bool split = bedFeatures.sorted(); // Unsorted lists are left in one piece
+        coord furthest = -1;
+        auto feat = features.begin();
+        auto bed = bedFeatures.begin();
+        while (feat != features.end() || bed != bedFeatures.end())
+        {
+            bool fromBed = feat == features.end() || (bed != bedFeatures.end() && bed->start < feat->start);
+            const Feature &current = fromBed ? *bed : *feat;
+            if (split && furthest >= 0 && current.start > furthest && furthest + 1 - jobs.back().begin >= target)
+            {
+                jobs.back().end = furthest + 1;
+                jobs.back().nextStart = current.start;
+                jobs.emplace_back();
+                jobs.back().tid = tid;
+                jobs.back().chr = chr;
+                jobs.back().begin = furthest + 1;
+                jobs.back().first = false;
+            }
+            if (current.end > furthest) furthest = current.end;
+            if (fromBed) jobs.back().bedFeatures.push_back(*(bed++));
+            else jobs.back().features.push_back(*(feat++));
+        }
+        jobs.back().end = length > furthest ? length : furthest + 1;
+        jobs.back().nextStart = numeric_limits<coord>::max();
+    }
+
+    bool readContigs(ReadProcessor &processor, const string &bamFilename, const QCOptions &options, unsigned int threads, const SeqLib::ThreadPool &decodePool, const vector<bool> &owned, vector<ContigResult> &results)
+    {
+        // Readers and fasta handles are opened up front, since opening them may register contigs in the (unsynchronized) chromosome map
+        vector<unique_ptr<SeqlibReader> > readers;
+        vector<unique_ptr<Fasta> > fastas;
+        for (unsigned int i = 0; i < threads; ++i)
+        {
+            readers.emplace_back(new SeqlibReader());
+            if (options.fastaPath.length()) readers.back()->addReference(options.fastaPath);
+            readers.back()->setThreadPool(decodePool);
+            if (!readers.back()->open(bamFilename)) return false;
+            fastas.emplace_back(new Fasta());
+#ifndef NO_FASTA
+            if (options.fastaPath.length())
+            {
+                string fastaPath = options.fastaPath;
+                fastas.back()->open(fastaPath);
+            }
+#endif
+        }
+        SeqLib::HeaderSequenceVector sequences = readers.front()->getHeader().GetHeaderSequenceVector();
+        try {
+            // Probe for an index. Without one, region queries are impossible and the caller should read serially
+            if (!readers.front()->setRegion(SeqLib::GenomicRegion(0, 0, 1))) return false;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        auto isOwned = [&owned](size_t idx) { return owned.empty() || owned[idx]; };
+
+        // Aim for several chunks per thread, so that threads which finish early can pick up the remaining work
+        unsigned long long totalLength = 0ull;
+        for (size_t i = 0; i < sequences.size(); ++i) if (isOwned(i)) totalLength += sequences[i].Length;
+        const int32_t target = static_cast<int32_t>(min<unsigned long long>(numeric_limits<int32_t>::max(), max<unsigned long long>(1ull, totalLength / (threads * CHUNKS_PER_THREAD))));
+        vector<ContigJob> jobs;
+        const FeatureList empty;
+        for (int32_t i = 0; i < static_cast<int32_t>(sequences.size()); ++i) if (isOwned(i))
+        {
+            chrom chr = chromosomeMap(sequences[i].Name);
+            auto feats = processor.features.find(chr);
+            auto bed = processor.bedFeatures.find(chr);
+            splitContig(jobs, i, chr, sequences[i].Length, feats != processor.features.end() ? feats->second : empty, bed != processor.bedFeatures.end() ? bed->second : empty, target);
+        }
+        if (isOwned(sequences.size()))
+        {
+            jobs.emplace_back();
+            jobs.back().tid = HTS_IDX_NOCOOR;
+            jobs.back().chr = 0;
+            jobs.back().begin = jobs.back().end = 0;
+            jobs.back().nextStart = numeric_limits<coord>::max();
+            jobs.back().first = true;
+        }
+
+        vector<size_t> pending(jobs.size());
+        for (size_t i = 0; i < pending.size(); ++i) pending[i] = i;
+        while (pending.size())
+        {
+            // Chunks are handed out from a shared queue, largest first, so that one big chunk doesn't finish last
+            stable_sort(pending.begin(), pending.end(), [&jobs](size_t a, size_t b) { return jobs[a].end - jobs[a].begin > jobs[b].end - jobs[b].begin; });
+            atomic<size_t> nextJob(0);
+            mutex failureLock;
+            exception_ptr failure = nullptr;
+            auto run = [&](unsigned int idx) {
+                try {
+                    for (size_t i = nextJob++; i < pending.size(); i = nextJob++)
+                    {
+                        {
+                            lock_guard<mutex> guard(failureLock);
+                            if (failure) return;
+                        }
+                        ContigJob &job = jobs[pending[i]];
+                        job.result.reset(new ReadProcessor(options, *fastas[idx], sequences));
+                        ReadProcessor &chunk = *job.result;
+                        if (job.tid >= 0)
+                        {
+                            chunk.features[job.chr] = job.features;
+                            chunk.counts.cover(job.features);
+                            if (processor.bedFeatures.count(job.chr)) chunk.bedFeatures[job.chr] = job.bedFeatures;
+                            // Later chunks pick up where the previous one left off, so warnings about the contig aren't repeated
+                            if (!job.first) chunk.current_chrom = job.chr;
+                        }
+                        chunk.doFragmentSize = processor.doFragmentSize;
+                        const string name = job.tid >= 0 ? sequences[job.tid].Name + ":" + to_string(job.begin + 1) + "-" + to_string(job.end) : string("(unplaced)");
+                        if (!readers[idx]->setRegion(SeqLib::GenomicRegion(job.tid, job.begin, job.tid >= 0 ? job.end : 0)))
+                            throw std::runtime_error("Unable to seek to " + name);
+                        // Reads are assigned to the chunk they start in. The last chunk of a contig takes everything after its start
+                        const bool lastChunk = job.nextStart == numeric_limits<coord>::max();
+                        Alignment alignment;
+                        while (readers[idx]->next(alignment))
+                            if (job.tid < 0 || (alignment.Position() >= job.begin && (lastChunk || alignment.Position() < job.end))) chunk.process(alignment);
+                        job.retired = chunk.baseCoverage.takeBuffer();
+                        chunk.finish();
+                        job.dropped = chunk.baseCoverage.takeBuffer();
+                        if (options.verbosity > 1) cout << "Finished " << name << "; Alignments processed: " << chunk.alignmentCount << endl;
+                    }
+                }
+                catch (...) {
+                    lock_guard<mutex> guard(failureLock);
+                    if (!failure) failure = current_exception();
+                }
+            };
+            vector<thread> pool;
+            for (unsigned int i = 0; i < threads && i < pending.size(); ++i) pool.push_back(thread(run, i));
+            for (auto t = pool.begin(); t != pool.end(); ++t) t->join();
+            if (failure) rethrow_exception(failure);
+
+            // A read which extends into the next chunk's features would have been counted against them in a serial run
+            // Fuse those chunks together and read them again
+            pending.clear();
+            for (size_t i = 0; i < jobs.size(); ++i)
+            {
+                const coord reach = jobs[i].result->classifiedEnd;
+                if (reach < jobs[i].nextStart) continue;
+                size_t last = i + 1;
+                while (jobs[last].nextStart <= reach) ++last;
+                if (options.verbosity > 1) cout << "Reads overlap the boundary after " << sequences[jobs[i].tid].Name << ":" << jobs[i].end << ". Merging chunks" << endl;
+                for (size_t j = i + 1; j <= last; ++j)
+                {
+                    jobs[i].features.append(jobs[j].features);
+                    jobs[i].bedFeatures.append(jobs[j].bedFeatures);
+                }
+                jobs[i].end = jobs[last].end;
+                jobs[i].nextStart = jobs[last].nextStart;
+                jobs.erase(jobs.begin() + i + 1, jobs.begin() + last + 1);
+                jobs[i].result.reset();
+                pending.push_back(i);
+            }
+        }
+
+        // Stitch the chunks of each contig back together
+        // The rows from each chunk follow each other directly. The only thing which varies is which rows are
+        // written while the contig is being read, and which are left until the contig is dropped
+        for (size_t first = 0; first < jobs.size();)
+        {
+            size_t last = first;
+            while (last + 1 < jobs.size() && !jobs[last + 1].first) ++last;
+            results.emplace_back();
+            ContigResult &contig = results.back();
+            contig.tid = jobs[first].tid;
+            contig.chr = jobs[first].chr;
+            contig.anchored = contig.classified = false;
+            contig.result.reset(new ReadProcessor(options, processor.getFastaReader(), sequences));
+            contig.result->doFragmentSize = processor.doFragmentSize;
+            size_t lastCounted = first;
+            for (size_t i = first; i <= last; ++i)
+            {
+                contig.anchored = contig.anchored || jobs[i].result->anchored;
+                if (jobs[i].result->classified)
+                {
+                    contig.classified = true;
+                    lastCounted = i;
+                }
+            }
+            for (size_t i = first; i <= last; ++i)
+            {
+                if (contig.classified && i < lastCounted)
+                {
+                    contig.retired += jobs[i].retired;
+                    contig.retired += jobs[i].dropped;
+                }
+                else if (contig.classified && i == lastCounted)
+                {
+                    contig.retired += jobs[i].retired;
+                    contig.dropped += jobs[i].dropped;
+                }
+                else
+                {
+                    contig.dropped += jobs[i].retired;
+                    contig.dropped += jobs[i].dropped;
+                }
+                contig.result->merge(*jobs[i].result);
+                jobs[i].result.reset();
+            }
+            first = last + 1;
+        }
+        return true;
+    }
+
+    void mergeContigs(ReadProcessor &processor, vector<ContigResult> &contigs)
+    {
+        // Merge the contigs in the order a serial run over the sorted bam would have produced them
+        // A serial run only drops a contig's remaining features once a read has been counted on the next contig
+        // The first contig with a mapped read is entered even if none of its reads get counted
+        long first = -1, last = -1;
+        for (size_t i = 0; i + 1 < contigs.size(); ++i) if (contigs[i].anchored)
+        {
+            first = i;
+            break;
+        }
+        vector<bool> visited(contigs.size(), false);
+        for (size_t i = 0; i + 1 < contigs.size(); ++i) if (contigs[i].classified || static_cast<long>(i) == first)
+        {
+            visited[i] = true;
+            last = i;
+        }
+        map<chrom, size_t> contigForChrom;
+        for (size_t i = 0; i < contigs.size(); ++i)
+        {
+            if (visited[i])
+            {
+                processor.baseCoverage.write(contigs[i].retired);
+                if (static_cast<long>(i) != last) processor.baseCoverage.write(contigs[i].dropped);
+            }
+            processor.merge(*contigs[i].result);
+            contigs[i].result.reset();
+            if (contigs[i].tid >= 0) contigForChrom[contigs[i].chr] = i;
+        }
+        // Finally, remaining features are dropped in chromosome order
+        for (auto feats = processor.features.begin(); feats != processor.features.end(); ++feats)
+        {
+            auto contig = contigForChrom.find(feats->first);
+            if (contig == contigForChrom.end())
+            {
+                if (feats->second.size()) dropFeatures(feats->second, processor.baseCoverage, processor.counts);
+                continue;
+            }
+            if (static_cast<long>(contig->second) == last || !visited[contig->second]) processor.baseCoverage.write(contigs[contig->second].dropped);
+            feats->second.clear();
+        }
+        processor.bedFeatures.clear();
+    }
+
+    bool processContigs(ReadProcessor &processor, const string &bamFilename, const QCOptions &options, unsigned int threads, const SeqLib::ThreadPool &decodePool)
+    {
+        vector<ContigResult> results;
+        if (!readContigs(processor, bamFilename, options, threads, decodePool, vector<bool>(), results)) return false;
+        mergeContigs(processor, results);
+        return true;
+    }
+
+    vector<bool> shardContigs(const SeqLib::HeaderSequenceVector &sequences, unsigned int shard, unsigned int shards)
+    {
+        // Longest contigs first, each onto the shard with the least sequence so far
+        vector<size_t> order(sequences.size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&sequences](size_t a, size_t b) { return sequences[a].Length > sequences[b].Length; });
+        vector<unsigned long long> load(shards, 0ull);
+        vector<bool> owned(sequences.size() + 1, false);
+        for (auto idx = order.begin(); idx != order.end(); ++idx)
+        {
+            const size_t target = min_element(load.begin(), load.end()) - load.begin();
+            load[target] += sequences[*idx].Length;
+            owned[*idx] = target == shard;
+        }
+        // Unplaced reads have no length to go by. They go to whichever shard ended up lightest
+        owned[sequences.size()] = static_cast<size_t>(min_element(load.begin(), load.end()) - load.begin()) == shard;
+        return owned;
+    }
+
+    const string PARTIAL_MAGIC = "RNASeQC partial";
+    const uint32_t PARTIAL_BYTE_ORDER = 0x01020304u;
+    const uint32_t PARTIAL_FORMAT = 5u;
+
+    void writePartial(const string &filename, PartialInfo &info, const vector<ContigResult> &results)
+    {
+        info.chromosomes.assign(chromosomes.size(), "");
+        for (auto entry = chromosomes.begin(); entry != chromosomes.end(); ++entry) info.chromosomes[entry->second - 1] = entry->first;
+        info.genes = geneList.size();
+        info.exons = exonList.size();
+        {
+            ostringstream settings;
+            writeBinary(settings, static_cast<int>(info.options.orientation));
+            writeBinary(settings, info.options.chimericDistance);
+            writeBinary(settings, info.options.fragmentSamples);
+            writeBinary(settings, info.options.mappingQuality);
+            writeBinary(settings, info.options.coverageMask);
+            writeBinary(settings, info.options.detectionThreshold);
+            writeBinary(settings, info.options.biasOffset);
+            writeBinary(settings, info.options.biasWindow);
+            writeBinary(settings, info.options.biasLength);
+            writeBinary(settings, info.options.tags);
+            writeBinary(settings, info.options.chimericTag);
+            writeBinary(settings, info.options.legacy);
+            writeBinary(settings, info.options.unpaired);
+            writeBinary(settings, info.options.excludeChimeric);
+            writeBinary(settings, info.options.outputCoverage);
+            writeBinary(settings, info.report.sampleName);
+            writeBinary(settings, info.report.labelled);
+            writeBinary(settings, info.report.rpkm);
+            writeBinary(settings, info.report.gcContent);
+            writeBinary(settings, info.fragmentBudget);
+            info.settings = settings.str();
+        }
+        ostringstream stream;
+        writeBinary(stream, PARTIAL_MAGIC);
+        writeBinary(stream, PARTIAL_BYTE_ORDER);
+        writeBinary(stream, PARTIAL_FORMAT);
+        writeBinary(stream, info.version);
+        writeBinary(stream, info.shard);
+        writeBinary(stream, info.shards);
+        writeBinary(stream, info.settings);
+        writeBinary(stream, info.chromosomes);
+        writeBinary(stream, static_cast<uint64_t>(info.sequences.size()));
+        for (auto sequence = info.sequences.begin(); sequence != info.sequences.end(); ++sequence)
+        {
+            writeBinary(stream, sequence->Name);
+            writeBinary(stream, static_cast<uint32_t>(sequence->Length));
+        }
+        writeBinary(stream, info.genes);
+        writeBinary(stream, info.exons);
+        writeBinary(stream, static_cast<uint64_t>(results.size()));
+        for (auto contig = results.begin(); contig != results.end(); ++contig)
+        {
+            writeBinary(stream, contig->tid);
+            writeBinary(stream, contig->anchored);
+            writeBinary(stream, contig->classified);
+            writeBinary(stream, contig->retired.genes);
+            writeBinary(stream, contig->retired.exons);
+            writeBinary(stream, contig->dropped.genes);
+            writeBinary(stream, contig->dropped.exons);
+            contig->result->save(stream);
+        }
+
+        const string data = stream.str();
+        gzFile output = gzopen(filename.c_str(), "wb");
+        if (output == nullptr) throw fileException("Unable to open partial output file: " + filename);
+        for (size_t offset = 0; offset < data.size();)
+        {
+            const unsigned int length = static_cast<unsigned int>(min<size_t>(data.size() - offset, 1u << 30));
+            if (gzwrite(output, data.data() + offset, length) != static_cast<int>(length))
+            {
+                gzclose(output);
+                throw fileException("Unable to write partial output file: " + filename);
+            }
+            offset += length;
+        }
+        if (gzclose(output) != Z_OK) throw fileException("Unable to write partial output file: " + filename);
+    }
+
+    string decompressPartial(const string &filename)
+    {
+        gzFile input = gzopen(filename.c_str(), "rb");
+        if (input == nullptr) throw fileException("Unable to open partial: " + filename);
+        string data;
+        vector<char> buffer(1u << 20);
+        int length;
+        while ((length = gzread(input, buffer.data(), buffer.size())) > 0) data.append(buffer.data(), length);
+        gzclose(input);
+        if (length < 0) throw fileException("Unable to read partial: " + filename);
+        return data;
+    }
+
+    void readPartialHeader(istream &stream, PartialInfo &info)
+    {
+        string magic;
+        uint32_t byteOrder, format;
+        try {
+            readBinary(stream, magic);
+        }
+        catch (serializationException &e) {
+            magic.clear();
+        }
+        if (magic != PARTIAL_MAGIC) throw serializationException("Not an RNA-SeQC partial");
+        readBinary(stream, byteOrder);
+        if (byteOrder != PARTIAL_BYTE_ORDER) throw serializationException("Partial was written on a machine with a different byte order");
+        readBinary(stream, format);
+        if (format != PARTIAL_FORMAT) throw serializationException("Unsupported partial format version " + to_string(format));
+        readBinary(stream, info.version);
+        readBinary(stream, info.shard);
+        readBinary(stream, info.shards);
+        readBinary(stream, info.settings);
+        {
+            istringstream settings(info.settings);
+            int orientation;
+            readBinary(settings, orientation);
+            info.options.orientation = static_cast<Strand>(orientation);
+            readBinary(settings, info.options.chimericDistance);
+            readBinary(settings, info.options.fragmentSamples);
+            readBinary(settings, info.options.mappingQuality);
+            readBinary(settings, info.options.coverageMask);
+            readBinary(settings, info.options.detectionThreshold);
+            readBinary(settings, info.options.biasOffset);
+            readBinary(settings, info.options.biasWindow);
+            readBinary(settings, info.options.biasLength);
+            readBinary(settings, info.options.tags);
+            readBinary(settings, info.options.chimericTag);
+            readBinary(settings, info.options.legacy);
+            readBinary(settings, info.options.unpaired);
+            readBinary(settings, info.options.excludeChimeric);
+            readBinary(settings, info.options.outputCoverage);
+            readBinary(settings, info.report.sampleName);
+            readBinary(settings, info.report.labelled);
+            readBinary(settings, info.report.rpkm);
+            readBinary(settings, info.report.gcContent);
+            readBinary(settings, info.fragmentBudget);
+            info.options.verbosity = 0;
+            info.options.fastaPath = "";
+            info.options.requireSorted = info.options.unsorted = false;
+        }
+        readBinary(stream, info.chromosomes);
+        uint64_t size;
+        readBinary(stream, size);
+        info.sequences.clear();
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            string name;
+            uint32_t length;
+            readBinary(stream, name);
+            readBinary(stream, length);
+            info.sequences.push_back(SeqLib::HeaderSequence(name, length));
+        }
+        readBinary(stream, info.genes);
+        readBinary(stream, info.exons);
+    }
+
+    void readPartialContigs(istream &stream, const QCOptions &options, Fasta &fasta, const SeqLib::HeaderSequenceVector &sequences, vector<ContigResult> &results)
+    {
+        uint64_t size;
+        readBinary(stream, size);
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            results.emplace_back();
+            ContigResult &contig = results.back();
+            readBinary(stream, contig.tid);
+            if (contig.tid != HTS_IDX_NOCOOR && (contig.tid < 0 || contig.tid >= static_cast<int32_t>(sequences.size())))
+                throw serializationException("Invalid contig ID " + to_string(contig.tid));
+            contig.chr = contig.tid >= 0 ? chromosomeMap(sequences[contig.tid].Name) : 0;
+            readBinary(stream, contig.anchored);
+            readBinary(stream, contig.classified);
+            readBinary(stream, contig.retired.genes);
+            readBinary(stream, contig.retired.exons);
+            readBinary(stream, contig.dropped.genes);
+            readBinary(stream, contig.dropped.exons);
+            contig.result.reset(new ReadProcessor(options, fasta, sequences));
+            contig.result->load(stream);
+        }
+    }
+
+    void processPipelined(ReadProcessor &processor, SeqlibReader &bam, const QCOptions &options)
+    {
+        BatchQueue queue(PIPELINE_DEPTH, PIPELINE_BATCH_SIZE);
+        exception_ptr failure = nullptr;
+        thread decoder([&]() {
+            try {
+                for (vector<Alignment> *batch = queue.acquire(); batch != nullptr; batch = queue.acquire())
+                {
+                    size_t count = 0;
+                    while (count < batch->size() && bam.next((*batch)[count])) ++count;
+                    queue.publish(count);
+                    if (count < batch->size()) break; // End of file
+                }
+            }
+            catch (...) {
+                failure = current_exception();
+            }
+            queue.close();
+        });
+        try {
+            time_t start, report_time;
+            time(&start);
+            time(&report_time);
+            size_t count = 0;
+            for (vector<Alignment> *batch = queue.next(count); batch != nullptr; batch = queue.next(count))
+            {
+                for (size_t i = 0; i < count; ++i) processor.process((*batch)[i]);
+                queue.release();
+                //print an update to stdout no more than once every 10 seconds
+                time_t now;
+                time(&now);
+                if (difftime(now, report_time) >= 10)
+                {
+                    time(&report_time);
+                    if (options.verbosity > 1) cout << "Time elapsed: " << difftime(now, start) << "; Alignments processed: " << processor.alignmentCount << endl;
+                }
+            }
+        }
+        catch (...) {
+            queue.cancel();
+            decoder.join();
+            throw;
+        }
+        decoder.join();
+        if (failure) rethrow_exception(failure);
+        processor.finish();
+    }
+
+    bool readStringTag(Alignment& alignment, string tagName, string& result) {
+        if (alignment.GetZTag(tagName, result)) return true;
+
+        const auto b = alignment.shared_pointer();
+
+        //Copied (with slight modification) from https://github.com/walaj/SeqLib/blob/master/src/BamRecord.cpp#L499
+        uint8_t* tagPtr = bam_aux_get(b.get(),tagName.c_str());
+        if (!tagPtr)
+          return false;
+
+        int type = *tagPtr;
+        if (type != 'A')
+          return false;
+
+        char tagContents = bam_aux2A(tagPtr);
+        if (!tagContents)
+          return false;
+        result = "";
+        result += tagContents;
+        return true;
+    }
+}
@@ -0,0 +1,149 @@
+//
+//  Engine.h
+//  RNA-SeQC
+//
+//  Runs alignments through the metrics, either serially or one contig per worker thread
+//  Also reads and writes the partial results of a sharded run
+//
+
+#ifndef Engine_h
+#define Engine_h
+
+#include "BamReader.h"
+#include "Expression.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <memory>
+#include <iostream>
+
+namespace rnaseqc {
+
+    const unsigned int LEGACY_MAX_READ_LENGTH = 100000u;
+    const int LEGACY_SPLIT_DISTANCE = 100;
+    const size_t PIPELINE_BATCH_SIZE = 4096u; // Alignments per batch handed from the decoder to the classifier
+    const size_t PIPELINE_DEPTH = 4u; // Batches in flight between the decoder and the classifier
+    const unsigned int CHUNKS_PER_THREAD = 8u; // Target number of chunks per thread when splitting contigs for --threads
+
+    struct QCOptions {
+        // Command line settings which affect how each alignment is counted
+        Strand orientation;
+        int chimericDistance;
+        unsigned int fragmentSamples, mappingQuality, coverageMask, detectionThreshold;
+        int verbosity, biasOffset, biasWindow;
+        unsigned long biasLength;
+        std::vector<std::string> tags;
+        std::string chimericTag, fastaPath;
+        bool legacy, unpaired, excludeChimeric, outputCoverage;
+        bool requireSorted; // Abort on unsorted input instead of warning
+        bool unsorted; // Features are indexed so reads can arrive in any order. Coverage is computed at the end
+    };
+
+    struct unsortedException : public std::exception {
+        std::string error;
+        unsortedException(std::string msg) : error(msg) {};
+    };
+
+    struct ReportOptions {
+        // Command line settings which only affect the final reports
+        std::string sampleName;
+        bool labelled, rpkm, gcContent; // labelled: The sample name was provided, and is used as the column header in the gct files
+    };
+
+    class ReadProcessor {
+        // Holds all of the state accumulated while reading a stream of alignments
+        // The main processor reads the whole bam. Workers each read one contig and are merged back in afterwards
+        const QCOptions &options;
+        Fasta &fastaReader;
+        SeqLib::HeaderSequenceVector sequences;
+        bool worker; // Workers read a single contig and keep their fragment size samples in order, so the total can be capped after merging
+        ReadProcessor(const ReadProcessor&) = delete;
+        void unsorted(Alignment&); // Warns about, or rejects, an out of order read
+    public:
+        std::map<chrom, FeatureList> features, bedFeatures; //chr -> genes/exons from the GTF, and exons from the BED
+        BiasCounter bias;
+        BaseCoverage baseCoverage;
+        Metrics counter;
+        FeatureCounts counts;
+        unsigned int doFragmentSize; //count of remaining fragment size samples to record
+        MateTracker fragmentSizeFragmentTracker, gcContentFragmentTracker;
+        std::map<long long, unsigned long> fragmentSizes;
+        std::vector<long long> fragmentSamples; // Only filled by workers
+        unsigned long gcBins[100];
+        LengthHistogram read_lengths;
+        unsigned long long alignmentCount;
+        int readLength; //longest read encountered so far
+        chrom current_chrom;
+        int32_t last_position; // For some reason, htslib has decided that this will be the datatype used for positions
+        bool anchored; // A mapped read has been seen (which sets current_chrom on the main processor)
+        bool classified; // At least one read reached the intron/exon counting stage
+        coord classifiedEnd; // Furthest end of any read which reached the intron/exon counting stage
+        std::set<chrom> finishedContigs; // Contigs which have been left for another. Seeing them again means the input isn't sorted
+
+        // Writes coverage to the provided file (if enabled), and exon CVs to the second file (with a GC column if enabled)
+        ReadProcessor(const QCOptions&, Fasta&, const SeqLib::HeaderSequenceVector&, const std::string&, bool, const std::string&, bool);
+        // Buffers coverage for a later ordered merge. Counters only cover the features given to the worker (see FeatureCounts::cover)
+        ReadProcessor(const QCOptions&, Fasta&, const SeqLib::HeaderSequenceVector&);
+
+        void process(Alignment&);
+        void finish(); // Computes coverage for every feature left in the window
+        void merge(ReadProcessor&); // Adds the results of a worker. Coverage rows are not transferred
+        void save(std::ostream&) const; // Saves everything the reports need from a finished worker
+        void load(std::istream&);
+        Fasta& getFastaReader() const {
+            return this->fastaReader;
+        }
+    };
+
+    struct ContigResult {
+        // Everything recorded while reading one contig, kept until it can be merged in header order
+        int32_t tid; // HTS_IDX_NOCOOR for reads without coordinates
+        chrom chr;
+        bool anchored, classified;
+        CoverageRows retired, dropped; // Coverage rows written while reading, and once the contig was finished
+        std::unique_ptr<ReadProcessor> result;
+    };
+
+    struct PartialInfo {
+        // Describes the run which produced a partial result file
+        std::string version, settings; // settings holds the serialized options. Partials can only be merged if they match exactly
+        unsigned int shard, shards, fragmentBudget;
+        QCOptions options;
+        ReportOptions report;
+        std::vector<std::string> chromosomes; // Chromosome names, in order of their internal IDs
+        SeqLib::HeaderSequenceVector sequences;
+        uint64_t genes, exons; // Sanity check that the same annotation is used to merge
+    };
+
+    bool readStringTag(Alignment&, std::string, std::string&);
+
+    // Reads the whole bam on a decoder thread while the calling thread classifies the previous batch of reads
+    // Works on any input, including unindexed or streamed files
+    void processPipelined(ReadProcessor&, SeqlibReader&, const QCOptions&);
+
+    // Reads an indexed bam on several threads, then merges the results into the processor as if the file was read serially
+    // Contigs are split into chunks wherever no feature spans the gap between them
+    // Returns false (having done nothing) if the bam has no usable index
+    // All readers share the given decompression pool (which may be empty)
+    bool processContigs(ReadProcessor&, const std::string&, const QCOptions&, unsigned int, const SeqLib::ThreadPool&);
+
+    // The two halves of processContigs
+    // readContigs only reads the contigs flagged in the mask (indexed by tid, with unplaced reads last). An empty mask reads everything
+    // mergeContigs requires results for every contig, in header order
+    bool readContigs(ReadProcessor&, const std::string&, const QCOptions&, unsigned int, const SeqLib::ThreadPool&, const std::vector<bool>&, std::vector<ContigResult>&);
+    void mergeContigs(ReadProcessor&, std::vector<ContigResult>&);
+
+    // Assigns whole contigs to shards, balancing total contig length. Returns the mask of contigs for the given (0-based) shard
+    std::vector<bool> shardContigs(const SeqLib::HeaderSequenceVector&, unsigned int, unsigned int);
+
+    // Partial results are gzipped binary files. The chromosome list and annotation size are filled in from the loaded GTF
+    void writePartial(const std::string&, PartialInfo&, const std::vector<ContigResult>&);
+    std::string decompressPartial(const std::string&);
+    void readPartialHeader(std::istream&, PartialInfo&);
+    // Appends the contigs stored in the partial, each loaded into a new worker
+    void readPartialContigs(std::istream&, const QCOptions&, Fasta&, const SeqLib::HeaderSequenceVector&, std::vector<ContigResult>&);
+}
+
+#endif /* Engine_h */
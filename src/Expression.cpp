@@ -66,54 +66,75 @@ namespace rnaseqc {
         return alignedSize;
     }
     
-    void trimFeatures(Alignment &alignment, list<Feature> &features)
+    void trimFeatures(Alignment &alignment, FeatureList &features)
     {
         //trim intervals upstream of this block
         //Since alignments are sorted, if an alignment occurs beyond any features, these features can be dropped
-        while (!features.empty() && features.front().end < alignment.Position())
-        {
-            if (features.front().type == FeatureType::Gene) fragmentTracker.erase(features.front().feature_id);
-            features.pop_front();
-        }
+        features.trim(alignment.Position(), [](const Feature&) {});
     }
     
-    void trimFeatures(Alignment &alignment, list<Feature> &features, BaseCoverage &coverage)
+    void trimFeatures(Alignment &alignment, FeatureList &features, BaseCoverage &coverage, FeatureCounts &counts)
     {
         //trim intervals upstream of this block
         //Since alignments are sorted, if an alignment occurs beyond any features, these features can be dropped
-        while (!features.empty() && features.front().end < alignment.Position())
-        {
-            if (features.front().type == FeatureType::Gene)
+        features.trim(alignment.Position(), [&](const Feature &feature) {
+            if (feature.type == FeatureType::Gene)
             {
-                coverage.compute(features.front()); //Once this gene leaves the search window, compute coverage
-                fragmentTracker.erase(features.front().feature_id);
+                coverage.compute(feature); //Once this gene leaves the search window, compute coverage
+                counts.fragmentTracker[feature.feature_index].release();
             }
-            features.pop_front();
-        }
+        });
     }
     
     // After we switch chromosomes, just drop all the remaining features from the previous chromosome
-    void dropFeatures(std::list<Feature> &features, BaseCoverage &coverage)
+    void dropFeatures(FeatureList &features, BaseCoverage &coverage, FeatureCounts &counts)
     {
         for (auto feat = features.begin(); feat != features.end(); ++feat) if (feat->type == FeatureType::Gene) {
             coverage.compute(*feat);
-            fragmentTracker.erase(feat->feature_id);
+            counts.fragmentTracker[feat->feature_index].release();
         }
         features.clear();
     }
     
-    // Get the list of features that this aligned segment intersects
-    list<Feature>* intersectBlock(Feature &block, list<Feature> &features)
+    FragmentMateEntry* MateTracker::find(uint64_t name)
     {
-        list<Feature> *output = new list<Feature>();
-        //since we've trimmed the beginning of the features, we start from the new beginning here
-        //There should be little overhead (at most ~1 gene worth of exons on either end of the block)
-        for (auto current = features.begin(); current != features.end() && current->start <= block.end; ++current)
+        auto entry = this->entries.find(name);
+        return entry == this->entries.end() ? nullptr : &entry->second;
+    }
+
+    void MateTracker::insert(uint64_t name, const FragmentMateEntry &entry, coord matePosition)
+    {
+        this->entries[name] = entry;
+        this->expiry.push(std::make_pair(matePosition, name));
+    }
+
+    void MateTracker::erase(uint64_t name)
+    {
+        this->entries.erase(name); // The expiry queue is left alone. Evicting a name which is already gone does nothing
+    }
+
+    void MateTracker::evict(coord position)
+    {
+        while (!this->expiry.empty() && this->expiry.top().first < position)
         {
-            //check that the current feature actually intersects the current block of the current alignment
-            if (intersectInterval(block, *current)) output->push_back(*current);
+            this->entries.erase(this->expiry.top().second);
+            this->expiry.pop();
         }
-        return output;
+    }
+
+    void MateTracker::clear()
+    {
+        std::unordered_map<uint64_t, FragmentMateEntry>().swap(this->entries);
+        decltype(this->expiry)().swap(this->expiry);
+    }
+
+    // Get the list of features that this aligned segment intersects
+    // The result is owned by the feature list and reused by its next intersection
+    const vector<const Feature*>& intersectBlock(const Feature &block, FeatureList &features)
+    {
+        //since we've trimmed the beginning of the features, only the active window is searched
+        //There should be little overhead (at most ~1 gene worth of exons on either end of the block)
+        return features.intersect(block);
     }
     
     Strand feature_strand(Alignment &alignment, Strand orientation)
@@ -126,7 +147,7 @@ namespace rnaseqc {
     
     // Legacy version of standard alignment metrics
     // This code is really inefficient, but it's a faithful replication of the original code
-    void legacyExonAlignmentMetrics(unsigned int SPLIT_DISTANCE, map<chrom, list<Feature>> &features, Metrics &counter, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable, unsigned int length, Strand orientation, BaseCoverage &baseCoverage, const bool highQuality, const bool singleEnd)
+    void legacyExonAlignmentMetrics(unsigned int SPLIT_DISTANCE, map<chrom, FeatureList> &features, Metrics &counter, FeatureCounts &counts, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable, unsigned int length, Strand orientation, BaseCoverage &baseCoverage, const bool highQuality, const bool singleEnd)
     {
         string chrName = sequenceTable[alignment.ChrID()].Name;
         chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand name
@@ -145,17 +166,17 @@ namespace rnaseqc {
         current.start = alignment.Position()+1; //0-based + 1 == 1-based
         current.end = alignment.PositionEnd(); //0-based, open == 1-based, closed
         
-        list<Feature> *results = intersectBlock(current, features[chr]);
+        const vector<const Feature*> &results = intersectBlock(current, features[chr]);
         
         vector<set<string> > genes; //each set is the set of genes intersected by the current block (one set per block)
         bool intragenic = false, transcriptPlus = false, transcriptMinus = false, ribosomal = false, doExonMetrics = false, exonic = false, legacyJunction = false, legacyNotExonic = false; //various booleans for keeping track of the alignment
         bool legacyNotSplit = false; //Legacy bug to override a read being split
         Strand read_strand = feature_strand(alignment, orientation);
-        for (auto result = results->begin(); result != results->end(); ++result)
+        for (auto hit = results.begin(); hit != results.end(); ++hit)
         {
-            Feature exon;
+            const Feature *result = *hit, *exon = nullptr;
             bool legacyFoundExon = false, legacyFoundGene = false, legacyTranscriptIntron = false, legacyTranscriptExon = false;
-            map<string, float> legacySplitDosage;
+            map<unsigned int, float> legacySplitDosage;
             legacyNotSplit = false;
             if (result->type == FeatureType::Gene)
             {
@@ -175,14 +196,15 @@ namespace rnaseqc {
                     // No condition. just a scope to keep things clean
                     {
                         legacyFoundGene = true;
-                        for (auto ex = results->begin(); ex != results->end() && !firstexon ; ++ex)
+                        for (auto exHit = results.begin(); exHit != results.end() && !firstexon ; ++exHit)
                         {
-                            if (ex->type == FeatureType::Exon && ex->gene_id == result->gene_id && intersectInterval(*ex, *block)  )
+                            const Feature *ex = *exHit;
+                            if (ex->type == FeatureType::Exon && ex->gene_index == result->gene_index && intersectInterval(*ex, *block)  )
                             {
                                 if (result->ribosomal) ribosomal = true;
                                 if (partialIntersect(*ex, *block) == (block->end - block->start))
                                 {
-                                    exon = *ex;
+                                    exon = ex;
                                     legacyTranscriptExon = true;
                                     firstexon = true;
                                     legacyFoundExon=true; //should this be part of the loop condition?  look into overlapsIntronp
@@ -199,7 +221,7 @@ namespace rnaseqc {
                         {
                             if (legacyFoundExon)
                             {
-                                legacySplitDosage[exon.feature_id] += (float) (block->end - block->start) / (float) alignment.Length();//length;
+                                legacySplitDosage[exon->feature_index] += (float) (block->end - block->start) / (float) alignment.Length();//length;
                             }
                             else legacyNotSplit = true;
                         }
@@ -216,24 +238,20 @@ namespace rnaseqc {
                         {
                             for (auto coverage = legacySplitDosage.begin(); coverage != legacySplitDosage.end(); ++coverage)
                             {
-                                exonCounts[coverage->first] += coverage->second;
+                                counts.exonCounts[coverage->first] += coverage->second;
                                 //                        cout << "\t" << coverage->first << " " << coverage->second;
                             }
                         }
                         else
                         {
                             //If read was not detected as split or the legacy bug changed it to unsplit, only record last exon
-                            exonCounts[exon.feature_id] += 1.0;
+                            counts.exonCounts[exon->feature_index] += 1.0;
                             //                    cout << "\t" << exon.feature_id<< " 1.0";
                         }
-                        geneCounts[exon.gene_id] += 1.0;
-                        if (fragmentTracker[exon.gene_id].count(alignment.Qname()) == 0)
-                        {
-                            fragmentTracker[exon.gene_id].insert(alignment.Qname());
-                            geneFragmentCounts[exon.gene_id]++;
-                        }
-                        if (!alignment.DuplicateFlag()) uniqueGeneCounts[exon.gene_id]++;
-                        baseCoverage.commit(exon.gene_id);
+                        counts.geneCounts[exon->gene_index] += 1.0;
+                        if (counts.fragmentTracker[exon->gene_index].insert(readFingerprint(alignment.Qname()))) counts.geneFragmentCounts[exon->gene_index]++;
+                        if (!alignment.DuplicateFlag()) counts.uniqueGeneCounts[exon->gene_index]++;
+                        baseCoverage.commit(exon->gene_index);
                     }
                     doExonMetrics = true;
                 }
@@ -243,61 +261,60 @@ namespace rnaseqc {
             
         }
         //    cout << endl;
-        delete results; //clean up dynamic allocation
         
         if (legacyNotExonic || legacyJunction || !exonic) //a.k.a: No exons were detected at all on any block of the read
         {
             if (intragenic)
             {
-                counter.increment("Intronic Reads");
-                counter.increment("Intragenic Reads");
+                counter.increment(MetricKey::IntronicReads);
+                counter.increment(MetricKey::IntragenicReads);
                 if (highQuality){
-                    counter.increment("HQ Intronic Reads");
-                    counter.increment("HQ Intragenic Reads");
+                    counter.increment(MetricKey::HQIntronicReads);
+                    counter.increment(MetricKey::HQIntragenicReads);
                 }
             }
             else
             {
-                counter.increment("Intergenic Reads");
-                if (highQuality) counter.increment("HQ Intergenic Reads");
+                counter.increment(MetricKey::IntergenicReads);
+                if (highQuality) counter.increment(MetricKey::HQIntergenicReads);
             }
         }
         else if (doExonMetrics && !legacyJunction && !legacyNotExonic) //if exons were detected and at least one exon ended up being collected, we count this as exonic
         {
-            counter.increment("Exonic Reads");
-            counter.increment("Intragenic Reads");
+            counter.increment(MetricKey::ExonicReads);
+            counter.increment(MetricKey::IntragenicReads);
             if (highQuality)
             {
-                counter.increment("HQ Exonic Reads");
-                counter.increment("HQ Intragenic Reads");
+                counter.increment(MetricKey::HQExonicReads);
+                counter.increment(MetricKey::HQIntragenicReads);
             }
-            if (split && !legacyNotSplit) counter.increment("Split Reads");
+            if (split && !legacyNotSplit) counter.increment(MetricKey::SplitReads);
         }
         else if (intragenic)
         {
             //It's unclear how to properly classify these reads
             //However, the legacy tool falls back on reads being exonic
-            counter.increment("Exonic Reads");
-            counter.increment("Intragenic Reads");
+            counter.increment(MetricKey::ExonicReads);
+            counter.increment(MetricKey::IntragenicReads);
             if (highQuality)
             {
-                counter.increment("HQ Exonic Reads");
-                counter.increment("HQ Intragenic Reads");
+                counter.increment(MetricKey::HQExonicReads);
+                counter.increment(MetricKey::HQIntragenicReads);
             }
         }
-        if (ribosomal) counter.increment("rRNA Reads");
+        if (ribosomal) counter.increment(MetricKey::RRNAReads);
         //also record strandedness counts
         if ((transcriptMinus ^ transcriptPlus) && (singleEnd || alignment.PairedFlag()))
         {
             if (singleEnd || alignment.FirstFlag())
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
-                else transcriptPlus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(MetricKey::End1Sense) : counter.increment(MetricKey::End1Antisense);
+                else transcriptPlus ? counter.increment(MetricKey::End1Sense) : counter.increment(MetricKey::End1Antisense);
             }
             else
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
-                else transcriptPlus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(MetricKey::End2Sense) : counter.increment(MetricKey::End2Antisense);
+                else transcriptPlus ? counter.increment(MetricKey::End2Sense) : counter.increment(MetricKey::End2Antisense);
             }
         }
         baseCoverage.reset();
@@ -305,11 +322,11 @@ namespace rnaseqc {
     
     // New version of exon metrics
     // More efficient and less buggy
-    double exonAlignmentMetrics(map<chrom, list<Feature>> &features, Metrics &counter,
+    double exonAlignmentMetrics(map<chrom, FeatureList> &features, Metrics &counter, FeatureCounts &counts,
                                 vector<Feature> &blocks, Alignment &alignment,
                                 SeqLib::HeaderSequenceVector &sequenceTable, unsigned int length,
                                 Strand orientation, BaseCoverage &baseCoverage, const bool highQuality,
-                                const bool singleEnd, map<string, FragmentMateEntry> &fragments, Fasta &fastaReader)
+                                const bool singleEnd, MateTracker &fragments, Fasta &fastaReader)
     {
         string chrName = sequenceTable[alignment.ChrID()].Name;
         chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand name
@@ -319,21 +336,22 @@ namespace rnaseqc {
         current.start = alignment.Position()+1; //0-based + 1 == 1-based
         current.end = alignment.PositionEnd(); //0-based, open == 1-based, closed
         
-        vector<set<string> > genes; //each set is the set of genes intersected by the current block (one set per block)
-        set<string> alignedExons; // Record of all aligned exons (make sure all blocks align to same exon for gc content)
-        Collector exonCoverageCollector(&exonCounts); //Collects coverage counts for later (counts may be discarded)
+        vector<set<unsigned int> > genes; //each set is the set of genes intersected by the current block (one set per block)
+        set<unsigned int> alignedExons; // Record of all aligned exons (make sure all blocks align to same exon for gc content)
+        Collector exonCoverageCollector(&counts.exonCounts); //Collects coverage counts for later (counts may be discarded)
         bool intragenic = false, transcriptPlus = false, transcriptMinus = false, ribosomal = false, doExonMetrics = false, exonic = false; //various booleans for keeping track of the alignment
         
         Strand read_strand = feature_strand(alignment, orientation);
 
-        map<string, float> gene_to_block_overlap_size;
+        map<unsigned int, float> gene_to_block_overlap_size;
         
         for (auto block = blocks.begin(); block != blocks.end(); ++block)
         {
-            genes.push_back(set<string>()); //create a new set for this block
-            list<Feature> *results = intersectBlock(*block, features[chr]); //grab the list of intersecting features
-            for (auto result = results->begin(); result != results->end(); ++result)
+            genes.push_back(set<unsigned int>()); //create a new set for this block
+            const vector<const Feature*> &results = intersectBlock(*block, features[chr]); //grab the list of intersecting features
+            for (auto hit = results.begin(); hit != results.end(); ++hit)
             {
+                const Feature *result = *hit;
                 if (read_strand != Strand::Unknown && read_strand != result->strand) continue;
                 if (result->strand == Strand::Forward) transcriptPlus = true;
                 else if (result->strand == Strand::Reverse) transcriptMinus = true;
@@ -342,18 +360,18 @@ namespace rnaseqc {
                 {
                     exonic = true;
                     int intersectionSize = partialIntersect(*result, *block);
-                    gene_to_block_overlap_size[result->gene_id] += intersectionSize;
+                    gene_to_block_overlap_size[result->gene_index] += intersectionSize;
                     
                     //check that this block fully overlaps the feature
                     //(if any bases of the block don't overlap, then the read is discarded)
                     if (intersectionSize == block->end - block->start)
                     {
                         //store the exon split dosage coverage in the collector for now
-                        genes.rbegin()->insert(result->gene_id);
+                        genes.rbegin()->insert(result->gene_index);
                         double tmp = static_cast<double>(intersectionSize) / length;
-                        exonCoverageCollector.add(result->gene_id, result->feature_id, tmp);
+                        exonCoverageCollector.add(result->gene_index, result->feature_index, tmp);
                         baseCoverage.add(*result, block->start, block->end); //provisionally add per-base coverage to this gene
-                        alignedExons.insert(result->feature_id);
+                        alignedExons.insert(result->feature_index);
                     }
                     
                 }
@@ -365,7 +383,6 @@ namespace rnaseqc {
                 }
                 if (result->ribosomal) ribosomal = true;
             }
-            delete results; //clean up dynamic allocation
         } // end of foreach block
         
         if (genes.size() >= 1) // if any alignment block (so if read was mapped)
@@ -373,7 +390,7 @@ namespace rnaseqc {
             //if there was more than one block, iterate through each block's set of genes and intersect them
             //In the end, we only care about genes that are common to each block
             //In theory, there's only one gene per block (in most cases) but I won't limit us on that assumption
-            set<string> last = genes.front();
+            set<unsigned int> last = genes.front();
 
             /*
             
@@ -391,15 +408,15 @@ namespace rnaseqc {
 
             // new gene selection logic (bhaas)
             if (gene_to_block_overlap_size.size() > 0) {
-                string gene_max_overlap;
+                // Ties go to the first gene ID in alphabetical order. If nothing overlaps, NO_GENE still marks the read as exonic
+                unsigned int gene_max_overlap = NO_GENE;
                 int max_overlap = 0;
                 for (auto gene = gene_to_block_overlap_size.begin(); gene != gene_to_block_overlap_size.end(); ++gene) {
-                    string gene_id = gene->first;
                     int overlap = gene->second;
 
-                    if (overlap > max_overlap) {
+                    if (overlap > max_overlap || (overlap == max_overlap && overlap > 0 && geneName(gene->first) < geneName(gene_max_overlap))) {
                         max_overlap = overlap;
-                        gene_max_overlap = gene_id;
+                        gene_max_overlap = gene->first;
                     }
                 }
                 last.insert(gene_max_overlap);
@@ -413,13 +430,9 @@ namespace rnaseqc {
                 if (highQuality) {
                     if (exonCoverageCollector.queryGene(*gene))
                     {
-                        geneCounts[*gene]++;
-                        if (fragmentTracker[*gene].count(alignment.Qname()) == 0)
-                        {
-                            fragmentTracker[*gene].insert(alignment.Qname());
-                            geneFragmentCounts[*gene]++;
-                        }
-                        if (!alignment.DuplicateFlag()) uniqueGeneCounts[*gene]++;
+                        counts.geneCounts[*gene]++;
+                        if (counts.fragmentTracker[*gene].insert(readFingerprint(alignment.Qname()))) counts.geneFragmentCounts[*gene]++;
+                        if (!alignment.DuplicateFlag()) counts.uniqueGeneCounts[*gene]++;
                     }
                     exonCoverageCollector.collect(*gene); //collect and keep exon coverage for this gene
                     baseCoverage.commit(*gene); //keep the per-base coverage recorded on this gene
@@ -429,14 +442,15 @@ namespace rnaseqc {
 
             //check if this is a globin read
             set<string> globinIntersection, unambiguousGeneNames;
-            for (const string& gene_id : last) unambiguousGeneNames.insert(geneNames[gene_id]); // translate set of gene_ids to set of gene names
+            for (const unsigned int gene : last) // translate set of genes to set of gene names
+                unambiguousGeneNames.insert(gene < geneNames.size() ? geneNames[gene] : "");
 
             set_intersection(unambiguousGeneNames.begin(), unambiguousGeneNames.end(), blacklistedGlobins.begin(), blacklistedGlobins.end(), inserter(globinIntersection, globinIntersection.begin()));
             if (globinIntersection.empty())
             {
                 // no unambiguous intersections with globins
-                counter.increment("Non-Globin Reads");
-                if (alignment.DuplicateFlag()) counter.increment("Non-Globin Duplicate Reads");
+                counter.increment(MetricKey::NonGlobinReads);
+                if (alignment.DuplicateFlag()) counter.increment(MetricKey::NonGlobinDuplicateReads);
             }
         }
         
@@ -444,27 +458,27 @@ namespace rnaseqc {
         {
             if (intragenic)
             {
-                counter.increment("Intronic Reads");
-                counter.increment("Intragenic Reads");
+                counter.increment(MetricKey::IntronicReads);
+                counter.increment(MetricKey::IntragenicReads);
                 if (highQuality){
-                    counter.increment("HQ Intronic Reads");
-                    counter.increment("HQ Intragenic Reads");
+                    counter.increment(MetricKey::HQIntronicReads);
+                    counter.increment(MetricKey::HQIntragenicReads);
                 }
             }
             else
             {
-                counter.increment("Intergenic Reads");
-                if (highQuality) counter.increment("HQ Intergenic Reads");
+                counter.increment(MetricKey::IntergenicReads);
+                if (highQuality) counter.increment(MetricKey::HQIntergenicReads);
             }
         }
         else if (doExonMetrics) //if exons were detected and at least one exon ended up being collected, we count this as exonic
         {
-            counter.increment("Exonic Reads");
-            counter.increment("Intragenic Reads");
+            counter.increment(MetricKey::ExonicReads);
+            counter.increment(MetricKey::IntragenicReads);
             if (highQuality)
             {
-                counter.increment("HQ Exonic Reads");
-                counter.increment("HQ Intragenic Reads");
+                counter.increment(MetricKey::HQExonicReads);
+                counter.increment(MetricKey::HQIntragenicReads);
             }
         }
         else
@@ -472,42 +486,46 @@ namespace rnaseqc {
             //It's unclear how to properly classify these reads
             //They had exon coverage, but aligned to multiple genes
             //Any exon and gene coverage they had was discarded and not recorded
-            counter.increment("Ambiguous Reads");
-            if (highQuality) counter.increment("HQ Ambiguous Reads");
+            counter.increment(MetricKey::AmbiguousReads);
+            if (highQuality) counter.increment(MetricKey::HQAmbiguousReads);
         }
-        if (ribosomal) counter.increment("rRNA Reads");
+        if (ribosomal) counter.increment(MetricKey::RRNAReads);
         //also record strandedness counts
         //TODO: check standing metrics.  Counts are probably off because of null intron/exon calls
         if ((transcriptMinus ^ transcriptPlus) && (singleEnd || alignment.PairedFlag()))
         {
             if (singleEnd || alignment.FirstFlag())
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
-                else transcriptPlus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(MetricKey::End1Sense) : counter.increment(MetricKey::End1Antisense);
+                else transcriptPlus ? counter.increment(MetricKey::End1Sense) : counter.increment(MetricKey::End1Antisense);
             }
             else
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
-                else transcriptPlus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(MetricKey::End2Sense) : counter.increment(MetricKey::End2Antisense);
+                else transcriptPlus ? counter.increment(MetricKey::End2Sense) : counter.increment(MetricKey::End2Antisense);
             }
         }
         baseCoverage.reset();
         if (fastaReader.hasContig(chr) && highQuality && exonic && doExonMetrics && alignedExons.size() == 1 && blocks.size() == 1 && fabs(alignment.InsertSize()) > 100 && fabs(alignment.InsertSize()) < 1000) {
-            string exonName = *(alignedExons.begin());
-            auto fragment = fragments.find(alignment.Qname());
-            if (fragment == fragments.end()) //first time we've encountered a read in this pair
+            const unsigned int exon = *(alignedExons.begin());
+            const uint64_t name = readFingerprint(alignment.Qname());
+            FragmentMateEntry *fragment = fragments.find(name);
+            if (fragment == nullptr) //first time we've encountered a read in this pair
             {
                 // Record the exon we aligned to and the actual end of the read
-                fragments[alignment.Qname()] = std::make_tuple(exonName, alignment.PositionEnd());
+                if (alignment.MateChrID() == alignment.ChrID()) fragments.insert(name, std::make_tuple(exon, alignment.PositionEnd()), alignment.MatePosition());
             }
-            else if (exonName == std::get<EXON>(fragment->second)) //second time we've encountered a read in this pair
+            else if (exon == std::get<EXON>(*fragment)) //second time we've encountered a read in this pair
             {
                 
-                //Check that we end after the mate ends, and that we aren't aligned to the same start position
-                if (alignment.PositionEnd() <= std::get<ENDPOS>(fragment->second) || alignment.Position() == alignment.MatePosition()) return -1;
+                //Check that the downstream mate ends after the upstream one, and that they aren't aligned to the same start position
+                //In sorted input this read is always the downstream mate. Unsorted input may deliver them the other way around
+                const coord mateEnd = std::get<ENDPOS>(*fragment);
+                const bool upstream = alignment.Position() < alignment.MatePosition();
+                if ((upstream ? mateEnd <= alignment.PositionEnd() : alignment.PositionEnd() <= mateEnd) || alignment.Position() == alignment.MatePosition()) return -1;
                 //This pair is useable for fragment statistics:  both pairs fully aligned to the same exon
-                string seq = fastaReader.getSeq(chr, std::get<ENDPOS>(fragment->second) - alignment.Length(), alignment.PositionEnd());
-                fragments.erase(alignment.Qname());
+                string seq = upstream ? fastaReader.getSeq(chr, alignment.PositionEnd() - alignment.Length(), mateEnd) : fastaReader.getSeq(chr, mateEnd - alignment.Length(), alignment.PositionEnd());
+                fragments.erase(name);
                 return seq.length() > 0 ? gc(seq) : -1;
             }
         }
@@ -515,42 +533,42 @@ namespace rnaseqc {
     }
 
     // Estimate fragment size in a read pair
-    void fragmentSizeMetrics(unsigned int &doFragmentSize, map<chrom, list<Feature>> *bedFeatures, map<string, FragmentMateEntry> &fragments, map<long long, unsigned long> &fragmentSizes, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable)
+    void fragmentSizeMetrics(unsigned int &doFragmentSize, map<chrom, FeatureList> &bedFeatures, MateTracker &fragments, map<long long, unsigned long> &fragmentSizes, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable)
     {
         string chrName = sequenceTable[alignment.ChrID()].Name;
         chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand referemce
         bool firstBlock = true, sameExon = true; //for keeping track of the alignment state
-        string exonName = ""; // the name of the intersected exon from the bed
+        const Feature *exon = nullptr; // the intersected exon from the bed
         
-        trimFeatures(alignment, (*bedFeatures)[chr]); //trim out the features to speed up intersections
+        FeatureList &intervals = bedFeatures[chr];
+        trimFeatures(alignment, intervals); //trim out the features to speed up intersections
         for (auto block = blocks.begin(); sameExon && block != blocks.end(); ++block)
         {
             //for each block, intersect it with the bed file features
-            list<Feature> *results = intersectBlock(*block, (*bedFeatures)[chr]);
-            if (results->size() == 1 && (partialIntersect(results->front(), *block) == (block->end - block->start))) //if the block intersected more than one exon, it's immediately disqualified
+            const vector<const Feature*> &results = intersectBlock(*block, intervals);
+            if (results.size() == 1 && (partialIntersect(*results.front(), *block) == (block->end - block->start))) //if the block intersected more than one exon, it's immediately disqualified
             {
-                if (firstBlock) exonName = results->begin()->feature_id; //record the exon name on the first pass
-                else if (exonName != results->begin()->feature_id) //ensure the same exon name on subsequent passes
+                if (firstBlock) exon = results.front(); //record the exon on the first pass
+                else if (exon->feature_id != results.front()->feature_id) //ensure the same exon name on subsequent passes
                 {
                     sameExon = false;
-                    delete results;
                     break;
                 }
             }
             else sameExon = false;
-            delete results; //clean up dynamic allocation
             firstBlock = false;
         }
-        if (sameExon && exonName.size()) //if all blocks intersected the same exon, take a fragment size sample
+        if (sameExon && exon && exon->feature_id.size()) //if all blocks intersected the same exon, take a fragment size sample
         {
             //both mates in a pair have to intersected the same exon in order for the pair to qualify for the sample
-            auto fragment = fragments.find(alignment.Qname());
-            if (fragment == fragments.end()) //first time we've encountered a read in this pair
+            const uint64_t name = readFingerprint(alignment.Qname());
+            FragmentMateEntry *fragment = fragments.find(name);
+            if (fragment == nullptr) //first time we've encountered a read in this pair
             {
                 // Record the exon we aligned to and the actual end of the read
-                fragments[alignment.Qname()] = std::make_tuple(exonName, alignment.PositionEnd());
+                if (alignment.MateChrID() == alignment.ChrID()) fragments.insert(name, std::make_tuple(exon->feature_index, alignment.PositionEnd()), alignment.MatePosition());
             }
-            else if (exonName == std::get<EXON>(fragment->second)) //second time we've encountered a read in this pair
+            else if (exon->feature_index == std::get<EXON>(*fragment)) //second time we've encountered a read in this pair
             {
                 //Quick test: Does the mate startP occur inside the aligned range of this read?
 //                if (alignment.PositionEndMate() >= alignment.Position() && alignment.PositionEndMate() <= alignment.PositionEnd()) return doFragmentSize;
@@ -561,22 +579,23 @@ namespace rnaseqc {
                 // 4) This read must not start at the same point as the mate. If so, without this check, the pair may be arbitrarily discarded or kept depending on sort order
                 
                 //FIXME: Is the above test actually accurate? Cant a + read appear after a - read for reverse strand alignments?
-                if (alignment.MateReverseFlag() || !alignment.ReverseFlag() || alignment.PositionEnd() <= std::get<ENDPOS>(fragment->second)  || alignment.Position() == alignment.MatePosition()) return;
+                // In sorted input this read is always the downstream mate. Unsorted input may deliver them the other way around, so the checks are mirrored
+                if (alignment.Position() < alignment.MatePosition())
+                {
+                    if (alignment.ReverseFlag() || !alignment.MateReverseFlag() || std::get<ENDPOS>(*fragment) <= alignment.PositionEnd()) return;
+                }
+                else if (alignment.MateReverseFlag() || !alignment.ReverseFlag() || alignment.PositionEnd() <= std::get<ENDPOS>(*fragment)  || alignment.Position() == alignment.MatePosition()) return;
                 //This pair is useable for fragment statistics:  both pairs fully aligned to the same exon
                 fragmentSizes[abs(alignment.InsertSize())] += 1;
-                fragments.erase(fragment);
+                fragments.erase(name);
                 --doFragmentSize;
-                if (!doFragmentSize)
-                {
-                    delete bedFeatures; //after taking all the samples we need, clean up the dynamic allocation
-                    bedFeatures = nullptr;
-                }
+                if (!doFragmentSize) bedFeatures.clear(); //after taking all the samples we need, free the intervals
             }
         }
     }
 
 
-    /*double gcContent(unsigned int &doFragmentSize, map<chrom, list<Feature>> *bedFeatures, map<string, FragmentMateEntry> &fragments, map<long long, unsigned long> &fragmentSizes, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable, Fasta &fastaReader)
+    /*double gcContent(unsigned int &doFragmentSize, map<chrom, list<Feature>> *bedFeatures, MateTracker &fragments, map<long long, unsigned long> &fragmentSizes, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable, Fasta &fastaReader)
     {
         string chrName = sequenceTable[alignment.ChrID()].Name;
         chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand referemce
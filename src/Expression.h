@@ -12,27 +12,43 @@
 #include "Metrics.h"
 #include "BamReader.h"
 #include <set>
+#include <queue>
 #include <iostream>
 
 namespace rnaseqc {
     //Utility functions
     unsigned int extractBlocks(Alignment&, std::vector<Feature>&, chrom, bool);
     //unsigned int legacyExtractBlocks(BamTools::BamAlignment&, std::vector<Feature>&, chrom);
-    std::list<Feature>* intersectBlock(Feature&, std::list<Feature>&);
-    void trimFeatures(Alignment&, std::list<Feature>&);
-    void trimFeatures(Alignment&, std::list<Feature>&, BaseCoverage&);
-    void dropFeatures(std::list<Feature>&, BaseCoverage&);
+    const std::vector<const Feature*>& intersectBlock(const Feature&, FeatureList&);
+    void trimFeatures(Alignment&, FeatureList&);
+    void trimFeatures(Alignment&, FeatureList&, BaseCoverage&, FeatureCounts&);
+    void dropFeatures(FeatureList&, BaseCoverage&, FeatureCounts&);
     
     // Definitions for fragment tracking
-    typedef std::tuple<std::string, coord> FragmentMateEntry; // Used to record mate end point (exon name, read end position)
+    typedef std::tuple<unsigned int, coord> FragmentMateEntry; // Used to record mate end point (exon index, read end position)
     const std::size_t EXON = 0, ENDPOS = 1;
+
+    class MateTracker {
+        // Holds the first mate of each fragment until the second arrives, keyed by read name fingerprint
+        // Entries are also queued by the position of their mate. In sorted input, once reads pass that position the mate
+        // has either been seen or never qualified, so the entry can be evicted. This keeps the tracker to about one insert size of reads
+        std::unordered_map<uint64_t, FragmentMateEntry> entries;
+        std::priority_queue<std::pair<coord, uint64_t>, std::vector<std::pair<coord, uint64_t> >, std::greater<std::pair<coord, uint64_t> > > expiry;
+    public:
+        MateTracker() : entries(), expiry() {}
+        FragmentMateEntry* find(uint64_t);
+        void insert(uint64_t, const FragmentMateEntry&, coord); // Records a first mate, along with the position of its mate
+        void erase(uint64_t);
+        void evict(coord); // Drops entries whose mate position is upstream of this position
+        void clear();
+    };
     
     //Metrics functions
-    void fragmentSizeMetrics(unsigned int&, std::map<chrom, std::list<Feature>>*, std::map<std::string, FragmentMateEntry>&, std::map<long long, unsigned long>&,std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&);
+    void fragmentSizeMetrics(unsigned int&, std::map<chrom, FeatureList>&, MateTracker&, std::map<long long, unsigned long>&,std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&);
     
-    double exonAlignmentMetrics(std::map<chrom, std::list<Feature>>&, Metrics&, std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&, unsigned int, Strand, BaseCoverage&, const bool, const bool, std::map<std::string, FragmentMateEntry>&, Fasta&);
+    double exonAlignmentMetrics(std::map<chrom, FeatureList>&, Metrics&, FeatureCounts&, std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&, unsigned int, Strand, BaseCoverage&, const bool, const bool, MateTracker&, Fasta&);
     
-    void legacyExonAlignmentMetrics(unsigned int, std::map<chrom, std::list<Feature>>&, Metrics&, std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&, unsigned int, Strand, BaseCoverage&, const bool, const bool);
+    void legacyExonAlignmentMetrics(unsigned int, std::map<chrom, FeatureList>&, Metrics&, FeatureCounts&, std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&, unsigned int, Strand, BaseCoverage&, const bool, const bool);
     
     Strand feature_strand(Alignment&, Strand);
 }
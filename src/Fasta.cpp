@@ -17,10 +17,8 @@ namespace rnaseqc {
     chrom chromosomeMap(std::string chr)
     {
         auto entry = chromosomes.find(chr);
-        if (entry == chromosomes.end())
-        {
-            chromosomes[chr] = chromosomes.size() + 1u;
-        }
+        if (entry != chromosomes.end()) return entry->second; // Read-only fast path, safe once all contigs are registered
+        chromosomes[chr] = chromosomes.size() + 1u;
         return chromosomes[chr];
     }
     
@@ -156,7 +154,6 @@ namespace rnaseqc {
     // Get page idx for position 0 of a contig
     indexType Fasta::pageForContig(chrom contig)
     {
-        static std::unordered_map<chrom, indexType> pageIndex; // Function caches the lookup table to save time
         if (!pageIndex.size()) pageIndex[0] = 0;
         if (pageIndex.count(contig)) return pageIndex[contig];
         if (!this->contigIndex.count(contig)) throw invalidContigException("No such contig: " + getChromosomeName(contig));
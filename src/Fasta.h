@@ -50,12 +50,13 @@ namespace rnaseqc {
         std::unordered_map<indexType, std::string> pageCache;
         std::list<indexType> lru;
         std::unordered_map<chrom, bioio::FastaContigIndex> contigIndex;
+        std::unordered_map<chrom, indexType> pageIndex; // Caches the first page of each contig
         void updateLRU(indexType);
         indexType pageForContig(chrom);
         std::string readSeq(chrom, coord);
         unsigned long calls, misses;
     public:
-        Fasta() : _open(), reader(), pageCache(), lru(), contigIndex(), calls(), misses() {};
+        Fasta() : _open(), reader(), pageCache(), lru(), contigIndex(), pageIndex(), calls(), misses() {};
         ~Fasta();
         void open(std::string&);
         std::string getSeq(chrom, coord, coord);
@@ -7,10 +7,24 @@
 //
 
 #include "GTF.h"
+#include "Serialize.h"
+#include <algorithm>
 #include <exception>
 #include <stdexcept>
 #include <unordered_set>
+#include <unordered_map>
+#include <cstring>
+#include <iterator>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <boost/regex.hpp>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <htslib/bgzf.h>
 
 using std::ifstream;
 using std::string;
@@ -19,101 +33,338 @@ using std::map;
 namespace rnaseqc {
     const string EXON_NAME = "exon";
     const boost::regex ribosomalPattern("rRNA"); //For recognizing features which are rRNAs
-    map<string, string> geneNames, geneSeqs;
-map<string, coord> geneLengths, geneCodingLengths;
-    map<string, FeatureSpan> exonLengths;
-    std::map<std::string, std::vector<std::string>> exonsForGene;
-    std::vector<std::string> geneList, exonList;
+    map<string, string> geneSeqs;
+    std::vector<std::string> geneList, exonList, geneIDs;
+    std::vector<std::string> geneNames, exonGeneNames;
+    std::vector<coord> geneLengths, geneCodingLengths;
+    std::vector<FeatureSpan> exonLengths;
+    std::vector<unsigned int> geneExonOffsets, geneExons;
+    std::unordered_map<string, string> featureNames; // Name attribute of every feature, by ID. Only kept while parsing
     map<string, unsigned int> exon_names;
-    
+    std::unordered_set<string> seenGeneIds, seenExonIds; // For rejecting duplicate IDs
+    std::unordered_map<string, bool> ribosomalTypes; // Transcript types already checked for rRNA, by the thread applying features
+
+    struct AttributeValue {
+        // Points into the attribute column of the line being parsed
+        const char *begin, *end;
+        bool present;
+        string str() const {
+            return string(begin, end);
+        }
+    };
+
+    struct GTFAttributes {
+        // The only attributes used by RNA-SeQC
+        AttributeValue gene_id, transcript_id, exon_id, gene_name, transcript_type;
+    };
+
+    struct ParsedFeature {
+        // One tokenized GTF line. Tokenizing only depends on the line itself, so it can happen on any thread
+        // Anything which depends on earlier lines (contig IDs, duplicate checks, unnamed exons, missing attributes) waits until
+        // the line is applied, strictly in file order
+        Feature feature; // No chromosome yet. feature_id only holds the transcript_id or exon_id
+        const char *line, *end; // For error messages
+        AttributeValue contig, gene_name;
+        bool hasFeatureId, hasGeneId, hasTranscriptType;
+    };
+
+    struct GTFChunk {
+        // The tokenized lines of one chunk of the file
+        std::vector<ParsedFeature> lines;
+        std::exception_ptr failure; // Set if a line failed to tokenize. The lines before it are still applied first
+        bool ready;
+        GTFChunk() : lines(), failure(nullptr), ready(false) {}
+    };
+
+    struct GTFPipeline {
+        // Tokenizes line aligned chunks of the file on worker threads, staying at most one window of chunks ahead of the reader
+        static const std::size_t CHUNK_SIZE = 1u << 22;
+        const char *data;
+        std::size_t length, chunks, window;
+        std::vector<GTFChunk> slots; // Chunk i is tokenized into slot i % window
+        std::size_t claimed, released; // Next chunk for a worker to take, and the chunk the reader is on
+        bool stopping;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::vector<std::thread> workers;
+        GTFPipeline(const char*, std::size_t, unsigned int);
+        ~GTFPipeline();
+        std::size_t boundary(std::size_t) const; // Start of the first line at or after the offset
+        void work();
+        GTFChunk& wait(); // Blocks until the reader's chunk is ready
+        void release(); // Moves the reader on to the next chunk, and frees the slot for the workers
+    };
+
+    bool tokenizeFeature(const char*, const char*, ParsedFeature&, std::unordered_map<string, bool>&);
+    void applyFeature(ParsedFeature&, Feature&);
+    void scanAttributes(const char*, const char*, GTFAttributes&);
+    bool ribosomalType(const string&, std::unordered_map<string, bool>&);
     
     ifstream& operator>>(ifstream &in, Feature &out)
     {
-        static std::unordered_set<std::string> geneIds, exonIds;
-        try{
-            string line;
-            while(getline(in, line))
-            {
-                if(line[0] == '#') continue; //not a feature line
-                std::istringstream tokenizer(line);
-                //get chr#
-                string buffer;
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse chromosome. Invalid GTF line: " + line);
-                out.chromosome = chromosomeMap(buffer);
-                //get track name
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse track. Invalid GTF line: " + line);
-                //get feature type
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse feature type. Invalid GTF line: " + line);
-                if (buffer == "exon") out.type = FeatureType::Exon;
-                else if (buffer == "gene") out.type = FeatureType::Gene;
-                else if (buffer == "transcript") out.type = FeatureType::Transcript;
-                else out.type = FeatureType::Other;
-                //get start pos
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse start. Invalid GTF line: " + line);
-                out.start = std::stoull(buffer);
-                //get stop pos
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse end. Invalid GTF line: " + line);
-                out.end = std::stoull(buffer);
-                //get score
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse score. Invalid GTF line: " + line);
-                //get strand
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse strand. Invalid GTF line: " + line);
-                switch(buffer[0])
+        string line;
+        while(getline(in, line))
+        {
+            ParsedFeature parsed;
+            if (tokenizeFeature(line.data(), line.data() + line.size(), parsed, ribosomalTypes))
+            {
+                applyFeature(parsed, out);
+                break;
+            }
+        }
+        return in;
+    }
+
+    MappedFile::MappedFile(const string &filename, unsigned int threads) : buffer(), bytes(nullptr), length(0), mapping(nullptr), opened(false)
+    {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        unsigned char magic[2];
+        const bool regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+        const bool compressed = regular && pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b; // gzip, which includes BGZF
+        if (regular && !compressed && info.st_size > 0)
+        {
+            void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                madvise(map, info.st_size, MADV_SEQUENTIAL);
+                this->mapping = map;
+                this->bytes = static_cast<const char*>(map);
+                this->length = info.st_size;
+                this->opened = true;
+            }
+        }
+        close(fd);
+        if (this->mapping == nullptr) this->inflate(filename, threads); // Compressed files, pipes, empty files, or anything else which can't be mapped
+    }
+
+    void MappedFile::inflate(const string &filename, unsigned int threads)
+    {
+        // htslib passes uncompressed input straight through, so this also reads pipes
+        BGZF *input = bgzf_open(filename.c_str(), "r");
+        if (input == nullptr) return;
+        if (threads > 1 && input->is_compressed && !input->is_gzip) bgzf_mt(input, threads, 256); // Plain gzip can only be inflated serially
+        const std::size_t BLOCK_SIZE = 1u << 22;
+        ssize_t count;
+        do {
+            const std::size_t size = this->buffer.size();
+            this->buffer.resize(size + BLOCK_SIZE);
+            count = bgzf_read(input, &this->buffer[size], BLOCK_SIZE);
+            this->buffer.resize(size + (count > 0 ? count : 0));
+        } while (count > 0);
+        bgzf_close(input);
+        if (count < 0) throw fileException("Unable to decompress " + filename);
+        this->bytes = this->buffer.data();
+        this->length = this->buffer.size();
+        this->opened = true;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (this->mapping != nullptr) munmap(this->mapping, this->length);
+    }
+
+    GTFReader::GTFReader(const string &filename, unsigned int threads) : file(filename, threads), offset(0), pipeline(), current(nullptr), position(0)
+    {
+        if (!this->file.is_open()) throw fileException("Unable to open GTF file: " + filename);
+        if (threads > 1 && this->file.size() > GTFPipeline::CHUNK_SIZE) this->pipeline.reset(new GTFPipeline(this->file.data(), this->file.size(), threads));
+    }
+
+    GTFReader::~GTFReader()
+    {
+    }
+
+    bool GTFReader::next(Feature &out)
+    {
+        if (this->pipeline)
+        {
+            while (true)
+            {
+                if (this->current == nullptr)
                 {
-                    case '+':
-                        out.strand = Strand::Forward;
-                        break;
-                    case '-':
-                        out.strand = Strand::Reverse;
-                        break;
-                    default:
-                        out.strand = Strand::Unknown;
+                    if (this->pipeline->released == this->pipeline->chunks) return false;
+                    this->current = &this->pipeline->wait();
+                    this->position = 0;
                 }
-                //get frame
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse frame. Invalid GTF line: " + line);
-                //get attributes
-                if(!getline(tokenizer, buffer)) throw gtfException("Unable to parse attributes. Invalid GTF line: " + line);
-                std::map<string, string> attributes;
-                parseAttributes(buffer, attributes);
-                if ( out.end < out.start)
-                    std::cerr << "Bad feature range:" << out.start << " - " << out.end << std::endl;
-                if (out.type == FeatureType::Gene && attributes.find("gene_id") != attributes.end())
+                if (this->position < this->current->lines.size())
                 {
-                    //Parse gene attributes
-                    out.feature_id = attributes["gene_id"];
-                    if (geneIds.count(out.feature_id)) throw gtfException(std::string("Detected non-unique Gene ID: "+out.feature_id));
-                    geneIds.insert(out.feature_id);
-                    geneLengths[out.feature_id] = out.end - out.start + 1;
-                    geneList.push_back(attributes["gene_id"]);
+                    applyFeature(this->current->lines[this->position++], out);
+                    return true;
                 }
-                if (out.type == FeatureType::Transcript && attributes.find("transcript_id") != attributes.end()) out.feature_id = attributes["transcript_id"];
-                if (attributes.find("gene_id") != attributes.end()) out.gene_id = attributes["gene_id"];
-                if (out.type == FeatureType::Exon)
+                if (this->current->failure) std::rethrow_exception(this->current->failure);
+                this->current = nullptr;
+                this->pipeline->release();
+            }
+        }
+        const char *data = this->file.data();
+        const std::size_t length = this->file.size();
+        while (this->offset < length)
+        {
+            const char *line = data + this->offset;
+            const char *newline = static_cast<const char*>(memchr(line, '\n', length - this->offset));
+            const char *end = newline != nullptr ? newline : data + length;
+            this->offset = (end - data) + 1;
+            ParsedFeature parsed;
+            if (tokenizeFeature(line, end, parsed, ribosomalTypes))
+            {
+                applyFeature(parsed, out);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    GTFPipeline::GTFPipeline(const char *bytes, std::size_t size, unsigned int threads) : data(bytes), length(size), chunks((size + CHUNK_SIZE - 1) / CHUNK_SIZE), window(2 * threads), slots(2 * threads), claimed(0), released(0), stopping(false), lock(), changed(), workers()
+    {
+        for (unsigned int i = 0; i < threads; ++i) this->workers.push_back(std::thread(&GTFPipeline::work, this));
+    }
+
+    GTFPipeline::~GTFPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->stopping = true;
+        }
+        this->changed.notify_all();
+        for (auto worker = this->workers.begin(); worker != this->workers.end(); ++worker) worker->join();
+    }
+
+    std::size_t GTFPipeline::boundary(std::size_t offset) const
+    {
+        if (offset == 0) return 0;
+        if (offset >= this->length) return this->length;
+        const char *newline = static_cast<const char*>(memchr(this->data + offset - 1, '\n', this->length - offset + 1));
+        return newline != nullptr ? (newline - this->data) + 1 : this->length;
+    }
+
+    void GTFPipeline::work()
+    {
+        std::unordered_map<string, bool> types; // Each worker checks transcript types on its own
+        while (true)
+        {
+            std::size_t index;
+            {
+                std::unique_lock<std::mutex> guard(this->lock);
+                this->changed.wait(guard, [this]() { return this->stopping || this->claimed >= this->chunks || this->claimed < this->released + this->window; });
+                if (this->stopping || this->claimed >= this->chunks) return;
+                index = this->claimed++;
+            }
+            GTFChunk &chunk = this->slots[index % this->window];
+            try {
+                const std::size_t end = this->boundary((index + 1) * CHUNK_SIZE);
+                for (std::size_t offset = this->boundary(index * CHUNK_SIZE); offset < end;)
                 {
-                    //Parse exon attributes
-                    if (attributes.find("exon_id") != attributes.end())
-                    {
-                        out.feature_id = attributes["exon_id"];
-                    }
-                    else if (attributes.find("gene_id") != attributes.end())
-                    {
-                        out.feature_id = attributes["gene_id"] + "_" + std::to_string(++exon_names[attributes["gene_id"]]);
-                        std::cerr << "Unnamed exon: Gene: " << attributes["gene_id"] << " Position: [" << out.start << ", " << out.end <<  "] Inferred Exon Name: " << out.feature_id << std::endl;
-                    }
-                    else throw gtfException(std::string("Exon missing exon_id and gene_id fields: " + line));
-                    if (exonIds.count(out.feature_id)) throw gtfException(std::string("Detected non-unique Exon ID: "+out.feature_id));
-                    exonIds.insert(out.feature_id);
-                    exonList.push_back(out.feature_id);
-                    geneCodingLengths[out.gene_id] += 1 + (out.end - out.start);
-                    exonLengths[out.feature_id] = {out.chromosome, out.start, 1 + (out.end - out.start)};
+                    const char *line = this->data + offset;
+                    const char *newline = static_cast<const char*>(memchr(line, '\n', end - offset));
+                    const char *lineEnd = newline != nullptr ? newline : this->data + end;
+                    offset = (lineEnd - this->data) + 1;
+                    ParsedFeature parsed;
+                    if (tokenizeFeature(line, lineEnd, parsed, types)) chunk.lines.push_back(std::move(parsed));
                 }
-                if (attributes.find("transcript_type") != attributes.end()) out.transcript_type = attributes["transcript_type"];
-                if (attributes.find("gene_name") != attributes.end()) geneNames[out.feature_id] = attributes["gene_name"];
-                else if (attributes.find("gene_id") != attributes.end()) geneNames[out.feature_id] = attributes["gene_id"];
-                out.ribosomal = boost::regex_search(out.transcript_type, ribosomalPattern);
-                break;
             }
-            
+            catch (...) {
+                chunk.failure = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> guard(this->lock);
+                chunk.ready = true;
+            }
+            this->changed.notify_all();
+        }
+    }
+
+    GTFChunk& GTFPipeline::wait()
+    {
+        GTFChunk &chunk = this->slots[this->released % this->window];
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->changed.wait(guard, [&chunk]() { return chunk.ready; });
+        return chunk;
+    }
+
+    void GTFPipeline::release()
+    {
+        GTFChunk &chunk = this->slots[this->released % this->window];
+        chunk.lines.clear();
+        chunk.failure = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            chunk.ready = false;
+            ++this->released;
+        }
+        this->changed.notify_all();
+    }
+
+    // Splits off the next tab delimited column. Same as getline(tokenizer, column, '\t') on an istringstream of the line
+    bool nextColumn(const char *&cursor, const char *end, const char *&begin, const char *&last)
+    {
+        if (cursor >= end) return false;
+        begin = cursor;
+        last = static_cast<const char*>(memchr(cursor, '\t', end - cursor));
+        if (last == nullptr) last = end;
+        cursor = last < end ? last + 1 : end;
+        return true;
+    }
+
+    // Tokenizes one GTF line. Returns false for comment lines
+    bool tokenizeFeature(const char *line, const char *end, ParsedFeature &out, std::unordered_map<string, bool> &types)
+    {
+        try{
+            if (line < end && line[0] == '#') return false; //not a feature line
+            out.line = line;
+            out.end = end;
+            const char *cursor = line, *begin, *last;
+            //get chr#
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse chromosome. Invalid GTF line: " + string(line, end));
+            out.contig = {begin, last, true};
+            //get track name
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse track. Invalid GTF line: " + string(line, end));
+            //get feature type
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse feature type. Invalid GTF line: " + string(line, end));
+            const string::size_type typeLength = last - begin;
+            if (typeLength == 4 && !memcmp(begin, "exon", 4)) out.feature.type = FeatureType::Exon;
+            else if (typeLength == 4 && !memcmp(begin, "gene", 4)) out.feature.type = FeatureType::Gene;
+            else if (typeLength == 10 && !memcmp(begin, "transcript", 10)) out.feature.type = FeatureType::Transcript;
+            else out.feature.type = FeatureType::Other;
+            //get start pos
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse start. Invalid GTF line: " + string(line, end));
+            out.feature.start = std::stoull(string(begin, last));
+            //get stop pos
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse end. Invalid GTF line: " + string(line, end));
+            out.feature.end = std::stoull(string(begin, last));
+            //get score
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse score. Invalid GTF line: " + string(line, end));
+            //get strand
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse strand. Invalid GTF line: " + string(line, end));
+            switch(begin < last ? begin[0] : '\0')
+            {
+                case '+':
+                    out.feature.strand = Strand::Forward;
+                    break;
+                case '-':
+                    out.feature.strand = Strand::Reverse;
+                    break;
+                default:
+                    out.feature.strand = Strand::Unknown;
+            }
+            //get frame
+            if(!nextColumn(cursor, end, begin, last)) throw gtfException("Unable to parse frame. Invalid GTF line: " + string(line, end));
+            //get attributes (the rest of the line)
+            if(cursor >= end) throw gtfException("Unable to parse attributes. Invalid GTF line: " + string(line, end));
+            GTFAttributes attributes;
+            scanAttributes(cursor, end, attributes);
+            out.hasGeneId = attributes.gene_id.present;
+            if (out.hasGeneId) out.feature.gene_id.assign(attributes.gene_id.begin, attributes.gene_id.end);
+            const AttributeValue &id = out.feature.type == FeatureType::Exon ? attributes.exon_id : attributes.transcript_id;
+            out.hasFeatureId = (out.feature.type == FeatureType::Exon || out.feature.type == FeatureType::Transcript) && id.present;
+            if (out.hasFeatureId) out.feature.feature_id.assign(id.begin, id.end);
+            out.hasTranscriptType = attributes.transcript_type.present;
+            if (out.hasTranscriptType)
+            {
+                out.feature.transcript_type.assign(attributes.transcript_type.begin, attributes.transcript_type.end);
+                out.feature.ribosomal = ribosomalType(out.feature.transcript_type, types);
+            }
+            out.gene_name = attributes.gene_name;
         }
         catch(gtfException &e)
         {
@@ -127,7 +378,112 @@ map<string, coord> geneLengths, geneCodingLengths;
         {
             throw gtfException(std::string("Uncountered an unknown error while parsing GTF: ")+e.what());
         }
-        return in;
+        return true;
+    }
+
+    // Applies a tokenized line to the feature, and records it in the annotation tables. Lines must be applied in file order
+    // Attributes missing from the line leave the corresponding fields of the feature untouched
+    void applyFeature(ParsedFeature &parsed, Feature &out)
+    {
+        static string lastContig;
+        static chrom lastChrom = 0;
+        if (lastContig.compare(0, string::npos, parsed.contig.begin, parsed.contig.end - parsed.contig.begin) || !lastChrom)
+        {
+            lastContig.assign(parsed.contig.begin, parsed.contig.end);
+            lastChrom = chromosomeMap(lastContig);
+        }
+        out.chromosome = lastChrom;
+        out.type = parsed.feature.type;
+        out.start = parsed.feature.start;
+        out.end = parsed.feature.end;
+        out.strand = parsed.feature.strand;
+        if ( out.end < out.start)
+            std::cerr << "Bad feature range:" << out.start << " - " << out.end << std::endl;
+        if (out.type == FeatureType::Gene && parsed.hasGeneId)
+        {
+            //Parse gene attributes
+            out.feature_id = parsed.feature.gene_id;
+            if (!seenGeneIds.insert(out.feature_id).second) throw gtfException(std::string("Detected non-unique Gene ID: "+out.feature_id));
+            geneLengths.push_back(out.end - out.start + 1);
+            geneList.push_back(out.feature_id);
+        }
+        if (out.type == FeatureType::Transcript && parsed.hasFeatureId) out.feature_id.swap(parsed.feature.feature_id);
+        if (parsed.hasGeneId) out.gene_id.swap(parsed.feature.gene_id);
+        if (out.type == FeatureType::Exon)
+        {
+            //Parse exon attributes
+            if (parsed.hasFeatureId)
+            {
+                out.feature_id.swap(parsed.feature.feature_id);
+            }
+            else if (parsed.hasGeneId)
+            {
+                out.feature_id = out.gene_id + "_" + std::to_string(++exon_names[out.gene_id]);
+                std::cerr << "Unnamed exon: Gene: " << out.gene_id << " Position: [" << out.start << ", " << out.end <<  "] Inferred Exon Name: " << out.feature_id << std::endl;
+            }
+            else throw gtfException(std::string("Exon missing exon_id and gene_id fields: " + string(parsed.line, parsed.end)));
+            if (!seenExonIds.insert(out.feature_id).second) throw gtfException(std::string("Detected non-unique Exon ID: "+out.feature_id));
+            exonList.push_back(out.feature_id);
+            exonLengths.push_back({out.chromosome, out.start, 1 + (out.end - out.start)});
+        }
+        if (parsed.hasTranscriptType)
+        {
+            out.transcript_type.swap(parsed.feature.transcript_type);
+            out.ribosomal = parsed.feature.ribosomal;
+        }
+        else out.ribosomal = ribosomalType(out.transcript_type, ribosomalTypes);
+        if (parsed.gene_name.present) featureNames[out.feature_id].assign(parsed.gene_name.begin, parsed.gene_name.end);
+        else if (parsed.hasGeneId) featureNames[out.feature_id] = out.gene_id;
+    }
+
+    // Picks the attributes RNA-SeQC uses out of the attribute column, without copying anything
+    // Follows parseAttributes exactly: fields are split on ';', the key is whatever precedes the first quote (less one separator),
+    // and the value runs up to the next quote. Later fields replace earlier ones with the same key
+    void scanAttributes(const char *cursor, const char *end, GTFAttributes &attributes)
+    {
+        attributes.gene_id.present = attributes.transcript_id.present = attributes.exon_id.present = attributes.gene_name.present = attributes.transcript_type.present = false;
+        while (cursor < end)
+        {
+            const char *fieldEnd = static_cast<const char*>(memchr(cursor, ';', end - cursor));
+            if (fieldEnd == nullptr) fieldEnd = end;
+            const char *quote = static_cast<const char*>(memchr(cursor, '"', fieldEnd - cursor));
+            if (quote == nullptr) quote = fieldEnd;
+            const char *key = cursor, *keyEnd = quote > cursor ? quote - 1 : cursor;
+            while (key < keyEnd && (*key == ' ' || *key == '\t')) ++key;
+            AttributeValue *target = nullptr;
+            switch (keyEnd - key)
+            {
+                case 7:
+                    if (!memcmp(key, "gene_id", 7)) target = &attributes.gene_id;
+                    else if (!memcmp(key, "exon_id", 7)) target = &attributes.exon_id;
+                    break;
+                case 9:
+                    if (!memcmp(key, "gene_name", 9)) target = &attributes.gene_name;
+                    break;
+                case 13:
+                    if (!memcmp(key, "transcript_id", 13)) target = &attributes.transcript_id;
+                    break;
+                case 15:
+                    if (!memcmp(key, "transcript_type", 15)) target = &attributes.transcript_type;
+                    break;
+            }
+            if (target != nullptr)
+            {
+                target->present = true;
+                target->begin = target->end = quote < fieldEnd ? quote + 1 : fieldEnd;
+                const char *closing = static_cast<const char*>(memchr(target->begin, '"', fieldEnd - target->begin));
+                target->end = closing != nullptr ? closing : fieldEnd;
+            }
+            cursor = fieldEnd + 1;
+        }
+    }
+
+    // Whether features of this transcript type are rRNAs. Each distinct type is only matched once per cache
+    bool ribosomalType(const string &transcript_type, std::unordered_map<string, bool> &known)
+    {
+        auto entry = known.find(transcript_type);
+        if (entry == known.end()) entry = known.emplace(transcript_type, boost::regex_search(transcript_type, ribosomalPattern)).first;
+        return entry->second;
     }
     
     std::map<std::string,std::string>& parseAttributes(std::string &intake, std::map<std::string,std::string> &attributes)
@@ -178,6 +534,383 @@ map<string, coord> geneLengths, geneCodingLengths;
         return intersectPoint(a, b.start) || intersectPoint(a, b.end) || intersectPoint(b, a.start);
     }
     
+    void indexFeatures(map<chrom, FeatureList> &features)
+    {
+        std::unordered_map<string, unsigned int> geneIndex, exonIndex;
+        geneIDs = geneList;
+        for (unsigned int i = 0; i < geneList.size(); ++i) geneIndex[geneList[i]] = i;
+        for (unsigned int i = 0; i < exonList.size(); ++i) exonIndex[exonList[i]] = i;
+        auto intern = [&](const string &gene_id) {
+            auto entry = geneIndex.find(gene_id);
+            if (entry != geneIndex.end()) return entry->second;
+            const unsigned int idx = geneIDs.size();
+            geneIndex[gene_id] = idx;
+            geneIDs.push_back(gene_id);
+            return idx;
+        };
+        std::vector<unsigned int> exonCount;
+        geneCodingLengths.clear();
+        for (auto contig = features.begin(); contig != features.end(); ++contig) contig->second.update([&](Feature &feat) {
+            if (feat.type == FeatureType::Exon)
+            {
+                feat.feature_index = exonIndex.at(feat.feature_id);
+                feat.gene_index = intern(feat.gene_id);
+            }
+            else feat.feature_index = feat.gene_index = intern(feat.feature_id);
+            if (geneIDs.size() > exonCount.size())
+            {
+                exonCount.resize(geneIDs.size(), 0u);
+                geneCodingLengths.resize(geneIDs.size(), 0);
+            }
+            if (feat.type == FeatureType::Exon)
+            {
+                ++exonCount[feat.gene_index];
+                geneCodingLengths[feat.gene_index] += 1 + (feat.end - feat.start);
+            }
+        });
+        exonCount.resize(geneIDs.size(), 0u);
+        geneCodingLengths.resize(geneIDs.size(), 0);
+        // Exons are grouped by gene, keeping the order of the feature lists
+        geneExonOffsets.assign(geneIDs.size() + 1, 0u);
+        for (unsigned int i = 0; i < geneIDs.size(); ++i) geneExonOffsets[i + 1] = geneExonOffsets[i] + exonCount[i];
+        geneExons.assign(geneExonOffsets.back(), 0u);
+        for (auto contig = features.begin(); contig != features.end(); ++contig)
+            for (auto feat = contig->second.begin(); feat != contig->second.end(); ++feat)
+                if (feat->type == FeatureType::Exon) geneExons[geneExonOffsets[feat->gene_index + 1] - (exonCount[feat->gene_index]--)] = feat->feature_index;
+        geneNames.assign(geneIDs.size(), "");
+        for (unsigned int i = 0; i < geneIDs.size(); ++i)
+        {
+            auto name = featureNames.find(geneIDs[i]);
+            if (name != featureNames.end()) geneNames[i] = name->second;
+        }
+        exonGeneNames.assign(exonList.size(), "");
+        for (unsigned int i = 0; i < exonList.size(); ++i)
+        {
+            auto name = featureNames.find(exonList[i]);
+            if (name != featureNames.end()) exonGeneNames[i] = name->second;
+        }
+        std::unordered_map<string, string>().swap(featureNames);
+    }
+
+    const std::string& geneName(unsigned int gene)
+    {
+        static const std::string none;
+        return gene < geneIDs.size() ? geneIDs[gene] : none;
+    }
+
+    const string INDEX_MAGIC = "RNASeQC index";
+    const uint32_t INDEX_BYTE_ORDER = 0x01020304u;
+    const uint32_t INDEX_FORMAT = 1u;
+
+    uint32_t checksum(const char *data, std::size_t length)
+    {
+        uLong crc = crc32(0L, Z_NULL, 0);
+        while (length)
+        {
+            const uInt block = static_cast<uInt>(std::min<std::size_t>(length, 1u << 30));
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(data), block);
+            data += block;
+            length -= block;
+        }
+        return static_cast<uint32_t>(crc);
+    }
+
+    bool isAnnotationIndex(const string &filename)
+    {
+        // Only regular files are probed. Reading from a pipe would consume the start of a GTF
+        struct stat info;
+        if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+        ifstream reader(filename, std::ios::binary);
+        uint64_t size;
+        string magic(INDEX_MAGIC.size(), '\0');
+        try {
+            readBinary(reader, size);
+        }
+        catch (serializationException &e) {
+            return false;
+        }
+        if (size != INDEX_MAGIC.size() || !reader.read(&magic[0], magic.size())) return false;
+        return magic == INDEX_MAGIC;
+    }
+
+    void writeAnnotationIndex(const string &filename, const map<chrom, FeatureList> &features, bool legacy)
+    {
+        std::ostringstream stream;
+        // Contigs by ID, so the position of each name is its ID - 1
+        std::vector<string> contigs(chromosomes.size());
+        for (auto entry = chromosomes.begin(); entry != chromosomes.end(); ++entry) contigs[entry->second - 1] = entry->first;
+        writeBinary(stream, contigs);
+        writeBinary(stream, static_cast<uint64_t>(features.size()));
+        for (auto contig = features.begin(); contig != features.end(); ++contig)
+        {
+            writeBinary(stream, contig->first);
+            writeBinary(stream, static_cast<uint64_t>(contig->second.size()));
+            for (auto feat = contig->second.begin(); feat != contig->second.end(); ++feat)
+            {
+                writeBinary(stream, feat->start);
+                writeBinary(stream, feat->end);
+                writeBinary(stream, feat->chromosome);
+                writeBinary(stream, static_cast<int>(feat->strand));
+                writeBinary(stream, static_cast<int>(feat->type));
+                writeBinary(stream, feat->feature_id);
+                writeBinary(stream, feat->gene_id);
+                writeBinary(stream, feat->transcript_type);
+                writeBinary(stream, feat->ribosomal);
+                writeBinary(stream, feat->feature_index);
+                writeBinary(stream, feat->gene_index);
+            }
+        }
+        writeBinary(stream, geneList);
+        writeBinary(stream, exonList);
+        writeBinary(stream, geneIDs);
+        writeBinary(stream, geneNames);
+        writeBinary(stream, exonGeneNames);
+        writeBinary(stream, geneLengths);
+        writeBinary(stream, geneCodingLengths);
+        writeBinary(stream, static_cast<uint64_t>(exonLengths.size()));
+        for (auto exon = exonLengths.begin(); exon != exonLengths.end(); ++exon)
+        {
+            writeBinary(stream, exon->chromosome);
+            writeBinary(stream, exon->start);
+            writeBinary(stream, exon->length);
+        }
+        writeBinary(stream, geneExonOffsets);
+        writeBinary(stream, geneExons);
+
+        const string payload = stream.str();
+        std::ofstream output(filename, std::ios::binary);
+        if (!output.is_open()) throw fileException("Unable to open annotation index for writing: " + filename);
+        writeBinary(output, INDEX_MAGIC);
+        writeBinary(output, INDEX_BYTE_ORDER);
+        writeBinary(output, INDEX_FORMAT);
+        writeBinary(output, legacy);
+        writeBinary(output, static_cast<uint64_t>(payload.size()));
+        writeBinary(output, checksum(payload.data(), payload.size()));
+        output.write(payload.data(), payload.size());
+        output.close();
+        if (!output) throw fileException("Unable to write annotation index: " + filename);
+    }
+
+    void readAnnotationIndex(const string &filename, bool legacy, map<chrom, FeatureList> &features)
+    {
+        // Only the file bytes come from the page cache shared by runs on the same node
+        // The annotation itself is still rebuilt on each process's heap
+        MappedFile file(filename);
+        if (!file.is_open()) throw fileException("Unable to open annotation index: " + filename);
+        MemoryReader buffer(file.data(), file.size());
+        std::istream stream(&buffer);
+        try {
+            string magic;
+            uint32_t byteOrder, format, crc;
+            uint64_t size;
+            bool indexLegacy;
+            readBinary(stream, magic);
+            if (magic != INDEX_MAGIC) throw gtfException("Not an RNA-SeQC annotation index: " + filename);
+            readBinary(stream, byteOrder);
+            if (byteOrder != INDEX_BYTE_ORDER) throw gtfException("The annotation index was written on a machine with a different byte order. Rebuild it with 'rnaseqc index'");
+            readBinary(stream, format);
+            if (format != INDEX_FORMAT) throw gtfException("Unsupported annotation index format version " + std::to_string(format) + ". Rebuild it with 'rnaseqc index'");
+            readBinary(stream, indexLegacy);
+            if (indexLegacy != legacy) throw gtfException(string("The annotation index was built ") + (indexLegacy ? "with" : "without") + " --legacy. Rebuild it with the same setting as this run");
+            readBinary(stream, size);
+            readBinary(stream, crc);
+            const std::size_t offset = static_cast<std::size_t>(stream.tellg());
+            if (size != file.size() - offset) throw gtfException("The annotation index is truncated: " + filename);
+            if (crc != checksum(file.data() + offset, size)) throw gtfException("The annotation index is corrupt (checksum mismatch): " + filename);
+
+            std::vector<string> contigs;
+            readBinary(stream, contigs);
+            std::vector<chrom> ids(contigs.size() + 1, 0);
+            for (std::size_t i = 0; i < contigs.size(); ++i) ids[i + 1] = chromosomeMap(contigs[i]);
+            auto contigID = [&ids](chrom stored) {
+                if (stored == 0 || stored >= ids.size()) throw gtfException("Invalid contig ID in the annotation index");
+                return ids[stored];
+            };
+            readBinary(stream, size);
+            for (uint64_t i = 0; i < size; ++i)
+            {
+                chrom contig;
+                uint64_t count;
+                readBinary(stream, contig);
+                readBinary(stream, count);
+                FeatureList &list = features[contigID(contig)];
+                Feature feat;
+                for (uint64_t j = 0; j < count; ++j)
+                {
+                    int strand, type;
+                    readBinary(stream, feat.start);
+                    readBinary(stream, feat.end);
+                    readBinary(stream, feat.chromosome);
+                    feat.chromosome = contigID(feat.chromosome);
+                    readBinary(stream, strand);
+                    feat.strand = static_cast<Strand>(strand);
+                    readBinary(stream, type);
+                    feat.type = static_cast<FeatureType>(type);
+                    readBinary(stream, feat.feature_id);
+                    readBinary(stream, feat.gene_id);
+                    readBinary(stream, feat.transcript_type);
+                    readBinary(stream, feat.ribosomal);
+                    readBinary(stream, feat.feature_index);
+                    readBinary(stream, feat.gene_index);
+                    list.push_back(feat);
+                }
+            }
+            readBinary(stream, geneList);
+            readBinary(stream, exonList);
+            readBinary(stream, geneIDs);
+            readBinary(stream, geneNames);
+            readBinary(stream, exonGeneNames);
+            readBinary(stream, geneLengths);
+            readBinary(stream, geneCodingLengths);
+            readBinary(stream, size);
+            exonLengths.resize(size);
+            for (auto exon = exonLengths.begin(); exon != exonLengths.end(); ++exon)
+            {
+                readBinary(stream, exon->chromosome);
+                exon->chromosome = contigID(exon->chromosome);
+                readBinary(stream, exon->start);
+                readBinary(stream, exon->length);
+            }
+            readBinary(stream, geneExonOffsets);
+            readBinary(stream, geneExons);
+        }
+        catch (serializationException &e) {
+            throw gtfException("Unable to read the annotation index " + filename + ": " + e.error);
+        }
+    }
+
+    void FeatureList::push_back(const Feature &feature)
+    {
+        records.push_back(feature);
+        starts.push_back(feature.start);
+        ends.push_back(feature.end);
+        active.clear();
+        frontier = head;
+        indexed = false;
+    }
+
+    void FeatureList::append(FeatureList &other)
+    {
+        for (auto feat = other.begin(); feat != other.end(); ++feat) push_back(*feat);
+        other.clear();
+    }
+
+    void FeatureList::sort()
+    {
+        records.erase(records.begin(), records.begin() + head);
+        std::stable_sort(records.begin(), records.end(), compIntervalStart);
+        starts.clear();
+        ends.clear();
+        for (auto feat = records.begin(); feat != records.end(); ++feat)
+        {
+            starts.push_back(feat->start);
+            ends.push_back(feat->end);
+        }
+        active.clear();
+        head = frontier = 0;
+        indexed = false;
+    }
+
+    bool FeatureList::sorted() const
+    {
+        for (size_t i = head + 1; i < starts.size(); ++i) if (starts[i] < starts[i - 1]) return false;
+        return true;
+    }
+
+    void FeatureList::clear()
+    {
+        std::vector<Feature>().swap(records);
+        std::vector<coord>().swap(starts);
+        std::vector<coord>().swap(ends);
+        std::vector<size_t>().swap(active);
+        head = frontier = 0;
+        position = 0;
+        indexed = false;
+        tree = IntervalIndex();
+    }
+
+    void FeatureList::index()
+    {
+        records.erase(records.begin(), records.begin() + head);
+        starts.erase(starts.begin(), starts.begin() + head);
+        ends.erase(ends.begin(), ends.begin() + head);
+        active.clear();
+        head = frontier = 0;
+        tree = IntervalIndex(starts, ends);
+        indexed = true;
+    }
+
+    IntervalIndex::IntervalIndex(const std::vector<coord> &featureStarts, const std::vector<coord> &featureEnds) : order(featureStarts.size()), starts(), ends(), reach(), levels(-1)
+    {
+        const size_t n = order.size();
+        for (size_t i = 0; i < n; ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&featureStarts](size_t a, size_t b) { return featureStarts[a] < featureStarts[b]; });
+        for (auto idx = order.begin(); idx != order.end(); ++idx)
+        {
+            starts.push_back(featureStarts[*idx]);
+            ends.push_back(featureEnds[*idx]);
+        }
+        reach = ends;
+        if (!n) return;
+        // Node i sits at the level given by its number of trailing ones. Leaves are the even positions
+        // Positions past the end of the list are virtual nodes, whose reach is that of the last real node below them
+        size_t last_i = 0;
+        coord last = 0;
+        for (size_t i = 0; i < n; i += 2)
+        {
+            last_i = i;
+            last = reach[i];
+        }
+        int k = 1;
+        for (; (static_cast<size_t>(1) << k) <= n; ++k)
+        {
+            const size_t x = static_cast<size_t>(1) << (k - 1), step = x << 2;
+            for (size_t i = (x << 1) - 1; i < n; i += step)
+            {
+                const coord left = reach[i - x], right = i + x < n ? reach[i + x] : last;
+                reach[i] = std::max(reach[i], std::max(left, right));
+            }
+            last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+            if (last_i < n && reach[last_i] > last) last = reach[last_i];
+        }
+        levels = k - 1;
+    }
+
+    void IntervalIndex::query(coord start, coord end, std::vector<size_t> &output) const
+    {
+        struct Node {
+            size_t x;
+            int k;
+            bool leftDone;
+        };
+        const size_t n = starts.size();
+        if (levels < 0) return;
+        Node stack[64];
+        int depth = 0;
+        stack[depth++] = {(static_cast<size_t>(1) << levels) - 1, levels, false};
+        while (depth)
+        {
+            const Node node = stack[--depth];
+            if (node.k <= 3)
+            {
+                // Small subtrees are scanned directly
+                const size_t first = node.x >> node.k << node.k, last = std::min(n, first + (static_cast<size_t>(1) << (node.k + 1)) - 1);
+                for (size_t i = first; i < last && starts[i] <= end; ++i) if (ends[i] >= start) output.push_back(order[i]);
+            }
+            else if (!node.leftDone)
+            {
+                const size_t left = node.x - (static_cast<size_t>(1) << (node.k - 1));
+                stack[depth++] = {node.x, node.k, true};
+                if (left >= n || reach[left] >= start) stack[depth++] = {left, node.k - 1, false};
+            }
+            else if (node.x < n && starts[node.x] <= end)
+            {
+                if (ends[node.x] >= start) output.push_back(order[node.x]);
+                stack[depth++] = {node.x + (static_cast<size_t>(1) << (node.k - 1)), node.k - 1, false};
+            }
+        }
+    }
+
     int partialIntersect(const Feature &target, const Feature &query)
     {
         return intersectInterval(target, query) ? (
@@ -15,7 +15,9 @@
 #include <map>
 #include <utility>
 #include <vector>
+#include <algorithm>
 #include <sstream>
+#include <memory>
 #include "Fasta.h"
 
 namespace rnaseqc {
@@ -34,6 +36,7 @@ namespace rnaseqc {
         FeatureType type;
         std::string feature_id, gene_id, transcript_type;
         bool ribosomal;
+        unsigned int feature_index, gene_index; // Dense indices of the feature (in geneIDs or exonList) and of its gene. Set by indexFeatures
     };
     
     //For comparing features
@@ -44,19 +47,181 @@ namespace rnaseqc {
     bool intersectInterval(const Feature&, const Feature&);
     int partialIntersect(const Feature&, const Feature&);
 
+    class IntervalIndex {
+        // Immutable implicit interval tree (features sorted by start, each node augmented with the furthest end below it)
+        // Answers intersection queries in any order
+        std::vector<size_t> order; // Position in the source list of each node
+        std::vector<coord> starts, ends, reach;
+        int levels;
+    public:
+        IntervalIndex() : order(), starts(), ends(), reach(), levels(-1) {}
+        IntervalIndex(const std::vector<coord>&, const std::vector<coord>&);
+        // Appends the list positions of every interval intersecting [start, end] (closed), in no particular order
+        void query(coord, coord, std::vector<size_t>&) const;
+    };
+
+    class FeatureList {
+        // The genes and exons (or BED intervals) of one contig, in the order they were loaded. The GTF is sorted by start
+        // Reads sweep through the list in coordinate order. Only the bounds are kept in packed arrays, so the full records are only touched on a hit
+        // Strand, type and gene index stay in the records: every caller reads the record of a hit anyway (feature_index, coverage), so packing them would save nothing
+        // A feature which ends before the current read can never be hit again, so it leaves the active window on its own,
+        // but it is only retired (to compute coverage) once every feature before it has been, as if popped from a queue
+        std::vector<Feature> records;
+        std::vector<coord> starts, ends;
+        std::vector<size_t> active; // Indices of features in the window, in list order
+        size_t head; // First feature not yet retired
+        size_t frontier; // First feature not yet admitted to the window
+        coord position; // Start of the read the list was last trimmed to
+        bool indexed; // Queries go through the interval tree instead of the window, and nothing is retired until the list is dropped
+        IntervalIndex tree;
+        std::vector<size_t> hits;
+        std::vector<const Feature*> matches; // Reused by every intersection, so reads don't allocate
+        bool overlaps(size_t idx, const Feature &block) const {
+            // Same as intersectInterval(block, records[idx])
+            return (starts[idx] >= block.start && starts[idx] <= block.end) || (ends[idx] >= block.start && ends[idx] <= block.end) || (block.start >= starts[idx] && block.start <= ends[idx]);
+        }
+    public:
+        typedef std::vector<Feature>::const_iterator const_iterator;
+        FeatureList() : records(), starts(), ends(), active(), head(0), frontier(0), position(0), indexed(false), tree(), hits(), matches() {}
+
+        // Building the list. These reset the window
+        void push_back(const Feature&);
+        void append(FeatureList&); // Moves the remaining features of the other list onto the end of this one
+        void sort(); // Stable sort by start
+        bool sorted() const; // Whether the remaining features are in order of start
+        void clear();
+        void index(); // Allows reads in any order. Coverage is then only computed once the list is dropped
+
+        // The remaining (unretired) features
+        size_t size() const { return records.size() - head; }
+        bool empty() const { return head == records.size(); }
+        const_iterator begin() const { return records.begin() + head; }
+        const_iterator end() const { return records.end(); }
+
+        // Edits each record in place. Only while building the list, and without changing the bounds
+        template <typename Callback> void update(Callback edit)
+        {
+            for (auto record = records.begin(); record != records.end(); ++record) edit(*record);
+        }
+
+        // Moves the window up to a read starting at the given position. Calls retired(feature) for each feature popped off the front
+        template <typename Callback> void trim(coord pos, Callback retired)
+        {
+            if (indexed) return;
+            position = pos;
+            while (head < records.size() && ends[head] < pos) retired(records[head++]);
+            if (frontier < head) frontier = head;
+            size_t kept = 0;
+            for (size_t i = 0; i < active.size(); ++i) if (ends[active[i]] >= pos) active[kept++] = active[i];
+            active.resize(kept);
+        }
+
+        // Calls hit(feature) for each feature intersecting the block, in list order
+        // Like a scan of the remaining list, this stops at the first feature starting after the block
+        template <typename Callback> void intersect(const Feature &block, Callback hit)
+        {
+            if (indexed)
+            {
+                hits.clear();
+                tree.query(block.start, block.end, hits);
+                std::sort(hits.begin(), hits.end());
+                for (auto idx = hits.begin(); idx != hits.end(); ++idx) hit(records[*idx]);
+                return;
+            }
+            for (size_t i = 0; i < active.size(); ++i)
+            {
+                if (starts[active[i]] > block.end) return;
+                if (overlaps(active[i], block)) hit(records[active[i]]);
+            }
+            for (; frontier < records.size() && starts[frontier] <= block.end; ++frontier)
+            {
+                if (ends[frontier] < position) continue; // Already behind the reads
+                active.push_back(frontier);
+                if (overlaps(frontier, block)) hit(records[frontier]);
+            }
+        }
+
+        // Returns the features intersecting the block, in list order
+        // The result points into the list, and is only valid until the next intersection or change to the list
+        const std::vector<const Feature*>& intersect(const Feature &block)
+        {
+            matches.clear();
+            intersect(block, [this](const Feature &feature) { matches.push_back(&feature); });
+            return matches;
+        }
+    };
+
     struct FeatureSpan {
         chrom chromosome;
         coord start, length;
     };
     
     
-    extern std::map<std::string, std::string> geneNames, geneSeqs;
-extern std::map<std::string, coord> geneLengths, geneCodingLengths;
-    extern std::map<std::string, FeatureSpan> exonLengths;
-    extern std::vector<std::string> geneList, exonList;
-    extern std::map<std::string, std::vector<std::string>> exonsForGene;
-    
+    // Genes and exons are referred to by dense indices, so that counters can be flat arrays. Names are only needed for the reports
+    // exonList and geneList hold the exons and genes declared in the GTF, in order, so exonList[i] is the name of exon i
+    // geneIDs starts with geneList, followed by any gene which is only referenced by its exons
+    const unsigned int NO_GENE = static_cast<unsigned int>(-1);
+    extern std::map<std::string, std::string> geneSeqs;
+    extern std::vector<std::string> geneList, exonList, geneIDs;
+    extern std::vector<std::string> geneNames, exonGeneNames; // By gene index, and by exon index
+    extern std::vector<coord> geneLengths, geneCodingLengths; // By gene index
+    extern std::vector<FeatureSpan> exonLengths; // By exon index
+    extern std::vector<unsigned int> geneExonOffsets, geneExons; // The exons of gene i are geneExons[geneExonOffsets[i]] up to geneExons[geneExonOffsets[i+1]], in order of start
+
+    // Assigns indices to the loaded (and sorted) features, and fills in the tables above
+    void indexFeatures(std::map<chrom, FeatureList>&);
+    const std::string& geneName(unsigned int); // Gene ID for an index. Empty for NO_GENE
+
+    class MappedFile {
+        // A whole file, mapped read-only. Inputs which can't be mapped (such as pipes) are read into memory instead
+        // gzip and BGZF files are inflated into memory. BGZF blocks are inflated on the given number of threads
+        std::string buffer;
+        const char *bytes;
+        std::size_t length;
+        void *mapping;
+        bool opened;
+        MappedFile(const MappedFile&) = delete;
+        void inflate(const std::string&, unsigned int);
+    public:
+        MappedFile(const std::string&, unsigned int = 1);
+        ~MappedFile();
+        bool is_open() const {
+            return this->opened;
+        }
+        const char* data() const {
+            return this->bytes;
+        }
+        std::size_t size() const {
+            return this->length;
+        }
+    };
+
+    struct GTFPipeline;
+    struct GTFChunk;
+
+    class GTFReader {
+        // Reads features straight out of the mapped GTF, without copying lines or building streams
+        // With several threads, chunks of the file are tokenized ahead of time. Features still come out in file order, exactly as with one
+        MappedFile file;
+        std::size_t offset;
+        std::unique_ptr<GTFPipeline> pipeline;
+        GTFChunk *current;
+        std::size_t position;
+        GTFReader(const GTFReader&) = delete;
+    public:
+        GTFReader(const std::string&, unsigned int = 1);
+        ~GTFReader();
+        bool next(Feature&); // Parses the next feature into the given one. Returns false at the end of the file
+    };
+
+    // Precompiled annotations (rnaseqc index) hold everything loadGTF builds: the sorted feature lists and the tables above
+    // Contigs are stored by name and registered in the order the GTF introduced them, so they get the same IDs as when parsing
+    bool isAnnotationIndex(const std::string&); // Whether the file is an index rather than a GTF
+    void writeAnnotationIndex(const std::string&, const std::map<chrom, FeatureList>&, bool); // The flag records if --legacy was used
+    void readAnnotationIndex(const std::string&, bool, std::map<chrom, FeatureList>&); // Rejects an index built with a different --legacy setting
+
     std::ifstream& operator>>(std::ifstream&, Feature&);
+    bool nextColumn(const char*&, const char*, const char*&, const char*&); // Splits the next tab delimited column off of a line
     std::map<std::string,std::string>& parseAttributes(std::string&, std::map<std::string,std::string>&);
 }
 
@@ -7,58 +7,453 @@
 //
 
 #include "Metrics.h"
+#include "Serialize.h"
 #include <iostream>
 #include <math.h>
 #include <cmath>
+#include <cfloat>
 #include <unordered_set>
 #include <algorithm>
 #include <iterator>
 
 namespace rnaseqc {
 
+    std::tuple<double, double, double> computeCoverage(Fasta&, std::ostream&, std::ostream&, const Feature&, const unsigned int, const std::unordered_map<unsigned int, std::vector<uint32_t> >&, QuantileSketch&, BiasCounter&);
 
-    std::map<std::string, double> uniqueGeneCounts, geneCounts, exonCounts, geneFragmentCounts; //counters for read coverage of genes and exons
+    void add_range(std::vector<uint32_t>&, coord, unsigned int);
 
-    std::map<std::string, std::unordered_set<std::string> > fragmentTracker; // tracks fragments encountered by each gene
-    
-    std::tuple<double, double, double> computeCoverage(Fasta&, std::ofstream&, const Feature&, const unsigned int, const std::map<std::string, std::vector<unsigned long> >&, std::map<std::string, ExonCoverage>&, BiasCounter&);
-
-    void add_range(std::vector<unsigned long>&, coord, unsigned int);
+    const char* const METRIC_NAMES[] = {
+        "Alternative Alignments",
+        "Chimeric Fragments_tag",
+        "Chimeric Fragments_auto",
+        "Duplicate Reads",
+        "End 1 Antisense",
+        "End 2 Antisense",
+        "End 1 Bases",
+        "End 2 Bases",
+        "End 1 Mapped Reads",
+        "End 2 Mapped Reads",
+        "End 1 Mismatches",
+        "End 2 Mismatches",
+        "End 1 Sense",
+        "End 2 Sense",
+        "Exonic Reads",
+        "Failed Vendor QC",
+        "High Quality Reads",
+        "Intergenic Reads",
+        "Intragenic Reads",
+        "Ambiguous Reads",
+        "Intronic Reads",
+        "Low Mapping Quality",
+        "Low Quality Reads",
+        "Mapped Duplicate Reads",
+        "Mapped Reads",
+        "Mapped Unique Reads",
+        "Mismatched Bases",
+        "Non-Globin Reads",
+        "Non-Globin Duplicate Reads",
+        "Reads used for Intron/Exon counts",
+        "rRNA Reads",
+        "Split Reads",
+        "Total Bases",
+        "Total Mapped Pairs",
+        "Total Reads",
+        "Unique Mapping, Vendor QC Passed Reads",
+        "Unpaired Reads",
+        "HQ Exonic Reads",
+        "HQ Intronic Reads",
+        "HQ Intergenic Reads",
+        "HQ Intragenic Reads",
+        "HQ Ambiguous Reads",
+        "Duplicate Pairs",
+        "Unique Fragments",
+        "Alignment Blocks"
+    };
 
-    void Metrics::increment(std::string key)
+    void Metrics::increment(const std::string &key)
     {
         this->counter[key]++;
     }
 
-    void Metrics::increment(std::string key, int n)
+    unsigned long Metrics::get(const std::string &key)
     {
-        this->counter[key] += n;
+        return this->counter[key];
     }
 
-    unsigned long Metrics::get(std::string key)
+    double Metrics::frac(MetricKey a, MetricKey b) const
     {
-        return this->counter[key];
+        return static_cast<double>(this->get(a)) / this->get(b);
     }
 
-    double Metrics::frac(std::string a, std::string b)
+    void Metrics::merge(const Metrics &other)
     {
-        return static_cast<double>(this->get(a)) / this->get(b);
+        for (std::size_t key = 0; key < METRIC_KEYS; ++key)
+            this->values[key] += other.values[key];
+        for (auto entry = other.counter.begin(); entry != other.counter.end(); ++entry)
+            this->counter[entry->first] += entry->second;
+    }
+
+    void Metrics::save(std::ostream &stream) const
+    {
+        for (std::size_t key = 0; key < METRIC_KEYS; ++key)
+            writeBinary(stream, this->values[key]);
+        writeBinary(stream, this->counter);
+    }
+
+    void Metrics::load(std::istream &stream)
+    {
+        for (std::size_t key = 0; key < METRIC_KEYS; ++key)
+            readBinary(stream, this->values[key]);
+        readBinary(stream, this->counter);
+    }
+
+    double expectedUniqueFragments(double librarySize, double reads)
+    {
+        return librarySize * (1.0 - exp(-1.0 * reads / librarySize)); //lander-waterman
+    }
+
+    // Smallest whole library size in [first, last] whose expected unique fragments exceed the target, or last + 1 if there is none
+    // Expected unique fragments grow with the library size, but the computed value carries rounding error of a few ulps of the size,
+    // which can outweigh the growth per step for large libraries. So bisection only looks for a size safely below the target,
+    // and the sizes after it are checked one by one, exactly as a full scan would
+    double firstLibrarySizeAbove(double target, double reads, double first, double last)
+    {
+        auto below = [target, reads](double size) {
+            return expectedUniqueFragments(size, reads) <= target - 16.0 * DBL_EPSILON * size;
+        };
+        double size = first;
+        if (below(first))
+        {
+            double high = last + 1.0; // below(low) always holds. high is past the end, or a size which isn't safely below
+            while (high - size > 1.0)
+            {
+                const double mid = floor((size + high) / 2.0);
+                if (below(mid)) size = mid;
+                else high = mid;
+            }
+            ++size;
+        }
+        for (; size <= last; ++size) if (expectedUniqueFragments(size, reads) > target) return size;
+        return last + 1.0;
+    }
+
+    unsigned int estimateLibraryComplexity(double unique, double reads)
+    {
+        // The estimate is the smallest library size (searching whole sizes upwards from the unique count) whose expected unique
+        // fragments are closest to the observed count, with the distance truncated to whole fragments
+        // The distance shrinks as the library grows, by less than a fragment per step, until it reaches zero
+        if (unique >= LIBRARY_SIZE_LIMIT) return 0u;
+        const double last = LIBRARY_SIZE_LIMIT - 1.0;
+        double distance = 0.0; // The smallest distance reached
+        if (firstLibrarySizeAbove(unique - 1.0, reads, unique, last) > last)
+        {
+            // No size comes within one fragment. The closest is at the end of the range, give or take rounding error
+            distance = floor(unique - expectedUniqueFragments(last, reads));
+            while (distance > 0.0 && firstLibrarySizeAbove(unique - distance, reads, unique, last) <= last) --distance;
+        }
+        return static_cast<unsigned int>(firstLibrarySizeAbove(unique - 1.0 - distance, reads, unique, last));
+    }
+
+    uint64_t readFingerprint(const std::string &name)
+    {
+        // FNV-1a, followed by the splitmix64 finalizer to spread the bits into the low end used for probing
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (auto c = name.begin(); c != name.end(); ++c)
+        {
+            hash ^= static_cast<unsigned char>(*c);
+            hash *= 0x100000001b3ull;
+        }
+        hash ^= hash >> 30;
+        hash *= 0xbf58476d1ce4e5b9ull;
+        hash ^= hash >> 27;
+        hash *= 0x94d049bb133111ebull;
+        hash ^= hash >> 31;
+        return hash ? hash : 1ull;
+    }
+
+    bool FingerprintSet::insert(uint64_t fingerprint)
+    {
+        if ((this->count + 1) * 4 > this->slots.size() * 3) this->grow();
+        const std::size_t mask = this->slots.size() - 1;
+        for (std::size_t slot = fingerprint & mask; ; slot = (slot + 1) & mask)
+        {
+            if (this->slots[slot] == fingerprint) return false;
+            if (!this->slots[slot])
+            {
+                this->slots[slot] = fingerprint;
+                ++this->count;
+                return true;
+            }
+        }
+    }
+
+    void FingerprintSet::grow()
+    {
+        std::vector<uint64_t> old(this->slots.empty() ? 16 : this->slots.size() * 2, 0ull);
+        old.swap(this->slots);
+        const std::size_t mask = this->slots.size() - 1;
+        for (auto fingerprint = old.begin(); fingerprint != old.end(); ++fingerprint) if (*fingerprint)
+        {
+            std::size_t slot = *fingerprint & mask;
+            while (this->slots[slot]) slot = (slot + 1) & mask;
+            this->slots[slot] = *fingerprint;
+        }
+    }
+
+    void FingerprintSet::release()
+    {
+        std::vector<uint64_t>().swap(this->slots);
+        this->count = 0;
+    }
+
+    void LengthHistogram::add(unsigned int length, unsigned long count)
+    {
+        if (length < DENSE_LENGTHS)
+        {
+            if (length >= this->dense.size()) this->dense.resize(length + 1, 0ul);
+            this->dense[length] += count;
+        }
+        else this->sparse[length] += count;
+        this->total += count;
+        this->sum += static_cast<unsigned long long>(length) * count;
+    }
+
+    void LengthHistogram::merge(const LengthHistogram &other)
+    {
+        if (other.dense.size() > this->dense.size()) this->dense.resize(other.dense.size(), 0ul);
+        for (std::size_t length = 0; length < other.dense.size(); ++length) this->dense[length] += other.dense[length];
+        for (auto entry = other.sparse.begin(); entry != other.sparse.end(); ++entry) this->sparse[entry->first] += entry->second;
+        this->total += other.total;
+        this->sum += other.sum;
+    }
+
+    unsigned int LengthHistogram::at(unsigned long long rank) const
+    {
+        for (std::size_t length = 0; length < this->dense.size(); ++length)
+        {
+            if (rank < this->dense[length]) return length;
+            rank -= this->dense[length];
+        }
+        for (auto entry = this->sparse.begin(); entry != this->sparse.end(); ++entry)
+        {
+            if (rank < entry->second) return entry->first;
+            rank -= entry->second;
+        }
+        return this->max();
+    }
+
+    unsigned int LengthHistogram::max() const
+    {
+        if (this->sparse.size()) return this->sparse.rbegin()->first;
+        for (std::size_t length = this->dense.size(); length > 0; --length) if (this->dense[length - 1]) return length - 1;
+        return 0u;
+    }
+
+    double LengthHistogram::median() const
+    {
+        if (this->total <= 1) return this->at(0);
+        const unsigned long long midpoint = (this->total - 1) / 2;
+        if (this->total % 2) return (static_cast<double>(this->at(midpoint)) + static_cast<double>(this->at(midpoint + 1))) / 2.0;
+        return static_cast<double>(this->at(midpoint));
+    }
+
+    void LengthHistogram::save(std::ostream &stream) const
+    {
+        std::map<unsigned int, unsigned long> lengths(this->sparse);
+        for (std::size_t length = 0; length < this->dense.size(); ++length) if (this->dense[length]) lengths[length] = this->dense[length];
+        writeBinary(stream, lengths);
+    }
+
+    void LengthHistogram::load(std::istream &stream)
+    {
+        std::map<unsigned int, unsigned long> lengths;
+        readBinary(stream, lengths);
+        *this = LengthHistogram();
+        for (auto entry = lengths.begin(); entry != lengths.end(); ++entry) this->add(entry->first, entry->second);
+    }
+
+    const double QuantileSketch::RELATIVE_ACCURACY = 1e-3;
+
+    void QuantileSketch::bin(double value, unsigned long long count)
+    {
+        static const double logGamma = std::log((1.0 + RELATIVE_ACCURACY) / (1.0 - RELATIVE_ACCURACY));
+        if (value > 0.0) this->buckets[static_cast<int>(std::ceil(std::log(value) / logGamma))] += count;
+        else this->zeros += count;
+    }
+
+    void QuantileSketch::compress()
+    {
+        for (auto value = this->values.begin(); value != this->values.end(); ++value) this->bin(*value);
+        std::vector<double>().swap(this->values);
+        this->exact = false;
+    }
+
+    std::map<double, unsigned long long> QuantileSketch::histogram() const
+    {
+        const double gamma = (1.0 + RELATIVE_ACCURACY) / (1.0 - RELATIVE_ACCURACY);
+        std::map<double, unsigned long long> counts;
+        if (this->zeros) counts[0.0] = this->zeros;
+        for (auto bucket = this->buckets.begin(); bucket != this->buckets.end(); ++bucket)
+            counts[2.0 * std::pow(gamma, bucket->first) / (gamma + 1.0)] += bucket->second;
+        return counts;
+    }
+
+    void QuantileSketch::add(double value)
+    {
+        ++this->total;
+        if (!this->exact) this->bin(value);
+        else
+        {
+            this->values.push_back(value > 0.0 ? value : 0.0);
+            if (this->values.size() > EXACT_VALUES) this->compress();
+        }
+    }
+
+    void QuantileSketch::merge(const QuantileSketch &other)
+    {
+        this->total += other.total;
+        if (this->exact && other.exact && this->values.size() + other.values.size() <= EXACT_VALUES)
+        {
+            this->values.insert(this->values.end(), other.values.begin(), other.values.end());
+            return;
+        }
+        if (this->exact) this->compress();
+        for (auto value = other.values.begin(); value != other.values.end(); ++value) this->bin(*value);
+        for (auto bucket = other.buckets.begin(); bucket != other.buckets.end(); ++bucket) this->buckets[bucket->first] += bucket->second;
+        this->zeros += other.zeros;
+    }
+
+    double QuantileSketch::median()
+    {
+        if (this->exact) return selectMedian(this->values);
+        return histogramMedian(this->histogram(), this->total);
+    }
+
+    double QuantileSketch::medianDeviation()
+    {
+        const double median = this->median();
+        if (this->exact)
+        {
+            std::vector<double> deviations;
+            deviations.reserve(this->values.size());
+            for (auto value = this->values.begin(); value != this->values.end(); ++value) deviations.push_back(std::fabs(*value - median));
+            return selectMedian(deviations);
+        }
+        const std::map<double, unsigned long long> counts = this->histogram();
+        std::map<double, unsigned long long> deviations;
+        for (auto entry = counts.begin(); entry != counts.end(); ++entry) deviations[std::fabs(entry->first - median)] += entry->second;
+        return histogramMedian(deviations, this->total);
+    }
+
+    void QuantileSketch::save(std::ostream &stream) const
+    {
+        writeBinary(stream, this->exact);
+        writeBinary(stream, this->total);
+        writeBinary(stream, this->zeros);
+        writeBinary(stream, this->values);
+        writeBinary(stream, this->buckets);
+    }
+
+    void QuantileSketch::load(std::istream &stream)
+    {
+        readBinary(stream, this->exact);
+        readBinary(stream, this->total);
+        readBinary(stream, this->zeros);
+        readBinary(stream, this->values);
+        readBinary(stream, this->buckets);
+    }
+
+    void FeatureCounts::coverAll()
+    {
+        this->uniqueGeneCounts.cover(0, geneIDs.size());
+        this->geneCounts.cover(0, geneIDs.size());
+        this->geneFragmentCounts.cover(0, geneIDs.size());
+        this->fragmentTracker.cover(0, geneIDs.size());
+        this->exonCounts.cover(0, exonList.size());
+    }
+
+    void FeatureCounts::cover(const FeatureList &features)
+    {
+        std::size_t firstGene = geneIDs.size(), lastGene = 0, firstExon = exonList.size(), lastExon = 0;
+        for (auto feat = features.begin(); feat != features.end(); ++feat)
+        {
+            firstGene = std::min<std::size_t>(firstGene, feat->gene_index);
+            lastGene = std::max<std::size_t>(lastGene, feat->gene_index + 1);
+            if (feat->type == FeatureType::Exon)
+            {
+                firstExon = std::min<std::size_t>(firstExon, feat->feature_index);
+                lastExon = std::max<std::size_t>(lastExon, feat->feature_index + 1);
+            }
+        }
+        this->uniqueGeneCounts.cover(firstGene, lastGene);
+        this->geneCounts.cover(firstGene, lastGene);
+        this->geneFragmentCounts.cover(firstGene, lastGene);
+        this->fragmentTracker.cover(firstGene, lastGene);
+        this->exonCounts.cover(firstExon, lastExon);
+    }
+
+    // Genes never span two runs, so adding onto an untouched counter reproduces the single-run value exactly
+    void FeatureCounts::merge(const FeatureCounts &other)
+    {
+        this->uniqueGeneCounts.merge(other.uniqueGeneCounts);
+        this->geneCounts.merge(other.geneCounts);
+        this->exonCounts.merge(other.exonCounts);
+        this->geneFragmentCounts.merge(other.geneFragmentCounts);
+    }
+
+    // Coverage is only ever added in positive amounts, so any exon which was hit has a nonzero count
+    unsigned long FeatureCounts::countedExons() const
+    {
+        const std::vector<double> &counts = this->exonCounts.data();
+        return counts.size() - std::count(counts.begin(), counts.end(), 0.0);
+    }
+
+    void saveCounts(std::ostream &stream, const IndexedCounts<double> &counts)
+    {
+        writeBinary(stream, static_cast<uint64_t>(counts.begin()));
+        writeBinary(stream, counts.data());
+    }
+
+    void loadCounts(std::istream &stream, IndexedCounts<double> &counts, std::size_t limit)
+    {
+        uint64_t first;
+        std::vector<double> values;
+        readBinary(stream, first);
+        readBinary(stream, values);
+        if (first + values.size() > limit) throw serializationException("Counts do not match the annotation");
+        counts.load(first, values);
+    }
+
+    void FeatureCounts::save(std::ostream &stream) const
+    {
+        saveCounts(stream, this->uniqueGeneCounts);
+        saveCounts(stream, this->geneCounts);
+        saveCounts(stream, this->exonCounts);
+        saveCounts(stream, this->geneFragmentCounts);
+    }
+
+    void FeatureCounts::load(std::istream &stream)
+    {
+        loadCounts(stream, this->uniqueGeneCounts, geneIDs.size());
+        loadCounts(stream, this->geneCounts, geneIDs.size());
+        loadCounts(stream, this->exonCounts, exonList.size());
+        loadCounts(stream, this->geneFragmentCounts, geneIDs.size());
     }
 
     // Add coverage to an exon
-    void Collector::add(const std::string &gene_id, const std::string &exon_id, const double coverage)
+    void Collector::add(const unsigned int gene, const unsigned int exon, const double coverage)
     {
         if (coverage > 0)
         {
-            this->data[gene_id].push_back(std::pair<std::string, double>(exon_id, coverage));
+            this->data[gene].push_back(std::pair<unsigned int, double>(exon, coverage));
             this->dirty = true;
         }
     }
 
     //Commit all the exon coverage from this gene to the global exon coverage counter
-    void Collector::collect(const std::string &gene_id)
+    void Collector::collect(const unsigned int gene)
     {
-        for (auto entry = this->data[gene_id].begin(); entry != this->data[gene_id].end(); ++entry)
+        for (auto entry = this->data[gene].begin(); entry != this->data[gene].end(); ++entry)
         {
             (*this->target)[entry->first] += entry->second;
             this->total += entry->second;
@@ -66,18 +461,18 @@ namespace rnaseqc {
     }
 
     //Legacy version of the above function. Ignores the actual coverage and reports a full read count
-    void Collector::collectSingle(const std::string &gene_id)
+    void Collector::collectSingle(const unsigned int gene)
     {
-        for (auto entry = this->data[gene_id].begin(); entry != this->data[gene_id].end(); ++entry)
+        for (auto entry = this->data[gene].begin(); entry != this->data[gene].end(); ++entry)
         {
             (*this->target)[entry->first] += 1.0;
         }
     }
 
     //Check if there is any coverage on any exon of this gene
-    bool Collector::queryGene(const std::string &gene_id)
+    bool Collector::queryGene(const unsigned int gene)
     {
-        return static_cast<bool>(this->data[gene_id].size());
+        return static_cast<bool>(this->data[gene].size());
     }
 
     // Check if any coverage has been reported whatsoever
@@ -98,27 +493,28 @@ namespace rnaseqc {
         CoverageEntry tmp;
         tmp.offset = start - exon.start;
         tmp.length = end - start;
-        tmp.feature_id = exon.feature_id;
-        this->cache[exon.gene_id].push_back(tmp);
+        tmp.exon = exon.feature_index;
+        this->cache[exon.gene_index].push_back(tmp);
     }
 
     //Commit the cached coverage to this gene after deciding to count the read towards the gene
-    void BaseCoverage::commit(const std::string &gene_id)
+    void BaseCoverage::commit(const unsigned int gene)
     {
-        if (this->seen.count(gene_id))
+        if (this->seen.count(gene))
         {
-            std::cerr << "Gene encountered after computing coverage " << gene_id << std::endl;
+            std::cerr << "Gene encountered after computing coverage " << geneName(gene) << std::endl;
             return;
         }
-        auto beg = this->cache[gene_id].begin();
-        auto end = this->cache[gene_id].end();
+        auto beg = this->cache[gene].begin();
+        auto end = this->cache[gene].end();
         while (beg != end)
         {
-            if (this->coverage.find(beg->feature_id) == this->coverage.end()) this->coverage[beg->feature_id] = std::vector<unsigned long>(exonLengths[beg->feature_id].length, 0ul);
-            //Add each coverage entry to the per-base coverage vector for the exon
-            //At this stage exons each have their own vectors.
-            //During the compute() step, exons get stiched together
-            add_range(this->coverage[beg->feature_id], beg->offset, beg->length);
+            std::vector<uint32_t> &exonCoverage = this->coverage[beg->exon];
+            if (exonCoverage.empty()) exonCoverage.assign(exonLengths[beg->exon].length + 1, 0u);
+            //Add each coverage entry to the difference array for the exon. That's two updates per block, regardless of its length
+            //At this stage exons each have their own arrays.
+            //During the compute() step, the per-base depth is summed up and exons get stiched together
+            add_range(exonCoverage, beg->offset, beg->length);
             ++beg;
         }
     }
@@ -131,33 +527,73 @@ namespace rnaseqc {
     //computes per-base coverage of the gene
     void BaseCoverage::compute(const Feature &gene)
     {
-        //Coverage is stored in EID -> coverage vector
-        //First iterate over all exons of the gene and ensure they're filled
-        //That way, stiching the exons will result in a complete transcript even for exons which haven't been seen
-        for (auto exon_id = exonsForGene[gene.feature_id].begin(); exon_id != exonsForGene[gene.feature_id].end(); ++exon_id)
-            if (this->coverage.find(*exon_id) == this->coverage.end()) this->coverage[*exon_id] = std::vector<unsigned long>(exonLengths[*exon_id].length, 0ul);
-        //then compute coverage for the gene
-        std::tuple<double, double, double> results = computeCoverage(this->fastaReader, this->writer, gene, this->mask_size, this->coverage, this->exonCoverage, this->bias);
+        //Coverage is stored in EID -> difference array. Exons which haven't been seen have no array, and are stiched in as zeros
+        const auto first = geneExons.begin() + geneExonOffsets[gene.feature_index], last = geneExons.begin() + geneExonOffsets[gene.feature_index + 1];
+        //compute coverage for the gene
+        std::tuple<double, double, double> results = computeCoverage(this->fastaReader, this->writer, this->exonWriter, gene, this->mask_size, this->coverage, this->exonCVs, this->bias);
         if (std::get<0>(results) != -1)
         {
-            this->geneMeans.push_back(std::get<0>(results));
-            this->geneStds.push_back(std::get<1>(results));
-            this->geneCVs.push_back(std::get<2>(results));
+            this->geneMeans.add(std::get<0>(results));
+            this->geneStds.add(std::get<1>(results));
+            if (!(std::isnan(std::get<2>(results)) || std::isinf(std::get<2>(results)))) this->geneCVs.add(std::get<2>(results));
         }
         //Now clean out the coverage map to save memory
-        for (auto exon_id = exonsForGene[gene.feature_id].begin(); exon_id != exonsForGene[gene.feature_id].end(); ++exon_id)
-            this->coverage.erase(*exon_id);
-        this->seen.insert(gene.feature_id);
+        for (auto exon = first; exon != last; ++exon)
+            this->coverage.erase(*exon);
+        this->seen.insert(gene.feature_index);
     }
 
     void BaseCoverage::close()
     {
         this->writer.flush();
-        this->writer.close();
+        this->fileWriter.close();
+        this->exonWriter.flush();
+        this->exonFileWriter.close();
+    }
+
+    CoverageRows BaseCoverage::takeBuffer()
+    {
+        CoverageRows rows;
+        rows.genes = this->bufferWriter.str();
+        rows.exons = this->exonBufferWriter.str();
+        this->bufferWriter.str("");
+        this->exonBufferWriter.str("");
+        return rows;
+    }
+
+    void BaseCoverage::write(const CoverageRows &rows)
+    {
+        this->writer << rows.genes;
+        this->exonWriter << rows.exons;
+    }
+
+    void BaseCoverage::merge(BaseCoverage &other)
+    {
+        this->geneMeans.merge(other.geneMeans);
+        this->geneStds.merge(other.geneStds);
+        this->geneCVs.merge(other.geneCVs);
+        this->exonCVs.merge(other.exonCVs);
+        this->seen.insert(other.seen.begin(), other.seen.end());
+    }
+
+    void BaseCoverage::save(std::ostream &stream) const
+    {
+        this->geneMeans.save(stream);
+        this->geneStds.save(stream);
+        this->geneCVs.save(stream);
+        this->exonCVs.save(stream);
+    }
+
+    void BaseCoverage::load(std::istream &stream)
+    {
+        this->geneMeans.load(stream);
+        this->geneStds.load(stream);
+        this->geneCVs.load(stream);
+        this->exonCVs.load(stream);
     }
 
     //Compute 3'/5' bias based on genes' per-base coverage
-    void BiasCounter::computeBias(const Feature &gene, std::vector<unsigned long> &coverage)
+    void BiasCounter::computeBias(const Feature &gene, std::vector<uint32_t> &coverage)
     {
 
         if (coverage.size() < this->geneLength) return; //Must meet minimum length req
@@ -169,24 +605,21 @@ namespace rnaseqc {
           peak = coverage[i];
         }
         auto coverageMedianPos = coverage.begin() + peak_pos;
-        std::list<unsigned long> coveragePeakEntries;
+        unsigned long coveragePeakEntries = 0ul;
         //First scroll half a window to the right of the peak (stop if we reach the end)
         for (int i = 0; i < this->windowSize/2 && coverageMedianPos != coverage.end(); ++i) ++coverageMedianPos;
-        //Then scroll back 1 full window, adding entries to the list
-        for (int i = 0; i < this->windowSize && coverageMedianPos != coverage.begin(); ++i) coveragePeakEntries.push_back(*(coverageMedianPos--));
-        coveragePeakEntries.sort();
-        double coveragePeakMedian = computeMedian(coveragePeakEntries.size(), coverageMedianPos);
+        //Then scroll back 1 full window, counting the entries passed
+        for (int i = 0; i < this->windowSize && coverageMedianPos != coverage.begin(); ++i, --coverageMedianPos) ++coveragePeakEntries;
+        double coveragePeakMedian = computeMedian(coveragePeakEntries, coverageMedianPos);
         
 
         if (coveragePeakMedian >= 100) {
-            std::vector<unsigned long> percentileContainer(coverage);
-            std::sort(percentileContainer.begin(), percentileContainer.end());
-            {
-                auto xcursor = percentileContainer.begin();
-                while (xcursor != percentileContainer.end() && (*xcursor) == 0ul) ++xcursor;
-                percentileContainer.erase(percentileContainer.begin(), xcursor);
-            }
-            unsigned long lowerLimit = percentileContainer[percentileContainer.size()*0.05];
+            //Select the 5th percentile of the nonzero depths, rather than sorting all of them
+            this->depths.clear();
+            for (auto depth = coverage.begin(); depth != coverage.end(); ++depth) if (*depth) this->depths.push_back(*depth);
+            const auto percentile = this->depths.begin() + static_cast<std::size_t>(this->depths.size()*0.05);
+            std::nth_element(this->depths.begin(), percentile, this->depths.end());
+            unsigned long lowerLimit = *percentile;
             unsigned long trimmed_length = 0ul;
             
             {
@@ -207,24 +640,21 @@ namespace rnaseqc {
 
             if (coverage.size() >= this->geneLength)
             {
-                double windowSize = static_cast<double>(this->windowSize);
-                std::vector<double> lcov, rcov;
-                lcov.reserve(this->windowSize);
-                rcov.reserve(this->windowSize);
+                std::vector<double> &lcov = this->lcov, &rcov = this->rcov;
+                lcov.clear();
+                rcov.clear();
                 for (unsigned int i = this->offset; i < this->offset + this->windowSize && i < coverage.size(); ++i)
                     lcov.push_back(static_cast<double>(coverage[i]));
                 for (int i = coverage.size() - (this->windowSize + this->offset); i >= 0 && i < coverage.size() - this->offset; ++i)
                     rcov.push_back(static_cast<double>(coverage[i]));
-                std::sort(lcov.begin(), lcov.end());
-                std::sort(rcov.begin(), rcov.end());
                 if (gene.strand == Strand::Forward)
                 {
-                    this->threeEnd[gene.feature_id] += computeMedian(rcov.size(), rcov.begin());
-                    this->fiveEnd[gene.feature_id] += computeMedian(lcov.size(), lcov.begin());
+                    this->threeEnd[gene.feature_id] += selectMedian(rcov);
+                    this->fiveEnd[gene.feature_id] += selectMedian(lcov);
                 } else
                 {
-                    this->threeEnd[gene.feature_id] += computeMedian(lcov.size(), lcov.begin());
-                    this->fiveEnd[gene.feature_id] += computeMedian(rcov.size(), rcov.begin());
+                    this->threeEnd[gene.feature_id] += selectMedian(lcov);
+                    this->fiveEnd[gene.feature_id] += selectMedian(rcov);
                 }
                 
             }
@@ -248,87 +678,121 @@ namespace rnaseqc {
         return -1.0;
     }
     
+    void BiasCounter::merge(const BiasCounter &other)
+    {
+        for (auto entry = other.fiveEnd.begin(); entry != other.fiveEnd.end(); ++entry)
+            this->fiveEnd[entry->first] += entry->second;
+        for (auto entry = other.threeEnd.begin(); entry != other.threeEnd.end(); ++entry)
+            this->threeEnd[entry->first] += entry->second;
+    }
+    
+    void BiasCounter::save(std::ostream &stream) const
+    {
+        writeBinary(stream, this->fiveEnd);
+        writeBinary(stream, this->threeEnd);
+    }
+
+    void BiasCounter::load(std::istream &stream)
+    {
+        readBinary(stream, this->fiveEnd);
+        readBinary(stream, this->threeEnd);
+    }
+
     unsigned int BiasCounter::countGenes() const
     {
         return this->countedGenes;
     }
 
 
-    void add_range(std::vector<unsigned long> &coverage, coord offset, unsigned int length)
+    void add_range(std::vector<uint32_t> &coverage, coord offset, unsigned int length)
     {
-        const size_t size = coverage.size();
-        for (coord i = offset; i < offset + length && i < size; ++i) coverage[i] += 1ul;
+        // Depth is recovered by a running sum, which comes out right modulo 2^32 even though the array itself wraps below zero
+        const size_t size = coverage.size() - 1;
+        if (length && offset < size)
+        {
+            coverage[offset] += 1u;
+            coverage[std::min<size_t>(offset + length, size)] -= 1u;
+        }
         if (offset + length > size) std::cerr << "Error: Attempted to write more coverage than present on exon. Coverage-based metrics may be inaccurate. This may be a sign of an invalid bam or gtf entry" << std::endl;
     }
 
-    //Compute exon coverage metrics, then stich exons together and compute gene coverage metrics
-    std::tuple<double, double, double> computeCoverage(Fasta& fastaReader, std::ofstream &writer, const Feature &gene, const unsigned int mask_size, const std::map<std::string, std::vector<unsigned long> > &coverage, std::map<std::string, ExonCoverage>& totalExonCV, BiasCounter &bias)
+    // Mean and standard deviation of the depths in [begin, end), which must not be empty
+    // The sum is exact, so the mean is correctly rounded. The variance takes a second pass over the (cached) range,
+    // with independent accumulators so the loop can be vectorized without reassociating floating point math
+    // Both agree with summing x/n and (x-mean)^2/n base by base to within about 1e-12 relative
+    std::pair<double, double> depthMoments(const uint32_t *begin, const uint32_t *end)
     {
-        std::vector<std::vector<bool> > coverageMask;
-        std::vector<unsigned long> geneCoverage;
-        unsigned int maskRemainder = mask_size;
-        for (unsigned int i = 0; i < exonsForGene[gene.feature_id].size(); ++i)
+        const std::size_t n = end - begin;
+        unsigned long long sum = 0ull;
+        for (const uint32_t *depth = begin; depth != end; ++depth) sum += *depth;
+        const double size = static_cast<double>(n), mean = static_cast<double>(sum) / size;
+        double squares[4] = {0.0, 0.0, 0.0, 0.0};
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            for (std::size_t lane = 0; lane < 4; ++lane)
+            {
+                const double deviation = static_cast<double>(begin[i + lane]) - mean;
+                squares[lane] += deviation * deviation;
+            }
+        for (; i < n; ++i)
         {
-            coverageMask.push_back(std::vector<bool>(exonLengths[exonsForGene[gene.feature_id][i]].length, true)); //First store a pre-filled mask for the exon
-            for (unsigned int j = 0; j < coverageMask.back().size() && maskRemainder; ++j, --maskRemainder) //now, remove coverage from the front of the exon until either it, or the mask size is depleted
-                coverageMask.back()[j] = false;
+            const double deviation = static_cast<double>(begin[i]) - mean;
+            squares[0] += deviation * deviation;
         }
-        maskRemainder = mask_size; //reset the exon mask to mask out the end
-        for (int i = exonsForGene[gene.feature_id].size() - 1; i >= 0 && maskRemainder; --i) //repeat the process, masking out regions from the back until the mask size is depleted
-            for (int j = coverageMask[i].size() - 1; j >= 0 && maskRemainder; --j, --maskRemainder)
-                coverageMask[i][j] = false;
-        for (unsigned int i = 0; i < exonsForGene[gene.feature_id].size(); ++i)
-        {
-            const std::vector<unsigned long> &exon_coverage = coverage.at(exonsForGene[gene.feature_id][i]); //get the coverage vector for the current exon
-            double exonMean = 0.0, exonStd = 0.0, exonSize = 0.0;
-            std::vector<bool> mask = coverageMask[i];
+        return std::make_pair(mean, std::sqrt(((squares[0] + squares[1]) + (squares[2] + squares[3])) / size));
+    }
 
-            for (unsigned int j = 0; j < mask.size(); ++j) if (mask[j]) exonSize += 1.0; //count the remaining unmasked length of the exon
-            if (exonSize > 0)
+    //Compute exon coverage metrics, then stich exons together and compute gene coverage metrics
+    std::tuple<double, double, double> computeCoverage(Fasta& fastaReader, std::ostream &writer, std::ostream &exonWriter, const Feature &gene, const unsigned int mask_size, const std::unordered_map<unsigned int, std::vector<uint32_t> > &coverage, QuantileSketch &exonCVs, BiasCounter &bias)
+    {
+        const unsigned int *exons = geneExons.data() + geneExonOffsets[gene.feature_index];
+        const std::size_t exonCount = geneExonOffsets[gene.feature_index + 1] - geneExonOffsets[gene.feature_index];
+        std::size_t transcriptLength = 0;
+        for (unsigned int i = 0; i < exonCount; ++i) transcriptLength += exonLengths[exons[i]].length;
+        std::vector<uint32_t> geneCoverage(transcriptLength, 0u);
+        //The mask removes mask_size bases from each end of the stiched transcript, so the unmasked bases are one range of it
+        const std::size_t unmaskedStart = mask_size, unmaskedEnd = transcriptLength > mask_size ? transcriptLength - mask_size : 0;
+        std::size_t exonStart = 0;
+        for (unsigned int i = 0; i < exonCount; ++i)
+        {
+            // Sum up the difference array for the current exon into its place in the gene vector
+            const std::size_t exonEnd = exonStart + exonLengths[exons[i]].length;
+            auto diff = coverage.find(exons[i]);
+            if (diff != coverage.end())
             {
-                auto maskIter = mask.begin();
-                for (auto start = exon_coverage.begin(); start != exon_coverage.end(); ++start)
-                    if (*(maskIter++)) exonMean += static_cast<double>(*start) / exonSize;
-                maskIter = mask.begin();
-                for (auto start = exon_coverage.begin(); start != exon_coverage.end(); ++start)
-                    if (*(maskIter++)) exonStd += pow(static_cast<double>(*start) - exonMean, 2.0) / exonSize;
-                exonStd = pow(exonStd, 0.5);
-                exonStd /= exonMean; //now it's a CV
+                uint32_t depth = 0u;
+                for (std::size_t j = exonStart; j < exonEnd; ++j) geneCoverage[j] = depth += diff->second[j - exonStart];
+            }
+            const std::size_t first = std::max(exonStart, unmaskedStart), last = std::min(exonEnd, unmaskedEnd);
+            if (first < last) //if any of the exon is left unmasked
+            {
+                const std::pair<double, double> moments = depthMoments(geneCoverage.data() + first, geneCoverage.data() + last);
+                const double exonCV = moments.second / moments.first;
                 
-                if (!(std::isnan(exonStd) || std::isinf(exonStd))) {
-                    FeatureSpan exonPos = exonLengths[exonsForGene[gene.feature_id][i]];
-                    if (fastaReader.hasContig(exonPos.chromosome)) {
-                        std::string exonSeq = fastaReader.getSeq(exonPos.chromosome, exonPos.start, exonPos.start + exonPos.length);
-                        totalExonCV[exonsForGene[gene.feature_id][i]] = {exonStd, gc(exonSeq)};
-                    } else totalExonCV[exonsForGene[gene.feature_id][i]] = {exonStd, -1.0};
+                if (!(std::isnan(exonCV) || std::isinf(exonCV))) {
+                    exonCVs.add(exonCV);
+                    exonWriter << exonList[exons[i]] << "\t" << exonCV;
+                    if (fastaReader.isOpen()) {
+                        FeatureSpan exonPos = exonLengths[exons[i]];
+                        if (fastaReader.hasContig(exonPos.chromosome)) {
+                            std::string exonSeq = fastaReader.getSeq(exonPos.chromosome, exonPos.start, exonPos.start + exonPos.length);
+                            exonWriter << "\t" << gc(exonSeq);
+                        } else exonWriter << "\t" << -1.0;
+                    }
+                    exonWriter << std::endl;
                 }
             }
-            // Reserve and append the exon vector to the growing gene vector
-            geneCoverage.reserve(geneCoverage.size() + exon_coverage.size());
-            geneCoverage.insert(geneCoverage.end(), exon_coverage.begin(), exon_coverage.end());
+            exonStart = exonEnd;
         }
         //at this point the gene coverage vector represents an UNMASKED, but complete transcript
         bias.computeBias(gene, geneCoverage); //no masking in bias
-        double avg = 0.0, std = 0.0;
-        // apply the mask to the full gene vector
-        if (mask_size)
-        {
-            //to account for the mask, erase bases from the vector
-            //If the mask is larger than the gene, just erase all of it
-            //Otherwise, erase from (end-mask) -> end
-            geneCoverage.erase((mask_size > geneCoverage.size() ? geneCoverage.begin() : geneCoverage.end() - mask_size), geneCoverage.end());
-            // If there is still coverage area, erase from the front to either the end (if the mask is larger than remaining coverage) or to (front + mask)
-            if (geneCoverage.size()) geneCoverage.erase(geneCoverage.begin(), (mask_size > geneCoverage.size() ? geneCoverage.end() : geneCoverage.begin() + mask_size));
-        }
-        double size = static_cast<double>(geneCoverage.size());
+        // apply the mask to the full gene vector. Bias may have trimmed low coverage off the ends, so the range is taken afterwards
+        const std::size_t geneStart = std::min<std::size_t>(mask_size, geneCoverage.size()), geneEnd = geneCoverage.size() > mask_size ? geneCoverage.size() - mask_size : 0;
         writer << gene.feature_id << "\t";
-        if (size > 0) //If there's still any coverage after applying the mask
+        if (geneStart < geneEnd) //If there's still any coverage after applying the mask
         {
-            for (auto beg = geneCoverage.begin(); beg != geneCoverage.end(); ++beg)
-                avg += static_cast<double>(*beg) / size;
-            for (auto base = geneCoverage.begin(); base != geneCoverage.end(); ++base)
-                std += std::pow(static_cast<double>(*base) - avg, 2.0) / size;
-            std = std::pow(std, 0.5);
+            const std::pair<double, double> moments = depthMoments(geneCoverage.data() + geneStart, geneCoverage.data() + geneEnd);
+            const double avg = moments.first, std = moments.second;
             writer << avg << "\t" << std << "\t" << (std / avg) << std::endl;
             return std::make_tuple(avg, std, (std / avg));
         }
@@ -336,65 +800,65 @@ namespace rnaseqc {
         return std::make_tuple(-1, -1, -1);
     }
 
-
 }
 
 std::ofstream& operator<<(std::ofstream &stream, rnaseqc::Metrics &counter)
 {
-    std::vector<std::string> keys =  {
-        //"Alternative Alignments",
+    using rnaseqc::MetricKey;
+    const std::vector<MetricKey> keys =  {
+        //MetricKey::AlternativeAlignments,
         //"Chimeric Reads",
-        "Duplicate Reads",
-        "End 1 Antisense",
-        "End 2 Antisense",
-        "End 1 Bases",
-        "End 2 Bases",
-        "End 1 Mapped Reads",
-        "End 2 Mapped Reads",
-        "End 1 Mismatches",
-        "End 2 Mismatches",
-        "End 1 Sense",
-        "End 2 Sense",
-        "Exonic Reads",
-        "Failed Vendor QC",
-        "High Quality Reads",
-        "Intergenic Reads",
-        "Intragenic Reads",
-        "Ambiguous Reads",
-        "Intronic Reads",
-        "Low Mapping Quality",
-        "Low Quality Reads",
-        "Mapped Duplicate Reads",
-        "Mapped Reads",
-        "Mapped Unique Reads",
-        "Mismatched Bases",
-        "Non-Globin Reads",
-        "Non-Globin Duplicate Reads",
-        "Reads used for Intron/Exon counts",
-        "rRNA Reads",
-        "Split Reads",
-        "Total Bases",
-        "Total Mapped Pairs",
-        "Total Reads",
-        "Unique Mapping, Vendor QC Passed Reads",
-        "Unpaired Reads"
+        MetricKey::DuplicateReads,
+        MetricKey::End1Antisense,
+        MetricKey::End2Antisense,
+        MetricKey::End1Bases,
+        MetricKey::End2Bases,
+        MetricKey::End1MappedReads,
+        MetricKey::End2MappedReads,
+        MetricKey::End1Mismatches,
+        MetricKey::End2Mismatches,
+        MetricKey::End1Sense,
+        MetricKey::End2Sense,
+        MetricKey::ExonicReads,
+        MetricKey::FailedVendorQC,
+        MetricKey::HighQualityReads,
+        MetricKey::IntergenicReads,
+        MetricKey::IntragenicReads,
+        MetricKey::AmbiguousReads,
+        MetricKey::IntronicReads,
+        MetricKey::LowMappingQuality,
+        MetricKey::LowQualityReads,
+        MetricKey::MappedDuplicateReads,
+        MetricKey::MappedReads,
+        MetricKey::MappedUniqueReads,
+        MetricKey::MismatchedBases,
+        MetricKey::NonGlobinReads,
+        MetricKey::NonGlobinDuplicateReads,
+        MetricKey::ReadsUsedForCounts,
+        MetricKey::RRNAReads,
+        MetricKey::SplitReads,
+        MetricKey::TotalBases,
+        MetricKey::TotalMappedPairs,
+        MetricKey::TotalReads,
+        MetricKey::UniqueMappingQCPassedReads,
+        MetricKey::UnpairedReads
     };
-    stream << "Alternative Alignments\t" << counter.get("Alternative Alignments") << std::endl;
+    stream << "Alternative Alignments\t" << counter.get(MetricKey::AlternativeAlignments) << std::endl;
     stream << "Chimeric Fragments\t";
-    if (counter.get("Chimeric Fragments_tag"))
+    if (counter.get(MetricKey::ChimericFragmentsTag))
     {
-        stream << counter.get("Chimeric Fragments_tag") << std::endl;
-        stream << "Chimeric Alignment Rate\t" << counter.frac("Chimeric Fragments_tag", "Total Mapped Pairs") << std::endl;
+        stream << counter.get(MetricKey::ChimericFragmentsTag) << std::endl;
+        stream << "Chimeric Alignment Rate\t" << counter.frac(MetricKey::ChimericFragmentsTag, MetricKey::TotalMappedPairs) << std::endl;
     }
     else
     {
-        stream << counter.get("Chimeric Fragments_auto") << std::endl;
-        stream << "Chimeric Alignment Rate\t" << counter.frac("Chimeric Fragments_auto", "Total Mapped Pairs") << std::endl;
+        stream << counter.get(MetricKey::ChimericFragmentsAuto) << std::endl;
+        stream << "Chimeric Alignment Rate\t" << counter.frac(MetricKey::ChimericFragmentsAuto, MetricKey::TotalMappedPairs) << std::endl;
 
     }
     for (int i = 0; i < keys.size(); ++i)
-        if (keys[i] != "Split Reads" || counter.get("Split Reads"))
-            stream << keys[i] << "\t" << counter.get(keys[i]) << std::endl;
+        if (keys[i] != MetricKey::SplitReads || counter.get(MetricKey::SplitReads))
+            stream << rnaseqc::METRIC_NAMES[keys[i]] << "\t" << counter.get(keys[i]) << std::endl;
     auto beg = counter.counter.begin();
     auto end = counter.counter.end();
     while (beg != end)
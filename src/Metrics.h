@@ -19,7 +19,11 @@
 #include <tuple>
 #include <list>
 #include <unordered_set>
+#include <unordered_map>
 #include <iterator>
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
 
 namespace rnaseqc {
     class Metrics;
@@ -28,33 +32,177 @@ namespace rnaseqc {
 std::ofstream& operator<<(std::ofstream&, rnaseqc::Metrics&);
 
 namespace rnaseqc {
+    enum MetricKey {
+        // Counters known at compile time. Names are in METRIC_NAMES, in the same order
+        AlternativeAlignments,
+        ChimericFragmentsTag,
+        ChimericFragmentsAuto,
+        DuplicateReads,
+        End1Antisense,
+        End2Antisense,
+        End1Bases,
+        End2Bases,
+        End1MappedReads,
+        End2MappedReads,
+        End1Mismatches,
+        End2Mismatches,
+        End1Sense,
+        End2Sense,
+        ExonicReads,
+        FailedVendorQC,
+        HighQualityReads,
+        IntergenicReads,
+        IntragenicReads,
+        AmbiguousReads,
+        IntronicReads,
+        LowMappingQuality,
+        LowQualityReads,
+        MappedDuplicateReads,
+        MappedReads,
+        MappedUniqueReads,
+        MismatchedBases,
+        NonGlobinReads,
+        NonGlobinDuplicateReads,
+        ReadsUsedForCounts,
+        RRNAReads,
+        SplitReads,
+        TotalBases,
+        TotalMappedPairs,
+        TotalReads,
+        UniqueMappingQCPassedReads,
+        UnpairedReads,
+        HQExonicReads,
+        HQIntronicReads,
+        HQIntergenicReads,
+        HQIntragenicReads,
+        HQAmbiguousReads,
+        DuplicatePairs,
+        UniqueFragments,
+        AlignmentBlocks,
+        METRIC_KEYS // Number of known counters
+    };
+    extern const char* const METRIC_NAMES[];
+
     class Metrics {
-        // For storing arbitrary counters
+        // Known counters are a flat array indexed by MetricKey, aligned and padded out to whole cache lines so that per-thread trackers don't share one
+        // Keys only known at runtime (such as tag filters) go in a side map
+        static const std::size_t CACHE_LINE = 64;
+        static const std::size_t PADDED_KEYS = (METRIC_KEYS * sizeof(unsigned long) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE / sizeof(unsigned long);
+        alignas(CACHE_LINE) unsigned long values[PADDED_KEYS];
         std::map<std::string, unsigned long> counter;
     public:
-        Metrics() : counter(){};
-        void increment(std::string);
-        void increment(std::string, int);
-        unsigned long get(std::string);
-        double frac(std::string, std::string);
+        Metrics() : values(), counter(){};
+        void increment(MetricKey key) {
+            ++this->values[key];
+        }
+        void increment(MetricKey key, int n) {
+            this->values[key] += n;
+        }
+        unsigned long get(MetricKey key) const {
+            return this->values[key];
+        }
+        double frac(MetricKey, MetricKey) const;
+        void increment(const std::string&);
+        unsigned long get(const std::string&);
+        void merge(const Metrics&); //Adds all counters from another tracker
+        void save(std::ostream&) const;
+        void load(std::istream&);
         friend std::ofstream& ::operator<<(std::ofstream&, Metrics&);
     };
     
+    template <typename T> class IndexedCounts {
+        // A flat array over a window of gene or exon indices
+        // The main processor covers every index. Workers only cover the indices of their own features, and grow as they merge
+        std::size_t base;
+        std::vector<T> values;
+    public:
+        IndexedCounts() : base(0), values() {}
+        void cover(std::size_t first, std::size_t last) // Resets to cover [first, last)
+        {
+            this->base = first;
+            this->values.assign(last > first ? last - first : 0, T());
+        }
+        std::size_t begin() const {
+            return this->base;
+        }
+        std::size_t end() const {
+            return this->base + this->values.size();
+        }
+        T& operator[](std::size_t idx) { //Unchecked. The index must be covered
+            return this->values[idx - this->base];
+        }
+        T get(std::size_t idx) const {
+            return idx >= this->begin() && idx < this->end() ? this->values[idx - this->base] : T();
+        }
+        void merge(const IndexedCounts &other)
+        {
+            if (other.values.empty()) return;
+            if (this->values.empty()) this->base = other.base;
+            if (other.begin() < this->begin())
+            {
+                this->values.insert(this->values.begin(), this->begin() - other.begin(), T());
+                this->base = other.base;
+            }
+            if (other.end() > this->end()) this->values.resize(other.end() - this->base, T());
+            for (std::size_t i = other.begin(); i < other.end(); ++i) this->values[i - this->base] += other.values[i - other.base];
+        }
+        const std::vector<T>& data() const {
+            return this->values;
+        }
+        void load(std::size_t first, std::vector<T> &data)
+        {
+            this->base = first;
+            this->values.swap(data);
+        }
+    };
+
+    const double LIBRARY_SIZE_LIMIT = 1e9; // Library complexity estimates are searched up to (but not including) this size
+    double expectedUniqueFragments(double, double); // Lander-Waterman: unique fragments expected from sampling reads from a library of the given size
+    unsigned int estimateLibraryComplexity(double, double); // Estimated library size, from the unique fragments observed among all fragments sequenced
+
+    // 64-bit fingerprint of a read name, used to recognise the mates of a fragment without keeping the name. Never zero
+    uint64_t readFingerprint(const std::string&);
+
+    class FingerprintSet {
+        // Open-addressing set of read fingerprints, with linear probing. Zero marks an empty slot
+        // Two different names in the same gene collide with probability about n^2 / 2^65,
+        // so even a gene with ten million fragments has roughly a one in 370,000 chance of undercounting a single fragment
+        std::vector<uint64_t> slots;
+        std::size_t count;
+        void grow();
+    public:
+        FingerprintSet() : slots(), count(0) {}
+        bool insert(uint64_t); // Returns true if the fingerprint was not already present
+        void release(); // Empties the set and frees its storage
+    };
+
+    struct FeatureCounts {
+        // Counters for read coverage of genes and exons, indexed by gene or exon index
+        IndexedCounts<double> uniqueGeneCounts, geneCounts, exonCounts, geneFragmentCounts;
+        IndexedCounts<FingerprintSet> fragmentTracker; // tracks fragments encountered by each gene
+        void coverAll(); // Covers every gene and exon in the annotation
+        void cover(const FeatureList&); // Covers the genes and exons in the list
+        void merge(const FeatureCounts&); //Adds counts from a run over a disjoint set of genes
+        unsigned long countedExons() const; // Exons which received any coverage
+        void save(std::ostream&) const; //The fragment tracker is not saved. It only matters while reads are being processed
+        void load(std::istream&);
+    };
+    
     class Collector {
         // For temporarily holding coverage on a read before we're ready to commit that coverage to a gene
-        std::map<std::string, std::vector<std::pair<std::string, double> > > data;
-        std::map<std::string, double> *target;
+        std::map<unsigned int, std::vector<std::pair<unsigned int, double> > > data;
+        IndexedCounts<double> *target;
         bool dirty;
         double total;
     public:
-        Collector(std::map<std::string, double> *dataTarget) : data(), target(dataTarget), dirty(false), total(0.0)
+        Collector(IndexedCounts<double> *dataTarget) : data(), target(dataTarget), dirty(false), total(0.0)
         {
             
         }
-        void add(const std::string&, const std::string&, const double);
-        void collect(const std::string&);
-        void collectSingle(const std::string&); //for legacy exon detection
-        bool queryGene(const std::string&);
+        void add(const unsigned int, const unsigned int, const double);
+        void collect(const unsigned int);
+        void collectSingle(const unsigned int); //for legacy exon detection
+        bool queryGene(const unsigned int);
         bool isDirty();
         double sum();
     };
@@ -63,9 +211,61 @@ namespace rnaseqc {
         // Represents a single segment of aligned read bases for base-coverage computation
         coord offset;
         unsigned int length;
-        std::string feature_id;
+        unsigned int exon;
     };
     
+    class LengthHistogram {
+        // Exact counts of read lengths, for order statistics without keeping every length
+        // Lengths below DENSE_LENGTHS go in an array that only grows as far as the longest of them seen so far
+        // Longer lengths (long read libraries) are spread too thinly for an array, so they are kept in a map
+        static const unsigned int DENSE_LENGTHS = 1u << 16;
+        std::vector<unsigned long> dense;
+        std::map<unsigned int, unsigned long> sparse;
+        unsigned long long total, sum;
+    public:
+        LengthHistogram() : dense(), sparse(), total(0ull), sum(0ull) {}
+        void add(unsigned int, unsigned long = 1ul);
+        void merge(const LengthHistogram&);
+        unsigned long long count() const {
+            return this->total;
+        }
+        unsigned long long lengthSum() const {
+            return this->sum;
+        }
+        unsigned int at(unsigned long long) const; // The length at this rank, as if the lengths were sorted. 0 if empty
+        unsigned int max() const;
+        double median() const; // Follows the same convention as computeMedian
+        void save(std::ostream&) const;
+        void load(std::istream&);
+    };
+
+    class QuantileSketch {
+        // Median and median deviation of a stream of non-negative values (negative values are counted as zero)
+        // Up to EXACT_VALUES values are kept as they are, so small inputs get exactly the same answers as computeMedian
+        // Past that, values are binned into buckets of logarithmic width, each within RELATIVE_ACCURACY of every value in it
+        // The number of buckets only depends on the range of the values, not how many there are. Sketches can be merged in any order
+        static const std::size_t EXACT_VALUES = 1u << 12; // About the memory of the buckets for a typical spread of coverage values
+        static const double RELATIVE_ACCURACY;
+        std::vector<double> values;
+        std::map<int, unsigned long long> buckets; // bucket -> count of values in (gamma^(bucket - 1), gamma^bucket]
+        unsigned long long zeros, total;
+        bool exact;
+        void bin(double, unsigned long long = 1ull);
+        void compress(); // Moves the exact values into buckets
+        std::map<double, unsigned long long> histogram() const; // Bucket midpoints -> counts
+    public:
+        QuantileSketch() : values(), buckets(), zeros(0ull), total(0ull), exact(true) {}
+        void add(double);
+        void merge(const QuantileSketch&);
+        unsigned long long count() const {
+            return this->total;
+        }
+        double median(); // Follows the same convention as computeMedian. Exact values are reordered
+        double medianDeviation(); // Median of the absolute deviations from the median
+        void save(std::ostream&) const;
+        void load(std::istream&);
+    };
+
     class BiasCounter {
         // For counting 3'/5' bias coverage
         const int offset;
@@ -75,65 +275,92 @@ namespace rnaseqc {
         unsigned int countedGenes;
         std::map<std::string, unsigned long> fiveEnd;
         std::map<std::string, unsigned long> threeEnd;
+        std::vector<uint32_t> depths; // Scratch space for the percentile, reused between genes
+        std::vector<double> lcov, rcov; // Scratch space for the window medians
     public:
-        BiasCounter(int offset, int windowSize, unsigned long geneLength, unsigned int detectionThreshold) : offset(offset), windowSize(windowSize), geneLength(geneLength), detectionThreshold(detectionThreshold), countedGenes(0), fiveEnd(), threeEnd()
+        BiasCounter(int offset, int windowSize, unsigned long geneLength, unsigned int detectionThreshold) : offset(offset), windowSize(windowSize), geneLength(geneLength), detectionThreshold(detectionThreshold), countedGenes(0), fiveEnd(), threeEnd(), depths(), lcov(), rcov()
         {
             
         }
         
-        void computeBias(const Feature&, std::vector<unsigned long>&);
+        void computeBias(const Feature&, std::vector<uint32_t>&);
         unsigned int countGenes() const;
         double getBias(const std::string&);
+        void merge(const BiasCounter&);
+        void save(std::ostream&) const;
+        void load(std::istream&);
         const unsigned int getThreshold() const {
             return this->detectionThreshold;
         }
     };
 
-    struct ExonCoverage {
-        double cv;
-        double gc;
+    struct CoverageRows {
+        // Pre-formatted rows of the gene coverage and exon CV reports
+        std::string genes, exons;
+        CoverageRows& operator+=(const CoverageRows &other) {
+            this->genes += other.genes;
+            this->exons += other.exons;
+            return *this;
+        }
     };
     
     class BaseCoverage {
         // For computing per-base coverage of genes
         Fasta& fastaReader;
-        std::map<std::string, std::vector<CoverageEntry> > cache; //GID -> Entry<EID> tmp cache as exon hits are recorded
-        std::map<std::string, std::vector<unsigned long> > coverage; //EID -> Coverage vector for exons still in window
-        std::map<std::string, ExonCoverage> exonCoverage;
-        std::ofstream writer;
+        std::map<unsigned int, std::vector<CoverageEntry> > cache; //Gene -> Entry<Exon> tmp cache as exon hits are recorded
+        std::unordered_map<unsigned int, std::vector<uint32_t> > coverage; //Exon -> Difference array of coverage (+1 where a block starts, -1 past where it ends) for exons still in window
+        std::ofstream fileWriter, exonFileWriter;
+        std::ostringstream bufferWriter, exonBufferWriter;
+        std::ostream &writer, &exonWriter; //Gene coverage rows, and exon CV rows (written as each gene is computed)
         const unsigned int mask_size;
-        std::list<double> geneMeans, geneStds, geneCVs;
+        QuantileSketch geneMeans, geneStds, geneCVs, exonCVs;
         BiasCounter &bias;
-        std::unordered_set<std::string> seen;
+        std::unordered_set<unsigned int> seen;
         BaseCoverage(const BaseCoverage&) = delete; //No!
     public:
-        BaseCoverage(Fasta& fasta, const std::string &filename, const unsigned int mask, bool openFile, BiasCounter &biasCounter) : fastaReader(fasta), coverage(), exonCoverage(), cache(), writer(openFile ? filename : "/dev/null"), mask_size(mask), geneMeans(), geneStds(), geneCVs(), bias(biasCounter), seen()
+        BaseCoverage(Fasta& fasta, const std::string &filename, const std::string &exonFilename, const unsigned int mask, bool openFile, bool gcContent, BiasCounter &biasCounter) : fastaReader(fasta), cache(), coverage(), fileWriter(openFile ? filename : "/dev/null"), exonFileWriter(exonFilename), bufferWriter(), exonBufferWriter(), writer(fileWriter), exonWriter(exonFileWriter), mask_size(mask), geneMeans(), geneStds(), geneCVs(), exonCVs(), bias(biasCounter), seen()
         {
-            if ((!this->writer.is_open()) && openFile) throw std::runtime_error("Unable to open BaseCoverage output file");
+            if ((!this->fileWriter.is_open()) && openFile) throw std::runtime_error("Unable to open BaseCoverage output file");
+            if (!this->exonFileWriter.is_open()) throw std::runtime_error("Unable to open exon CV output file");
             this->writer << "gene_id\tcoverage_mean\tcoverage_std\tcoverage_CV" << std::endl;
+            this->exonWriter << "Exon ID\tExon CV";
+            if (gcContent) this->exonWriter << "\tGC Content";
+            this->exonWriter << std::endl;
+        }
+        
+        // Buffered coverage (no header). Used by workers whose rows are later spliced into the main report in order
+        // If the gene coverage rows won't be written anyway, their buffer is disabled to save memory. Exon CV rows are always kept
+        BaseCoverage(Fasta& fasta, const unsigned int mask, bool keepRows, BiasCounter &biasCounter) : fastaReader(fasta), cache(), coverage(), fileWriter(), exonFileWriter(), bufferWriter(), exonBufferWriter(), writer(bufferWriter), exonWriter(exonBufferWriter), mask_size(mask), geneMeans(), geneStds(), geneCVs(), exonCVs(), bias(biasCounter), seen()
+        {
+            if (!keepRows) this->bufferWriter.setstate(std::ios::badbit);
         }
         
         void add(const Feature&, const coord, const coord); //Adds to the cache
-        void commit(const std::string&); //moves one gene out of the cache and adds hits to exon coverage vector
+        void commit(const unsigned int); //moves one gene out of the cache and adds hits to exon coverage vector
         void reset(); //Empties the cache
         //    void clearCoverage(); //empties out data that won't be used
         void compute(const Feature&); //Computes the per-base coverage for all transcripts in the gene
         void close(); //Flush and close the ofstream
+        CoverageRows takeBuffer(); //Returns and clears the rows written so far (buffered coverage only)
+        void write(const CoverageRows&); //Appends pre-formatted rows to the outputs
+        void merge(BaseCoverage&); //Absorbs the per-gene and per-exon summaries of another (buffered) coverage tracker
+        void save(std::ostream&) const; //Saves the per-gene and per-exon summaries. Coverage rows are handled by the caller
+        void load(std::istream&);
         BiasCounter& getBiasCounter() const {
             return this->bias;
         }
-        const std::map<std::string, ExonCoverage>& getExonCoverage() const {
-            return this->exonCoverage;
-        }
-        std::list<double>& getGeneMeans() {
+        QuantileSketch& getGeneMeans() {
             return this->geneMeans;
         }
-        std::list<double>& getGeneStds() {
+        QuantileSketch& getGeneStds() {
             return this->geneStds;
         }
-        std::list<double>& getGeneCVs() {
+        QuantileSketch& getGeneCVs() {
             return this->geneCVs;
         }
+        QuantileSketch& getExonCVs() {
+            return this->exonCVs;
+        }
     };
 
     template <typename T> void sortContainer(T &data) {
@@ -159,6 +386,16 @@ namespace rnaseqc {
         return static_cast<double>(*iterator);
     }
 
+    // Same result as computeMedian over the sorted data, found by selection instead of sorting. Reorders the data
+    template <typename T> double selectMedian(std::vector<T> &data)
+    {
+        if (data.size() <= 1) return computeMedian(data.size(), data.begin());
+        const auto midpoint = data.begin() + (data.size() - 1) / 2;
+        std::nth_element(data.begin(), midpoint, data.end());
+        if (data.size() % 2) return (static_cast<double>(*midpoint) + static_cast<double>(*std::min_element(midpoint + 1, data.end()))) / 2.0;
+        return static_cast<double>(*midpoint);
+    }
+
     typedef std::tuple<double, double, double, double> statsTuple;
     
     enum StatIdx {avg = 0, med = 1, std = 2, mad = 3, skew = 1, kurt = 3};
@@ -204,9 +441,65 @@ namespace rnaseqc {
         double std = pow(m2/count, 0.5);
         return statsTuple(avg, m3 / count / pow(std, 3.0), std, (count * m4) / (m2 * m2) - 3);
     }
-    
-    extern std::map<std::string, double> uniqueGeneCounts, geneCounts, exonCounts, geneFragmentCounts; //counters for read coverage of genes and exons
-    extern std::map<std::string, std::unordered_set<std::string> > fragmentTracker; // tracks fragments encountered by each gene
+
+    // Statistics over a histogram of (value, count) pairs in ascending order of value, such as a map of value -> count
+    // These follow getStatistics and getAdvancedStatistics over the expanded samples, without ever expanding them
+
+    template <typename H> double histogramRank(const H &histogram, unsigned long long rank) // The value at this rank among the samples
+    {
+        for (auto entry = histogram.begin(); entry != histogram.end(); ++entry)
+        {
+            if (rank < entry->second) return static_cast<double>(entry->first);
+            rank -= entry->second;
+        }
+        return NAN;
+    }
+
+    template <typename H> double histogramMedian(const H &histogram, unsigned long long size) // Same convention as computeMedian
+    {
+        if (size <= 1) return histogramRank(histogram, 0ull);
+        const unsigned long long midpoint = (size - 1) / 2;
+        if (size % 2) return (histogramRank(histogram, midpoint) + histogramRank(histogram, midpoint + 1)) / 2.0;
+        return histogramRank(histogram, midpoint);
+    }
+
+    template <typename H>
+    statsTuple getHistogramStatistics(const H &histogram) {
+        unsigned long long samples = 0ull;
+        for (auto entry = histogram.begin(); entry != histogram.end(); ++entry) samples += entry->second;
+        if (!samples) return statsTuple(NAN, NAN, NAN, NAN);
+        double avg = 0.0, std = 0.0;
+        const double size = static_cast<double>(samples), median = histogramMedian(histogram, samples);
+        std::map<double, unsigned long long> deviations;
+        for (auto entry = histogram.begin(); entry != histogram.end(); ++entry) {
+            avg += static_cast<double>(entry->first) * static_cast<double>(entry->second) / size;
+            deviations[fabs(static_cast<double>(entry->first) - median)] += entry->second;
+        }
+        double medDev = histogramMedian(deviations, samples) * 1.4826;
+        for (auto entry = histogram.begin(); entry != histogram.end(); ++entry)
+            std += static_cast<double>(entry->second) * pow(static_cast<double>(entry->first) - avg, 2.0) / size;
+        std = pow(std, 0.5);
+        return statsTuple(avg, median, std, medDev);
+    }
+
+    template <typename H>
+    statsTuple getAdvancedHistogramStatistics(const H &histogram) {
+        double count = 0.0, sum = 0.0, m2 = 0.0, m3 = 0.0, m4 = 0.0;
+        for (auto entry = histogram.begin(); entry != histogram.end(); ++entry) {
+            count += static_cast<double>(entry->second);
+            sum += static_cast<double>(entry->first) * static_cast<double>(entry->second);
+        }
+        if (!count) return statsTuple(NAN, NAN, NAN, NAN);
+        const double avg = sum / count;
+        for (auto entry = histogram.begin(); entry != histogram.end(); ++entry) {
+            const double delta = static_cast<double>(entry->first) - avg, delta2 = delta * delta, weight = static_cast<double>(entry->second);
+            m2 += weight * delta2;
+            m3 += weight * delta2 * delta;
+            m4 += weight * delta2 * delta2;
+        }
+        double std = pow(m2/count, 0.5);
+        return statsTuple(avg, m3 / count / pow(std, 3.0), std, (count * m4) / (m2 * m2) - 3);
+    }
 }
 
 #endif /* Metrics_h */
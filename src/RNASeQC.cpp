@@ -4,9 +4,13 @@
 
 //Include headers
 #include "BED.h"
-#include "Expression.h"
+#include "Engine.h"
+#include "Serialize.h"
+#include "Collapse.h"
 #include <string>
 #include <iostream>
+#include <sstream>
+#include <memory>
 #include <stdio.h>
 #include <set>
 #include <regex>
@@ -14,6 +18,8 @@
 #include <limits.h>
 #include <math.h>
 #include <unordered_set>
+#include <atomic>
+#include <thread>
 #include "../args.hxx"
 #include <boost/filesystem.hpp>
 #include <htslib/sam.h>
@@ -21,29 +27,31 @@ using namespace std;
 using namespace args;
 using namespace rnaseqc;
 
-const string NM = "NM";
 const string VERSION = "RNASeQC 2.4.2";
 const double MAD_FACTOR = 1.4826;
-const unsigned int LEGACY_MAX_READ_LENGTH = 100000u;
-const int LEGACY_SPLIT_DISTANCE = 100;
-map<string, double> tpms;
 
-bool compGenes(const string&, const string&);
 void add_range(vector<unsigned long>&, coord, unsigned int);
 double reduceDeltaCV(list<double>&);
-bool readStringTag(Alignment&, string, string&);
+void loadGTF(const string&, bool, int, unsigned int, map<chrom, FeatureList>&);
+void writeReport(ReadProcessor&, const QCOptions&, const ReportOptions&, const string&);
+int mergePartials(int, char*[]);
+int buildIndex(int, char*[]);
+int collapseGTF(int, char*[]);
 
 int main(int argc, char* argv[])
 {
+    if (argc > 1 && string(argv[1]) == "merge") return mergePartials(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "index") return buildIndex(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "collapse") return collapseGTF(argc - 1, argv + 1);
     //Set up command line syntax
     ArgumentParser parser(VERSION);
     HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
     Flag versionFlag(parser, "version", "Display the version and quit", {"version"});
-    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bam against");
-    Positional<string> bamFile(parser, "bam", "The input SAM/BAM file containing reads to process");
+    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bam against. May be gzip or BGZF compressed, or an annotation index made by 'rnaseqc index'");
+    Positional<string> bamFile(parser, "bam", "The input SAM/BAM file containing reads to process. Use '-' to read from stdin");
     Positional<string> outputDir(parser, "output", "Output directory");
     ValueFlag<string> sampleName(parser, "sample", "The name of the current sample.  Default: The bam's filename", {'s', "sample"});
-    ValueFlag<string> bedFile(parser, "BEDFILE", "Optional input BED file containing non-overlapping exons used for fragment size calculations", {"bed"});
+    ValueFlag<string> bedFile(parser, "BEDFILE", "Optional input BED file containing non-overlapping exons used for fragment size calculations. May be gzip or BGZF compressed", {"bed"});
     ValueFlag<string> fastaFile(parser, "fasta", "Optional input FASTA/FASTQ file containing the reference sequence used for parsing CRAM files", {"fasta"});
     ValueFlag<int> chimericDistance(parser, "DISTANCE", "Set the maximum accepted distance between read mates.  Mates beyond this distance will be counted as chimeric pairs. Default: 2000000 [bp]", {"chimeric-distance"});
     ValueFlag<unsigned int> fragmentSamples(parser, "SAMPLES", "Set the number of samples to take when computing fragment sizes.  Requires the --bed argument. Default: 1000000", {"fragment-samples"});
@@ -58,10 +66,15 @@ int main(int argc, char* argv[])
     ValueFlagList<string> filterTags(parser, "TAG", "Filter out reads with the specified tag.", {'t', "tag"});
     ValueFlag<string> chimericTag(parser, "TAG", "Reads maked with the specified tag will be labeled as Chimeric.  Defaults to 'ch' for STAR", {"chimeric-tag"});
     Flag excludeChimeric(parser, "exclude-chimeric", "Exclude chimeric reads from the read counts", {"exclude-chimeric"});
+    Flag requireSorted(parser, "require-sorted", "Abort if the input is not coordinate sorted, instead of warning. Useful when streaming from another program", {"require-sorted"});
+    Flag unsortedInput(parser, "unsorted", "Accept alignments in any order, such as unsorted aligner output. Features are indexed instead of swept, and coverage is computed after the whole bam has been read, which uses more memory", {"unsorted"});
     Flag unpaired(parser, "unparied", "Allow unpaired reads to be quantified. Required for single-end libraries", {'u', "unpaired"});
     Flag useRPKM(parser, "rpkm", "Output gene RPKM values instead of TPMs", {"rpkm"});
     Flag outputTranscriptCoverage(parser, "coverage", "If this flag is provided, coverage statistics for each transcript will be written to a table. Otherwise, only summary coverage statistics are generated and added to the metrics table", {"coverage"});
     ValueFlag<unsigned int> coverageMaskSize(parser, "SIZE", "Sets how many bases at both ends of a transcript are masked out when computing per-base exon coverage. Default: 500bp", {"coverage-mask"});
+    ValueFlag<unsigned int> threads(parser, "THREADS", "Number of threads to use. With an indexed BAM/CRAM, contigs are split into chunks which are processed in parallel. Otherwise, reads are decoded on a separate thread. The GTF is also parsed with this many threads. Default: 1", {"threads"});
+    ValueFlag<string> shard(parser, "i/N", "Only process shard i of N (counting from 1), and write a partial result instead of the reports. Shards are made of whole contigs, and require an indexed BAM/CRAM. Use 'rnaseqc merge' to combine the partials", {"shard"});
+    ValueFlag<unsigned int> decodeThreads(parser, "THREADS", "Number of additional threads used by htslib to decompress the BAM/CRAM. Default: 0", {"decode-threads"});
     ValueFlag<unsigned int> detectionThreshold(parser, "threshold", "Number of counts on a gene to consider the gene 'detected'. Additionally, genes below this limit are excluded from 3' bias computation. Default: 5 reads", {'d', "detection-threshold"});
 	try
 	{
@@ -74,6 +87,8 @@ int main(int argc, char* argv[])
         if (!gtfFile) throw ValidationError("No GTF file provided");
         if (!bamFile) throw ValidationError("No BAM file provided");
         if (!outputDir) throw ValidationError("No output directory provided");
+        if (bamFile.Get() == "-" && !sampleName) throw ValidationError("A sample name (-s) is required when reading from stdin");
+        if (requireSorted && unsortedInput) throw ValidationError("--require-sorted and --unsorted are mutually exclusive");
 
         Strand STRAND_ORIENTATION = Strand::Unknown;
         if (strandSpecific)
@@ -98,62 +113,32 @@ int main(int argc, char* argv[])
         const string chimeric_tag = chimericTag ? chimericTag.Get() : "ch";
         const string SAMPLENAME = sampleName ? sampleName.Get() : boost::filesystem::path(bamFile.Get()).filename().string();
         const unsigned int DETECTION_THRESHOLD = detectionThreshold ? detectionThreshold.Get() : 5u;
+        const unsigned int THREADS = threads ? threads.Get() : 1u;
+        const unsigned int DECODE_THREADS = decodeThreads ? decodeThreads.Get() : 0u;
+        unsigned int SHARD = 0u, SHARDS = 0u;
+        if (shard)
+        {
+            smatch match;
+            const string spec = shard.Get();
+            if (!regex_match(spec, match, regex("([0-9]+)/([0-9]+)"))) throw ValidationError("--shard argument must be in the form i/N");
+            SHARD = stoul(match[1].str());
+            SHARDS = stoul(match[2].str());
+            if (SHARD < 1 || SHARD > SHARDS) throw ValidationError("--shard index must be between 1 and the number of shards");
+        }
 
         time_t t0, t1, t2; //various timestamps to record execution time
         clock_t start_clock = clock(); //timer used to compute CPU time
-        map<chrom, list<Feature>> features; //map of chr -> genes/exons; parsed from GTF
+        map<chrom, FeatureList> features; //map of chr -> genes/exons; parsed from GTF
         Fasta fastaReader;
-        unsigned long gcBins[100] = {0};
-        //Parse the GTF and extract features
-        {
-            Feature line; //current feature being read from the gtf
-            ifstream reader(gtfFile.Get());
-            if (!reader.is_open())
-            {
-                cerr << "Unable to open GTF file: " << gtfFile.Get() << endl;
-                return 10;
-            }
-
 #ifndef NO_FASTA
-            if (fastaFile)
-            {
-                fastaReader.open(fastaFile.Get());
-                if (VERBOSITY > 1) cout << "A FASTA has been provided. This will enable GC-content statistics but adds additional runtime and memory costs" << endl;
-            }
-#endif
-
-            if (VERBOSITY) cout<<"Reading GTF Features..."<<endl;
-            time(&t0);
-            while ((reader >> line))
-            {
-                if(LegacyMode.Get() && line.end == line.start)
-                {
-                    //legacy code excludes single base exons
-                    if (VERBOSITY > 1) cerr<<"Legacy mode excluded feature: " << line.feature_id << endl;
-                    if (line.type == FeatureType::Exon) geneCodingLengths[line.gene_id] -= 1;
-                    continue;
-                }
-                //Just keep genes and exons.  We don't care about transcripts or any other feature types
-                if (line.type == FeatureType::Gene || line.type == FeatureType::Exon)
-                {
-                    features[line.chromosome].push_back(line);
-//#ifndef NO_FASTA
-//                    //If fasta features are enabled, read the gene sequence from the fasta
-//                    if (fastaFile && line.type == FeatureType::Gene) geneSeqs[line.feature_id] = fastaReader.getSeq(line.chromosome, line.start - 1, line.end, line.strand);
-//#endif
-
-                }
-            }
-        }
-		//ensure that the features are sorted.  This MUST be true for the exon alignment metrics
-        if (VERBOSITY > 1) cout << "Processing GTF Features..." << endl;
-        for (auto beg = features.begin(); beg != features.end(); ++beg)
+        if (fastaFile)
         {
-            beg->second.sort(compIntervalStart);
-            for (auto feat = beg->second.begin(); feat != beg->second.end(); ++feat)
-                if (feat->type == FeatureType::Exon) exonsForGene[feat->gene_id].push_back(feat->feature_id);
-
+            fastaReader.open(fastaFile.Get());
+            if (VERBOSITY > 1) cout << "A FASTA has been provided. This will enable GC-content statistics but adds additional runtime and memory costs" << endl;
         }
+#endif
+        time(&t0);
+        loadGTF(gtfFile.Get(), LegacyMode.Get(), VERBOSITY, THREADS, features);
         time(&t1); //record the time taken to parse the GTF
         if (!(geneList.size() && exonList.size()))
         {
@@ -166,24 +151,24 @@ int main(int argc, char* argv[])
 
         //fragment size variables
         unsigned int doFragmentSize = 0u; //count of remaining fragment size samples to record
-        map<chrom, list<Feature> > *bedFeatures = nullptr; //similar map, but parsed from BED for fragment sizes only
-        map<string, FragmentMateEntry> fragmentSizeFragmentTracker, gcContentFragmentTracker; //Map of alignment name -> exonID to ensure mates map to the same exon for
-        map<long long, unsigned long> fragmentSizes; //list of fragment size samples taken so far
+        map<chrom, FeatureList> bedFeatures; //similar map, but parsed from BED for fragment sizes only
         if (bedFile) //If we were given a BED file, parse it for fragment size calculations
         {
              Feature line; //current feature being read from the bed
             if (VERBOSITY) cout << "Parsing BED intervals for fragment size computations..." << endl;
             doFragmentSize = FRAGMENT_SIZE_SAMPLES;
-            bedFeatures = new map<chrom, list<Feature> >();
-            ifstream bedReader(bedFile.Get());
+            BEDReader bedReader(bedFile.Get(), THREADS);
             if (!bedReader.is_open())
             {
                 cerr << "Unable to open BED file: " << bedFile.Get() << endl;
                 return 10;
             }
-            //extract each line of the bed and insert it into the bedFeatures map
-            while (extractBED(bedReader, line)) (*bedFeatures)[line.chromosome].push_back(line);
-            bedReader.close();
+            //extract each line of the bed and insert it into the bedFeatures map. Lines are numbered so fragment mates can refer to their exon
+            for (unsigned int index = 0; bedReader.next(line); ++index)
+            {
+                line.feature_index = index;
+                bedFeatures[line.chromosome].push_back(line);
+            }
         }
 
         //use boost to ensure that the output directory exists before the metrics are dumped to it
@@ -196,32 +181,54 @@ int main(int argc, char* argv[])
         const string bamFilename = bamFile.Get();
         SeqlibReader bam;
         if (fastaFile) bam.addReference(fastaFile.Get());
+        if (DECODE_THREADS) bam.setThreadPool(SeqLib::ThreadPool(DECODE_THREADS));
         if (!bam.open(bamFilename))
         {
             cerr << "Unable to open BAM file: " << bamFilename << endl;
             return 10;
         }
-        Metrics counter; //main tracker for various metrics
-        int readLength = 0; //longest read encountered so far
-
-        BiasCounter bias(BIAS_OFFSET, BIAS_WINDOW, BIAS_LENGTH, DETECTION_THRESHOLD);
-        BaseCoverage baseCoverage(fastaReader, outputDir.Get() + "/" + SAMPLENAME + ".coverage.tsv", COVERAGE_MASK, outputTranscriptCoverage.Get(), bias);
-        unsigned long long alignmentCount = 0ull; //count of how many alignments we've seen so far
-        chrom current_chrom = 0;
-        int32_t last_position = 0; // For some reason, htslib has decided that this will be the datatype used for positions
-
-        
-        vector<unsigned int> read_lengths;
-        unsigned int sum_read_lengths = 0;
-        
-        
+        QCOptions options;
+        options.orientation = STRAND_ORIENTATION;
+        options.chimericDistance = CHIMERIC_DISTANCE;
+        options.fragmentSamples = FRAGMENT_SIZE_SAMPLES;
+        options.mappingQuality = MAPPING_QUALITY_THRESHOLD;
+        options.coverageMask = COVERAGE_MASK;
+        options.detectionThreshold = DETECTION_THRESHOLD;
+        options.verbosity = VERBOSITY;
+        options.biasOffset = BIAS_OFFSET;
+        options.biasWindow = BIAS_WINDOW;
+        options.biasLength = BIAS_LENGTH;
+        options.tags = tags;
+        options.chimericTag = chimeric_tag;
+        options.fastaPath = fastaFile ? fastaFile.Get() : "";
+        options.legacy = LegacyMode.Get();
+        options.unpaired = unpaired.Get();
+        options.excludeChimeric = excludeChimeric.Get();
+        options.outputCoverage = outputTranscriptCoverage.Get();
+        options.requireSorted = requireSorted.Get();
+        options.unsorted = unsortedInput.Get();
+        ReportOptions report;
+        report.sampleName = SAMPLENAME;
+        report.labelled = static_cast<bool>(sampleName);
+        report.rpkm = useRPKM.Get();
+        report.gcContent = static_cast<bool>(fastaFile);
+
+        SeqLib::BamHeader header = bam.getHeader();
+        SeqLib::HeaderSequenceVector sequences = header.GetHeaderSequenceVector();
+        ReadProcessor processor(options, fastaReader, sequences, outputDir.Get() + "/" + SAMPLENAME + ".coverage.tsv", outputTranscriptCoverage.Get() && !SHARDS, SHARDS ? "/dev/null" : outputDir.Get() + "/" + SAMPLENAME + ".exon_cv.tsv", report.gcContent);
+        processor.features.swap(features);
+        processor.bedFeatures.swap(bedFeatures);
+        processor.doFragmentSize = doFragmentSize;
+        if (options.unsorted)
+        {
+            for (auto feats = processor.features.begin(); feats != processor.features.end(); ++feats) feats->second.index();
+            for (auto bed = processor.bedFeatures.begin(); bed != processor.bedFeatures.end(); ++bed) bed->second.index();
+        }
+
         //Begin parsing the bam.  Each alignment is run through various sets of metrics
         {
             Alignment alignment; //current bam alignment
-            SeqLib::BamHeader header = bam.getHeader();
             time_t report_time; //used to ensure that stdout isn't spammed if the program runs super fast
-            SeqLib::HeaderSequenceVector sequences = header.GetHeaderSequenceVector();
-            const unsigned int nChrs = sequences.size();
             //Check the sequence dictionary for contig overlap with gtf
             if (VERBOSITY > 1) cout<<"Checking bam header..."<<endl;
             bool hasOverlap = false;
@@ -229,7 +236,7 @@ int main(int argc, char* argv[])
             for(auto sequence = sequences.begin(); sequence != sequences.end(); ++sequence)
             {
                 chrom chrom = chromosomeMap(sequence->Name);
-                if (features.find(chrom) != features.end()) hasOverlap = true;
+                if (processor.features.find(chrom) != processor.features.end()) hasOverlap = true;
                 if (!bam.validateChromosome(chrom)) {
                     ++chrMismatchCount;
                     if (VERBOSITY) cerr << "The cram MD5 field for chromosome " << sequence->Name << " did not match the provided reference file. HTSLIB will revert to using cached references." << endl;
@@ -245,462 +252,66 @@ int main(int argc, char* argv[])
             time(&report_time);
             time(&t2);
 
-            
-            while (bam.next(alignment))
+            if (SHARDS && bam.isStream()) throw ValidationError("--shard requires an indexed BAM/CRAM file. It can't be used on a stream");
+            if (SHARDS)
             {
-                //try to print an update to stdout every 250,000 reads, but no more than once every 10 seconds
-                ++alignmentCount;
-                string trash;
-                if (alignmentCount % 250000 == 0) time(&t2);
-                if (difftime(t2, report_time) >= 10)
+                vector<ContigResult> results;
+                if (!readContigs(processor, bamFilename, options, THREADS ? THREADS : 1u, bam.getThreadPool(), shardContigs(sequences, SHARD - 1, SHARDS), results))
                 {
-                    time(&report_time);
-                    if (VERBOSITY > 1) cout << "Time elapsed: " << difftime(t2, t1) << "; Alignments processed: " << alignmentCount << endl;
-                }
-                //count metrics based on basic read data
-                if (alignment.SecondaryFlag()) counter.increment("Alternative Alignments");
-                else if (alignment.QCFailFlag()) counter.increment("Failed Vendor QC");
-                else if (alignment.MapQuality() < MAPPING_QUALITY_THRESHOLD) counter.increment("Low Mapping Quality");
-                if (alignment.SupplementaryFlag() && !(LegacyMode.Get() || readStringTag(alignment, chimeric_tag, trash)))
-                {
-                    counter.increment("Chimeric Fragments_auto");
-                    if(excludeChimeric.Get()) continue;
-                }
-                if (!(alignment.SecondaryFlag() || alignment.QCFailFlag() || alignment.SupplementaryFlag()))
-                {
-                    counter.increment("Unique Mapping, Vendor QC Passed Reads");
-
-                    unsigned read_len = alignment.Sequence().length();
-                    read_lengths.push_back(read_len);
-                    sum_read_lengths += read_len;
-                    
-                    //raw counts:
-                    if (!alignment.PairedFlag()) counter.increment("Unpaired Reads");
-                    if (alignment.MappedFlag())
-                    {
-                        counter.increment("Mapped Reads");
-
-                        if (alignment.DuplicateFlag()) counter.increment("Mapped Duplicate Reads");
-                        else counter.increment("Mapped Unique Reads");
-                        //check length against max read length
-                        unsigned int alignmentSize = alignment.PositionEnd() - alignment.Position();
-                        if (LegacyMode.Get() && alignmentSize > LEGACY_MAX_READ_LENGTH) continue;
-                        if (!readLength) current_chrom = chromosomeMap(sequences[alignment.ChrID()].Name);
-                        if (alignmentSize > readLength) readLength = alignment.Length();
-                        if (!LegacyMode.Get() && readStringTag(alignment, chimeric_tag, trash))
-                        {
-                            if (alignment.FirstFlag()) counter.increment("Chimeric Fragments_tag");
-                            if(excludeChimeric.Get()) continue;
-                        }
-                        if (alignment.PairedFlag() && alignment.MateMappedFlag() )
-                        {
-                            if (alignment.FirstFlag()) counter.increment("Total Mapped Pairs");
-                            if (alignment.ChrID() != alignment.MateChrID() || abs(alignment.Position() - alignment.MatePosition()) > CHIMERIC_DISTANCE || (LegacyMode.Get() && alignment.ChrID() > 127))
-                            {
-                                if (alignment.FirstFlag()) counter.increment("Chimeric Fragments_auto");
-                                if(excludeChimeric.Get()) continue;
-                            }
-                        }
-                        //Get tag data
-                        int32_t mismatches = 0;
-                        if (alignment.GetIntTag(NM, mismatches))
-                        {
-                            if (alignment.PairedFlag())
-                            {
-                                if (alignment.FirstFlag())
-                                {
-                                    counter.increment("End 1 Mapped Reads");
-                                    counter.increment("End 1 Mismatches", mismatches);
-                                    counter.increment("End 1 Bases", alignment.Length());
-                                    if (alignment.DuplicateFlag())counter.increment("Duplicate Pairs");
-                                    else counter.increment("Unique Fragments");
-                                }
-                                else
-                                {
-                                    counter.increment("End 2 Mapped Reads");
-                                    counter.increment("End 2 Mismatches", mismatches);
-                                    counter.increment("End 2 Bases", alignment.Length());
-                                }
-
-                            }
-                            counter.increment("Mismatched Bases", mismatches);
-                        }
-                        counter.increment("Total Bases", alignment.Length());
-                        //generic filter tags:
-                        bool discard = false;
-                        for (auto tag = tags.begin(); tag != tags.end(); ++tag)
-                        {
-                            if (alignment.GetTag(tag->c_str(), trash))
-                            {
-                                discard = true;
-                                counter.increment("Filtered by tag: "+*tag);
-                            }
-                        }
-                        if (discard) continue;
-
-                        //bool highQuality = (mismatches <= BASE_MISMATCH_THRESHOLD && (unpaired.Get() || alignment.ProperPair()) && alignment.MapQuality() >= MAPPING_QUALITY_THRESHOLD);
-			// just rely on mapping quality to determine whether highQuality or not. // bhaas
-			bool highQuality = (alignment.MapQuality() >= MAPPING_QUALITY_THRESHOLD);
-
-                        //now record intron/exon metrics by intersecting filtered reads with the list of features
-                        if (alignment.ChrID() < 0 || alignment.ChrID() >= nChrs)
-                        {
-                            //The read had an unrecognized RefID (one not defined in the bam's header)
-                            if (VERBOSITY) cerr << "Unrecognized RefID on alignment: " << alignment.Qname() <<endl;
-                        }
-                        else
-                        {
-                            if (highQuality) counter.increment("High Quality Reads");
-                            else counter.increment("Low Quality Reads");
-                            counter.increment("Reads used for Intron/Exon counts");
-                            vector<Feature> blocks;
-                            string chrName = sequences[alignment.ChrID()].Name;
-                            chrom chr = chromosomeMap(chrName); //parse out a chromosome shorthand
-                            if (chr != current_chrom)
-                            {
-                                dropFeatures(features[current_chrom], baseCoverage);
-                                current_chrom = chr;
-                                if (fastaReader.isOpen() && !fastaReader.hasContig(chr)) {
-                                    cerr << "Warning: Provided Fasta does not contain chromosome " << chrName << ". No GC statistics will be collected for this chromosome" << endl;
-                                }
-                            }
-                            else if (last_position > alignment.Position())
-                                cerr << "Warning: The input bam does not appear to be sorted. An unsorted bam will yield incorrect results" << endl;
-                            last_position = alignment.Position();
-
-                            //extract each cigar block from the alignment
-                            unsigned int length = extractBlocks(alignment, blocks, chr, LegacyMode.Get());
-                            counter.increment("Alignment Blocks", blocks.size());
-                            trimFeatures(alignment, features[chr], baseCoverage); //drop features that appear before this read
-
-                            //run the read through exon metrics
-                            if (LegacyMode.Get()) legacyExonAlignmentMetrics(LEGACY_SPLIT_DISTANCE, features, counter, blocks, alignment, sequences, length, STRAND_ORIENTATION, baseCoverage, highQuality, unpaired.Get());
-                            else {
-                                double gcContent = exonAlignmentMetrics(features, counter, blocks, alignment, sequences, length, STRAND_ORIENTATION, baseCoverage, highQuality, unpaired.Get(), gcContentFragmentTracker, fastaReader);
-                                if (gcContent != -1 && static_cast<unsigned int>(gcContent * 100.0) == 0) cout << "0:0\t" << alignment.Qname() <<"\t" << gcContent<< endl;
-                                if (gcContent != -1) gcBins[static_cast<unsigned int>(gcContent * 100.0)]++;
-                            }
-
-                            //if fragment size calculations were requested, we still have samples to take, and the chromosome exists within the provided bed
-                            if (highQuality && doFragmentSize && alignment.PairedFlag() && bedFeatures != nullptr && bedFeatures->find(chr) != bedFeatures->end())
-                            {
-                                fragmentSizeMetrics(doFragmentSize, bedFeatures, fragmentSizeFragmentTracker, fragmentSizes, blocks, alignment, sequences);
-                                if (!doFragmentSize && VERBOSITY > 1) cout << "Completed taking fragment size samples" << endl;
-                            }
-                        }
-                    }
-
-                }
-
-            } //end of bam alignment loop
-        } //end of bam alignment scope
-
-        for (auto feats = features.begin(); feats != features.end(); ++feats)
-            if (feats->second.size()) dropFeatures(feats->second, baseCoverage);
-
-        baseCoverage.close();
-        time(&t2);
-        if (VERBOSITY)
-        {
-            cout<< "Time Elapsed: " << difftime(t2, t1) << "; Alignments processed: " << alignmentCount << endl;
-            cout << "Total runtime: " << difftime(t2, t0) << "; Total CPU Time: " << (clock() - start_clock)/CLOCKS_PER_SEC << endl;
-            if (VERBOSITY > 1) cout << "Average Reads/Sec: " << static_cast<double>(alignmentCount) / difftime(t2, t1) << endl;
-            cout << "Estimating library complexity..." << endl;
-        }
-        counter.increment("Total Reads", alignmentCount);
-        double duplicates = static_cast<double>(counter.get("Duplicate Pairs"));
-        double unique = static_cast<double>(counter.get("Unique Fragments"));
-        double numReads = duplicates + unique;
-        unsigned int minReads = 0u, minError = UINT_MAX;
-        if (duplicates > 0)
-        {
-            //If there are no duplicates, the estimate is useless, so skip it
-            for (double x = unique; x < 1e9; ++x)
-            {
-                double estimate = x * (1.0 - exp(-1.0 * numReads / x)); //lander-waterman
-                unsigned int error = static_cast<unsigned int>(fabs(estimate - unique));
-                if (error < minError)
-                {
-                    minError = error;
-                    minReads = static_cast<unsigned int>(x);
+                    cerr << "Unable to load an index for " << bamFilename << ". An index is required for --shard" << endl;
+                    return 10;
                 }
+                PartialInfo partial;
+                partial.version = VERSION;
+                partial.shard = SHARD;
+                partial.shards = SHARDS;
+                partial.fragmentBudget = doFragmentSize;
+                partial.options = options;
+                partial.report = report;
+                partial.sequences = sequences;
+                const string partialFilename = outputDir.Get() + "/" + SAMPLENAME + ".shard" + to_string(SHARD) + "-of-" + to_string(SHARDS) + ".partial";
+                writePartial(partialFilename, partial, results);
+                time(&t2);
+                if (VERBOSITY) cout << "Wrote partial results to " << partialFilename << " in " << difftime(t2, t0) << " seconds" << endl;
+                return 0;
             }
-        }
-
-        if (VERBOSITY) cout << "Generating report" << endl;
-
-        //gene coverage report generation
-        unsigned int genesDetected = 0;
-        double fragmentMed = 0.0;
-        vector<double> ratios;
-        {
-            ofstream geneReport(outputDir.Get()+"/"+SAMPLENAME+".gene_reads.gct");
-            ofstream geneRPKM(outputDir.Get()+"/"+SAMPLENAME+".gene_"+(useRPKM.Get() ? "rpkm" : "tpm")+".gct");
-            ofstream fragmentReport(outputDir.Get()+"/"+SAMPLENAME+".gene_fragments.gct");
-            geneReport << "#1.2" << endl;
-            geneRPKM << "#1.2" << endl;
-            fragmentReport << "#1.2" << endl;
-            geneReport << geneList.size() << "\t1" << endl;
-            geneRPKM << geneList.size() << "\t1" << endl;
-            fragmentReport << geneList.size() << "\t1" << endl;
-            geneReport << "Name\tDescription\t" << (sampleName ? sampleName.Get() : "Counts") << endl;
-            geneRPKM << "Name\tDescription\t" << (sampleName ? sampleName.Get() : (useRPKM.Get() ? "RPKM" : "TPM")) << endl;
-            geneRPKM << fixed;
-            fragmentReport << "Name\tDescription\t" << (sampleName ? sampleName.Get() : "Fragments") << endl;
-            const double scaleRPKM = static_cast<double>(counter.get("Exonic Reads")) / 1000000.0;
-            double scaleTPM = 0.0;
-            for(auto gene = geneList.begin(); gene != geneList.end(); ++gene)
+            // Streams can only be read once, so they're never split up by contig
+            else if (THREADS > 1 && !bam.isStream() && processContigs(processor, bamFilename, options, THREADS, bam.getThreadPool()))
             {
-                geneReport << *gene << "\t" << geneNames[*gene] << "\t" << static_cast<long>(geneCounts[*gene]) << endl;
-                fragmentReport << *gene << "\t" << geneNames[*gene] << "\t" << static_cast<long>(geneFragmentCounts[*gene]) << endl;
-
-//#ifndef NO_FASTA
-//                //If fasta features were enabled, get the gc content coverage bias from this gene
-//                if (fastaFile && geneCoverage[*gene]) gcBias += gc(geneSeqs[*gene]) / static_cast<double>(geneList.size());
-//#endif
-
-                if (useRPKM.Get())
-                {
-                    double RPKM = (1000.0 * geneCounts[*gene] / scaleRPKM) / static_cast<double>(geneCodingLengths[*gene]);
-                    geneRPKM << *gene << "\t" << geneNames[*gene] << "\t" << RPKM << endl;
-                }
-                else
-                {
-                    double TPM = (1000.0 * geneCounts[*gene]) / static_cast<double>(geneCodingLengths[*gene]);
-                    tpms[*gene] = TPM;
-                    scaleTPM += TPM;
-                }
-                // Gene 'detection' depends only on unique reads, discounting duplicates
-                if (uniqueGeneCounts[*gene] >= DETECTION_THRESHOLD) ++genesDetected;
-                double geneBias = bias.getBias(*gene);
-                assert(geneBias == -1.0 || (geneBias >= 0.0 && geneBias <= 1.0));
-                if (geneBias != -1.0) ratios.push_back(geneBias);
+                if (VERBOSITY > 1) cout << "Processed contigs in parallel" << endl;
             }
-            geneReport.close();
-            if (!useRPKM.Get())
+            else if (THREADS > 1)
             {
-                scaleTPM /= 1000000.0;
-                for(auto gene = geneList.begin(); gene != geneList.end(); ++gene)
-                    geneRPKM << *gene << "\t" << geneNames[*gene] << "\t" << tpms[*gene] / scaleTPM << endl;
-            }
-            geneRPKM.close();
-
-        }
-
-        //3'/5' coverage ratio calculations
-        double ratioAvg = 0.0, ratioMedDev = 0.0, ratioMedian = 0.0, ratioStd = 0.0, ratio75 = 0.0, ratio25 = 0.0;
-        if (ratios.size() > 1)
-        {
-            statsTuple ratio_stats = getStatistics(ratios);
-            ratioAvg = std::get<StatIdx::avg>(ratio_stats);
-            ratioMedian = std::get<StatIdx::med>(ratio_stats);
-            ratioStd = std::get<StatIdx::std>(ratio_stats);
-            ratioMedDev = std::get<StatIdx::mad>(ratio_stats);
-            double index = .25 * ratios.size();
-            if (index > floor(index))
-            {
-                index = ceil(index);
-                ratio25 = ratios[static_cast<int>(index)];
+                // Without an index, the best we can do is to decode and classify reads on separate threads
+                if (VERBOSITY && !bam.isStream()) cerr << "Unable to load an index for " << bamFilename << ". Contigs will not be processed in parallel" << endl;
+                processPipelined(processor, bam, options);
             }
             else
             {
-                index = ceil(index);
-                ratio25 = (ratios[static_cast<int>(index)] + ratios[static_cast<int>(index + 1)]) / 2.0;
-            }
-            index = .75 * ratios.size();
-            if (index > floor(index))
-            {
-                index = ceil(index);
-                ratio75 = ratios[static_cast<int>(index)];
-            }
-            else
-            {
-                index = ceil(index);
-                ratio75 = (ratios[static_cast<int>(index)] + ratios[static_cast<int>(index + 1)]) / 2.0;
-            }
-        }
-        //exon coverage report generation
-        {
-            ofstream exonReport(outputDir.Get()+"/"+SAMPLENAME+".exon_reads.gct");
-            exonReport << "#1.2" << endl;
-            exonReport << exonCounts.size() << "\t1" << endl;
-            exonReport << "Name\tDescription\t" << (sampleName ? sampleName.Get() : "Counts") << endl;
-            exonReport << fixed;
-            for(auto exon = exonList.begin(); exon != exonList.end(); ++exon)
-            {
-                exonReport << *exon << "\t" << geneNames[*exon] << "\t" << exonCounts[*exon] << endl;
-            }
-            exonReport.close();
-        }
-
-        // get read length stats.
-        std::sort(read_lengths.begin(), read_lengths.end());
-        unsigned int num_uniq_mapped_reads = read_lengths.size();
-        float mean_read_length = sum_read_lengths / static_cast<float>(num_uniq_mapped_reads);
-        unsigned int max_read_length = read_lengths[read_lengths.size()-1];
-        unsigned int median_read_length =  computeMedian(read_lengths.size(), read_lengths.begin());
-        unsigned int third_quartile_read_length = read_lengths[static_cast<int>(0.75 * read_lengths.size())];
-        unsigned int first_quartile_read_length = read_lengths[static_cast<int>(0.25 * read_lengths.size())];
-        
-        ofstream output(outputDir.Get()+"/"+SAMPLENAME+".metrics.tsv");
-        //output rates and other fractions to the report
-        output << "Sample\t" << SAMPLENAME << endl;
-        output << "Mapping Rate\t" << counter.frac("Mapped Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "Unique Rate of Mapped\t" << counter.frac("Mapped Unique Reads", "Mapped Reads") << endl;
-        output << "Duplicate Rate of Mapped\t" << counter.frac("Mapped Duplicate Reads", "Mapped Reads") << endl;
-        output << "Duplicate Rate of Mapped, excluding Globins\t" << counter.frac("Non-Globin Duplicate Reads", "Non-Globin Reads") << endl;
-        output << "Base Mismatch\t" << counter.frac("Mismatched Bases", "Total Bases") << endl;
-        output << "End 1 Mapping Rate\t"<< 2.0 * counter.frac("End 1 Mapped Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "End 2 Mapping Rate\t"<< 2.0 * counter.frac("End 2 Mapped Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "End 1 Mismatch Rate\t" << counter.frac("End 1 Mismatches", "End 1 Bases") << endl;
-        output << "End 2 Mismatch Rate\t" << counter.frac("End 2 Mismatches", "End 2 Bases") << endl;
-        output << "Expression Profiling Efficiency\t" << counter.frac("Exonic Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "High Quality Rate\t" << counter.frac("High Quality Reads", "Mapped Reads") << endl;
-        output << "Exonic Rate\t" << counter.frac("Exonic Reads", "Mapped Reads") << endl;
-        output << "Intronic Rate\t" << counter.frac("Intronic Reads", "Mapped Reads") << endl;
-        output << "Intergenic Rate\t" << counter.frac("Intergenic Reads", "Mapped Reads") << endl;
-        output << "Intragenic Rate\t" << counter.frac("Intragenic Reads", "Mapped Reads") << endl;
-        output << "Ambiguous Alignment Rate\t" << counter.frac("Ambiguous Reads", "Mapped Reads") << endl;
-        output << "High Quality Exonic Rate\t" << counter.frac("HQ Exonic Reads", "High Quality Reads") << endl;
-        output << "High Quality Intronic Rate\t" << counter.frac("HQ Intronic Reads", "High Quality Reads") << endl;
-        output << "High Quality Intergenic Rate\t" << counter.frac("HQ Intergenic Reads", "High Quality Reads") << endl;
-        output << "High Quality Intragenic Rate\t" << counter.frac("HQ Intragenic Reads", "High Quality Reads") << endl;
-        output << "High Quality Ambiguous Alignment Rate\t" << counter.frac("HQ Ambiguous Reads", "High Quality Reads") << endl;
-        output << "Discard Rate\t" << static_cast<double>(counter.get("Mapped Reads") - counter.get("Reads used for Intron/Exon counts")) / counter.get("Mapped Reads") << endl;
-        output << "rRNA Rate\t" << counter.frac("rRNA Reads", "Mapped Reads") << endl;
-        output << "End 1 Sense Rate\t" << static_cast<double>(counter.get("End 1 Sense")) / (counter.get("End 1 Sense") + counter.get("End 1 Antisense")) << endl;
-        output << "End 2 Sense Rate\t" << static_cast<double>(counter.get("End 2 Sense")) / (counter.get("End 2 Sense") + counter.get("End 2 Antisense")) << endl;
-        output << "Avg. Splits per Read\t" << counter.frac("Alignment Blocks", "Mapped Reads") - 1.0 << endl;
-        //automatically dump the raw counts of all metrics to the file
-        output << counter;
-        //append metrics that were manually tracked
-        //output << "Read Length\t" << readLength << endl;
-        output << "Mean read length\t" << mean_read_length << endl;
-        output << "Median read length\t" << median_read_length << endl;
-        output << "Third quartile read length\t" << third_quartile_read_length << endl;
-        output << "First quartile read length\t" << first_quartile_read_length << endl;
-        output << "Maximum read length\t" << max_read_length << endl;
-        output << "Genes Detected\t" << genesDetected << endl;
-        output << "Estimated Library Complexity\t" << minReads << endl;
-        output << "Genes used in 3' bias\t" << bias.countGenes() << endl;
-        output << "Mean 3' bias\t" << ratioAvg << endl;
-        output << "Median 3' bias\t" << ratioMedian << endl;
-        output << "3' bias Std\t" << ratioStd << endl;
-        output << "3' bias MAD_Std\t" << ratioMedDev << endl;
-        output << "3' Bias, 25th Percentile\t" << ratio25 << endl;
-        output << "3' Bias, 75th Percentile\t" << ratio75 << endl;
-
-//#ifndef NO_FASTA
-//        if (fastaFile) output << "Mean Weighted GC Content\t" << gcBias << endl;
-//#endif
-
-        if (fragmentSizes.size())
-        {
-            //If any fragment size samples were taken, also generate a fragment size report
-            double fragmentAvg = 0.0, fragmentStd = 0.0, fragmentMedDev = 0.0;
-            // fragments stores {size -> count}
-            // But we need to unpack that into a regular list to get metrics
-            list<long long> dumb_fragment_expansion_list;
-            for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
-                for(unsigned long i = 0u; i < fragment->second; ++i) dumb_fragment_expansion_list.push_back(fragment->first);
-            sortContainer(dumb_fragment_expansion_list);
-            double size = static_cast<double>(dumb_fragment_expansion_list.size());
-            vector<double> deviations; //list of recorded deviations from the median
-            fragmentMed = computeMedian(size, dumb_fragment_expansion_list.begin());
-            ofstream fragmentList(outputDir.Get()+"/"+SAMPLENAME+".fragmentSizes.txt"); //raw list of each fragment size recorded
-            fragmentList << "Fragment Size\tCount" << endl;
-            for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
-            {
-                fragmentList << fragment->first << "\t" << fragment->second << endl; //record the fragment size into the output list
-                fragmentAvg += static_cast<double>(fragment->first * fragment->second) / size; //add this fragment's size to the mean
-                double deviation = fabs(static_cast<double>(fragment->first) - fragmentMed);
-                for(unsigned long i = 0u; i < fragment->second; ++i) deviations.push_back(deviation); //record this fragment's deviation
-            }
-            fragmentList.close();
-            sortContainer(deviations); //for the next line to work, we have to sort
-            //now compute the median absolute deviation, an estimator for standard deviation
-            fragmentMedDev = computeMedian(deviations.size(), deviations.begin()) * MAD_FACTOR;
-            //we have to iterate again now for the standard deviation calculation, now that we know the mean
-            for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
-            {
-                for(unsigned long i = 0u; i < fragment->second; ++i) fragmentStd += pow(static_cast<double>(fragment->first) - fragmentAvg, 2.0) / size;
+                while (bam.next(alignment))
+                {
+                    processor.process(alignment);
+                    //try to print an update to stdout every 250,000 reads, but no more than once every 10 seconds
+                    if (processor.alignmentCount % 250000 == 0) time(&t2);
+                    if (difftime(t2, report_time) >= 10)
+                    {
+                        time(&report_time);
+                        if (VERBOSITY > 1) cout << "Time elapsed: " << difftime(t2, t1) << "; Alignments processed: " << processor.alignmentCount << endl;
+                    }
+                } //end of bam alignment loop
+                processor.finish();
             }
-            fragmentStd = pow(fragmentStd, 0.5); //compute the standard deviation
-
-            output << "Average Fragment Length\t" << fragmentAvg << endl;
-            output << "Fragment Length Median\t" << fragmentMed << endl;
-            output << "Fragment Length Std\t" << fragmentStd << endl;
-            output << "Fragment Length MAD_Std\t" << fragmentMedDev << endl;
-        }
+        } //end of bam alignment scope
 
+        processor.baseCoverage.close();
+        time(&t2);
+        if (VERBOSITY)
         {
-            list<double> means = baseCoverage.getGeneMeans(), stdDevs = baseCoverage.getGeneStds(), cvs = baseCoverage.getGeneCVs();
-            const unsigned long nTranscripts = means.size();
-            sortContainer(means);
-            sortContainer(stdDevs);
-            auto beg = cvs.begin();
-            auto end = cvs.end();
-            while (beg != end)
-            {
-                if (std::isnan(*beg) || std::isinf(*beg)) cvs.erase(beg++);
-                else ++beg;
-            }
-            cvs.sort();
-            //You may need to disable _GLIBCXX_USE_CXX11_ABI in order to compile this program, but that ends up
-            //using the old implimentation of list which has to walk the entire sequence to determine size
-            //so we just do it once and store it in a variable
-            const unsigned long nCVS = cvs.size();
-            output << "Median of Avg Transcript Coverage\t" << computeMedian(nTranscripts, means.begin()) << endl;
-            output << "Median of Transcript Coverage Std\t" << computeMedian(nTranscripts, stdDevs.begin()) << endl;
-            output << "Median of Transcript Coverage CV\t" << (nCVS ? computeMedian(nCVS, cvs.begin()) : 0.0) << endl;
-            list<double> totalExonCV;
-            map<string, ExonCoverage> exonCoverage = baseCoverage.getExonCoverage();
-            ofstream cvReport(outputDir.Get()+"/"+SAMPLENAME+".exon_cv.tsv");
-            cvReport << "Exon ID\tExon CV";
-            if (fastaFile)
-                cvReport << "\tGC Content";
-            cvReport << endl;
-            if (fastaFile) {
-                for (auto entry = exonCoverage.begin(); entry != exonCoverage.end(); ++entry) {
-                    cvReport << entry->first << "\t" << entry->second.cv << "\t" << entry->second.gc << endl;
-                    totalExonCV.push_back(entry->second.cv);
-                }
-            } else {
-                for (auto entry = exonCoverage.begin(); entry != exonCoverage.end(); ++entry) {
-                    cvReport << entry->first << "\t" << entry->second.cv << endl;
-                    totalExonCV.push_back(entry->second.cv);
-                }
-            }
-
-//            sortContainer(totalExonCV);
-//            const unsigned long nExonCVs = totalExonCV.size();
-//            double exonMedian = nExonCVs ? computeMedian(totalExonCV.size(), totalExonCV.begin()) : 0.0;
-//            vector<double> exonDeviations;
-//            for (auto cv = totalExonCV.begin(); cv != totalExonCV.end(); ++cv) exonDeviations.push_back(fabs((*cv) - exonMedian));
-//            sortContainer(exonDeviations);
-//            output << "Median Exon CV\t" << exonMedian << endl;
-//            output << "Exon CV MAD\t" << (nExonCVs ? computeMedian(exonDeviations.size(), exonDeviations.begin()) * MAD_FACTOR : 0.0) << endl;
-            statsTuple cv_stats = getStatistics(totalExonCV);
-            output << "Median Exon CV\t" << std::get<StatIdx::med>(cv_stats) << endl;
-            output << "Exon CV MAD\t" << std::get<StatIdx::mad>(cv_stats) << endl;
-        }
-        if (fastaFile) {
-            ofstream gcReport(outputDir.Get() + "/" + SAMPLENAME + ".gc_content.tsv");
-            gcReport << "Content Bin\tCount" << endl;
-            std::list<unsigned int> rough_gc;
-            for (unsigned int i = 0; i < 100; ++i) {
-                gcReport << (double)i/100.0 << "\t" << gcBins[i] << endl;
-                for (unsigned int j = 0; j < gcBins[i]; ++j)
-                    rough_gc.push_back(i);
-            }
-            statsTuple gc_stats = getAdvancedStatistics(rough_gc);
-            output << "Fragment GC Content Mean\t" << (double) std::get<StatIdx::avg>(gc_stats)/100.0 << endl;
-            output << "Fragment GC Content Std\t" << (double) std::get<StatIdx::std>(gc_stats)/100.0 << endl;
-            output << "Fragment GC Content Skewness\t" << std::get<StatIdx::skew>(gc_stats) << endl;
-            output << "Fragment GC Content Kurtosis\t" << std::get<StatIdx::kurt>(gc_stats) << endl;
+            cout<< "Time Elapsed: " << difftime(t2, t1) << "; Alignments processed: " << processor.alignmentCount << endl;
+            cout << "Total runtime: " << difftime(t2, t0) << "; Total CPU Time: " << (clock() - start_clock)/CLOCKS_PER_SEC << endl;
+            if (VERBOSITY > 1) cout << "Average Reads/Sec: " << static_cast<double>(processor.alignmentCount) / difftime(t2, t1) << endl;
         }
-
-        output.close();
+        writeReport(processor, options, report, outputDir.Get());
 	}
     catch (args::Help)
     {
@@ -753,6 +364,10 @@ int main(int argc, char* argv[])
         cerr << e.error << endl;
         return 11;
     }
+    catch (unsortedException &e) {
+        cerr << e.error << endl;
+        return 11;
+    }
     catch (std::length_error &e)
     {
         cerr<<"Unable to parse the GFT lines"<<endl;
@@ -793,35 +408,572 @@ int main(int argc, char* argv[])
     return 0;
 }
 
-double reduceDeltaCV(list<double> &deltaCV)
+// Parses the GTF (or reads a precompiled index of one), keeping genes and exons sorted by start position
+// With several threads, the GTF is tokenized in parallel chunks and contigs are sorted in parallel. The result is identical either way
+void loadGTF(const string &filename, bool legacy, int verbosity, unsigned int threads, map<chrom, FeatureList> &features)
 {
-    sortContainer(deltaCV);
-    return computeMedian(deltaCV.size(), deltaCV.begin());
+    if (isAnnotationIndex(filename))
+    {
+        if (verbosity) cout << "Reading annotation index..." << endl;
+        readAnnotationIndex(filename, legacy, features);
+        return;
+    }
+    {
+        Feature line; //current feature being read from the gtf
+        GTFReader reader(filename, threads);
+
+        if (verbosity) cout<<"Reading GTF Features..."<<endl;
+        while (reader.next(line))
+        {
+            if(legacy && line.end == line.start)
+            {
+                //legacy code excludes single base exons
+                if (verbosity > 1) cerr<<"Legacy mode excluded feature: " << line.feature_id << endl;
+                continue;
+            }
+            //Just keep genes and exons.  We don't care about transcripts or any other feature types
+            if (line.type == FeatureType::Gene || line.type == FeatureType::Exon)
+            {
+                features[line.chromosome].push_back(line);
+//#ifndef NO_FASTA
+//                //If fasta features are enabled, read the gene sequence from the fasta
+//                if (fastaFile && line.type == FeatureType::Gene) geneSeqs[line.feature_id] = fastaReader.getSeq(line.chromosome, line.start - 1, line.end, line.strand);
+//#endif
+
+            }
+        }
+    }
+    //ensure that the features are sorted.  This MUST be true for the exon alignment metrics
+    if (verbosity > 1) cout << "Processing GTF Features..." << endl;
+    vector<FeatureList*> contigs;
+    for (auto beg = features.begin(); beg != features.end(); ++beg) contigs.push_back(&beg->second);
+    atomic<size_t> nextContig(0);
+    auto sortContigs = [&contigs, &nextContig]() {
+        for (size_t i = nextContig++; i < contigs.size(); i = nextContig++) contigs[i]->sort();
+    };
+    vector<thread> sorters;
+    for (unsigned int i = 1; i < threads && i < contigs.size(); ++i) sorters.push_back(thread(sortContigs));
+    sortContigs();
+    for (auto sorter = sorters.begin(); sorter != sorters.end(); ++sorter) sorter->join();
+    indexFeatures(features); // Coding lengths only include the exons which were kept
 }
 
-bool compGenes(const string &a, const string &b)
+// rnaseqc index: Parses a GTF once, and saves the result for any number of later runs
+int buildIndex(int argc, char* argv[])
 {
-    return tpms[a] < tpms[b];
+    ArgumentParser parser(VERSION + " index. Precompiles a GTF into an annotation index, which can be given to rnaseqc in place of the GTF");
+    parser.Prog("rnaseqc index");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "The GTF file to index");
+    ValueFlag<string> outputFile(parser, "output", "The annotation index to write", {'o', "output"});
+    Flag LegacyMode(parser, "legacy", "Build the index for runs which use --legacy", {"legacy"});
+    ValueFlag<unsigned int> threads(parser, "THREADS", "Number of threads used to parse the GTF. Default: 1", {"threads"});
+    CounterFlag verbosity(parser, "verbose", "Give some feedback about what's going on", {'v', "verbose"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        if (!outputFile) throw ValidationError("No output file provided");
+        const int VERBOSITY = verbosity ? verbosity.Get() : 0;
+        if (isAnnotationIndex(gtfFile.Get())) throw ValidationError("The input is already an annotation index");
+        map<chrom, FeatureList> features;
+        loadGTF(gtfFile.Get(), LegacyMode.Get(), VERBOSITY, threads ? threads.Get() : 1u, features);
+        if (!(geneList.size() && exonList.size()))
+        {
+            cerr << "There were either no genes or no exons in the GTF" << endl;
+            cerr << geneList.size() << " genes parsed" << endl;
+            cerr << exonList.size() << " exons parsed" << endl;
+            return 11;
+        }
+        writeAnnotationIndex(outputFile.Get(), features, LegacyMode.Get());
+        if (VERBOSITY) cout << "Wrote " << geneList.size() << " genes and " << exonList.size() << " exons to " << outputFile.Get() << endl;
+    }
+    catch (const args::Help&)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    return 0;
 }
 
-bool readStringTag(Alignment& alignment, string tagName, string& result) {
-    if (alignment.GetZTag(tagName, result)) return true;
-    
-    const auto b = alignment.shared_pointer();
-    
-    //Copied (with slight modification) from https://github.com/walaj/SeqLib/blob/master/src/BamRecord.cpp#L499
-    uint8_t* tagPtr = bam_aux_get(b.get(),tagName.c_str());
-    if (!tagPtr)
-      return false;
-
-    int type = *tagPtr;
-    if (type != 'A')
-      return false;
+// rnaseqc collapse: Reduces a transcript annotation to one transcript per gene, without overlaps between genes
+int collapseGTF(int argc, char* argv[])
+{
+    ArgumentParser parser(VERSION + " collapse. Collapses isoforms into a single transcript per gene and removes overlapping intervals between genes");
+    parser.Prog("rnaseqc collapse");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "Transcript annotation in GTF format. May be gzip or BGZF compressed");
+    Positional<string> outputFile(parser, "output", "The collapsed GTF to write");
+    ValueFlag<string> blacklistFile(parser, "blacklist", "Tab delimited table (with a header) whose first column lists transcripts to exclude, such as unannotated readthroughs", {"transcript-blacklist"});
+    Flag collapseOnly(parser, "collapse-only", "Only collapse the transcripts of each gene. Do not remove overlaps between genes", {"collapse-only"});
+    Flag stranded(parser, "stranded", "Only remove overlaps between genes on the same strand", {"stranded"});
+    CounterFlag verbosity(parser, "verbose", "Give some feedback about what's going on", {'v', "verbose"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        if (!outputFile) throw ValidationError("No output file provided");
+        CollapseOptions options;
+        if (blacklistFile) options.blacklist = readTranscriptBlacklist(blacklistFile.Get());
+        options.collapseOnly = collapseOnly.Get();
+        options.stranded = stranded.Get();
+        options.verbosity = verbosity ? verbosity.Get() : 0;
+        collapseAnnotation(gtfFile.Get(), outputFile.Get(), options);
+    }
+    catch (const args::Help&)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    return 0;
+}
+
+// rnaseqc merge: Combines the partial results of --shard runs into the usual reports
+int mergePartials(int argc, char* argv[])
+{
+    ArgumentParser parser(VERSION + " merge. Combines the partial results of --shard runs into the usual reports");
+    parser.Prog("rnaseqc merge");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "The GTF file which was used to produce the partials");
+    Positional<string> outputDir(parser, "output", "Output directory");
+    PositionalList<string> partialFiles(parser, "partials", "The partial result from each shard");
+    CounterFlag verbosity(parser, "verbose", "Give some feedback about what's going on", {'v', "verbose"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        if (!outputDir) throw ValidationError("No output directory provided");
+        if (!partialFiles) throw ValidationError("No partials provided");
+        const int VERBOSITY = verbosity ? verbosity.Get() : 0;
+        const vector<string> filenames = partialFiles.Get();
+
+        // Read all of the headers first, to make sure the partials belong together
+        vector<PartialInfo> partials(filenames.size());
+        vector<unique_ptr<istringstream> > streams;
+        for (size_t i = 0; i < filenames.size(); ++i)
+        {
+            if (VERBOSITY) cout << "Reading " << filenames[i] << endl;
+            streams.emplace_back(new istringstream(decompressPartial(filenames[i])));
+            try {
+                readPartialHeader(*streams.back(), partials[i]);
+            }
+            catch (serializationException &e) {
+                throw serializationException(filenames[i] + ": " + e.error);
+            }
+            if (partials[i].version != VERSION) throw serializationException(filenames[i] + " was produced by " + partials[i].version + ", not " + VERSION);
+            if (partials[i].settings != partials[0].settings) throw serializationException(filenames[i] + " was produced with different settings than " + filenames[0]);
+            if (partials[i].shards != partials[0].shards || partials[i].chromosomes != partials[0].chromosomes || partials[i].genes != partials[0].genes || partials[i].exons != partials[0].exons || partials[i].sequences.size() != partials[0].sequences.size())
+                throw serializationException(filenames[i] + " does not belong to the same run as " + filenames[0]);
+            for (size_t j = 0; j < partials[i].sequences.size(); ++j)
+                if (partials[i].sequences[j].Name != partials[0].sequences[j].Name || partials[i].sequences[j].Length != partials[0].sequences[j].Length)
+                    throw serializationException(filenames[i] + " was produced from a BAM with a different header than " + filenames[0]);
+        }
+        const PartialInfo &first = partials[0];
+        QCOptions options = first.options;
+        options.verbosity = VERBOSITY;
+
+        // Contigs must get the same internal IDs as in the shards, so that features are dropped in the same order
+        for (size_t i = 0; i < first.chromosomes.size(); ++i)
+            if (chromosomeMap(first.chromosomes[i]) != i + 1) throw serializationException("Unable to restore the chromosome order of the partials");
+        map<chrom, FeatureList> features;
+        loadGTF(gtfFile.Get(), options.legacy, VERBOSITY, 1u, features);
+        if (chromosomes.size() != first.chromosomes.size() || geneList.size() != first.genes || exonList.size() != first.exons)
+            throw serializationException("The GTF does not match the one used to produce the partials");
+
+        if (!boost::filesystem::exists(outputDir.Get()))
+        {
+            boost::filesystem::create_directories(outputDir.Get());
+        }
+        Fasta fastaReader; // Never opened. Any sequence needed was read by the shards
+        ReadProcessor processor(options, fastaReader, first.sequences, outputDir.Get() + "/" + first.report.sampleName + ".coverage.tsv", options.outputCoverage, outputDir.Get() + "/" + first.report.sampleName + ".exon_cv.tsv", first.report.gcContent);
+        processor.features.swap(features);
+        processor.doFragmentSize = first.fragmentBudget;
+
+        vector<ContigResult> results;
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            try {
+                readPartialContigs(*streams[i], options, fastaReader, first.sequences, results);
+            }
+            catch (serializationException &e) {
+                throw serializationException(filenames[i] + ": " + e.error);
+            }
+            streams[i].reset();
+        }
+        // Every contig (and the unplaced reads) must have been read by exactly one shard
+        vector<unsigned int> readCount(first.sequences.size() + 1, 0u);
+        for (auto contig = results.begin(); contig != results.end(); ++contig) ++readCount[contig->tid >= 0 ? contig->tid : first.sequences.size()];
+        for (auto count = readCount.begin(); count != readCount.end(); ++count)
+        {
+            if (*count > 1u) throw serializationException("Some contigs were processed by more than one shard. Make sure to merge exactly one partial from each shard");
+            if (!*count) throw serializationException("Some contigs were not processed by any shard. Make sure to merge exactly one partial from each shard");
+        }
+        stable_sort(results.begin(), results.end(), [](const ContigResult &a, const ContigResult &b) {
+            return static_cast<uint32_t>(a.tid) < static_cast<uint32_t>(b.tid); // Unplaced reads (negative) sort last
+        });
+
+        if (VERBOSITY) cout << "Merging " << filenames.size() << " partials" << endl;
+        mergeContigs(processor, results);
+        processor.baseCoverage.close();
+        writeReport(processor, options, first.report, outputDir.Get());
+    }
+    catch (const args::Help&)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (boost::filesystem::filesystem_error &e)
+    {
+        cerr << "Filesystem error:  " << e.what() << endl;
+        return 8;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch (serializationException &e)
+    {
+        cerr << "Unable to merge partials: " << e.error << endl;
+        return 11;
+    }
+    catch(ios_base::failure &e)
+    {
+        cerr << "Encountered an IO failure" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    return 0;
+}
+
+// Writes all of the reports from the finished processor
+void writeReport(ReadProcessor &processor, const QCOptions &options, const ReportOptions &report, const string &outputDir)
+{
+    Metrics &counter = processor.counter;
+    FeatureCounts &counts = processor.counts;
+    BiasCounter &bias = processor.bias;
+    BaseCoverage &baseCoverage = processor.baseCoverage;
+    const unsigned long long alignmentCount = processor.alignmentCount;
+    unsigned long *gcBins = processor.gcBins;
+    const LengthHistogram &read_lengths = processor.read_lengths;
+    map<long long, unsigned long> &fragmentSizes = processor.fragmentSizes;
+    if (options.verbosity) cout << "Estimating library complexity..." << endl;
+    counter.increment(MetricKey::TotalReads, alignmentCount);
+    double duplicates = static_cast<double>(counter.get(MetricKey::DuplicatePairs));
+    double unique = static_cast<double>(counter.get(MetricKey::UniqueFragments));
+    double numReads = duplicates + unique;
+    unsigned int minReads = 0u;
+    //If there are no duplicates, the estimate is useless, so skip it
+    if (duplicates > 0) minReads = estimateLibraryComplexity(unique, numReads);
+    if (minReads)
+    {
+        //Predicted unique fragments if the library were sequenced deeper (or shallower)
+        ofstream complexityReport(outputDir+"/"+report.sampleName+".complexity.tsv");
+        complexityReport << "depth_multiple\tfragments\tunique_fragments" << endl;
+        const vector<double> multiples = {0.5, 1.0, 2.0, 3.0, 4.0, 5.0, 10.0};
+        for (auto multiple = multiples.begin(); multiple != multiples.end(); ++multiple)
+            complexityReport << *multiple << "\t" << static_cast<unsigned long long>(*multiple * numReads) << "\t" << llround(expectedUniqueFragments(minReads, *multiple * numReads)) << endl;
+    }
+
+    if (options.verbosity) cout << "Generating report" << endl;
+
+    //gene coverage report generation
+    unsigned int genesDetected = 0;
+    double fragmentMed = 0.0;
+    vector<double> ratios;
+    {
+        ofstream geneReport(outputDir+"/"+report.sampleName+".gene_reads.gct");
+        ofstream geneRPKM(outputDir+"/"+report.sampleName+".gene_"+(report.rpkm ? "rpkm" : "tpm")+".gct");
+        ofstream fragmentReport(outputDir+"/"+report.sampleName+".gene_fragments.gct");
+        geneReport << "#1.2" << endl;
+        geneRPKM << "#1.2" << endl;
+        fragmentReport << "#1.2" << endl;
+        geneReport << geneList.size() << "\t1" << endl;
+        geneRPKM << geneList.size() << "\t1" << endl;
+        fragmentReport << geneList.size() << "\t1" << endl;
+        geneReport << "Name\tDescription\t" << (report.labelled ? report.sampleName : "Counts") << endl;
+        geneRPKM << "Name\tDescription\t" << (report.labelled ? report.sampleName : (report.rpkm ? "RPKM" : "TPM")) << endl;
+        geneRPKM << fixed;
+        fragmentReport << "Name\tDescription\t" << (report.labelled ? report.sampleName : "Fragments") << endl;
+        const double scaleRPKM = static_cast<double>(counter.get(MetricKey::ExonicReads)) / 1000000.0;
+        double scaleTPM = 0.0;
+        vector<double> tpms(report.rpkm ? 0 : geneList.size());
+        for(unsigned int gene = 0; gene < geneList.size(); ++gene)
+        {
+            geneReport << geneList[gene] << "\t" << geneNames[gene] << "\t" << static_cast<long>(counts.geneCounts.get(gene)) << endl;
+            fragmentReport << geneList[gene] << "\t" << geneNames[gene] << "\t" << static_cast<long>(counts.geneFragmentCounts.get(gene)) << endl;
+
+//#ifndef NO_FASTA
+//                //If fasta features were enabled, get the gc content coverage bias from this gene
+//                if (fastaFile && geneCoverage[*gene]) gcBias += gc(geneSeqs[*gene]) / static_cast<double>(geneList.size());
+//#endif
+
+            if (report.rpkm)
+            {
+                double RPKM = (1000.0 * counts.geneCounts.get(gene) / scaleRPKM) / static_cast<double>(geneCodingLengths[gene]);
+                geneRPKM << geneList[gene] << "\t" << geneNames[gene] << "\t" << RPKM << endl;
+            }
+            else
+            {
+                double TPM = (1000.0 * counts.geneCounts.get(gene)) / static_cast<double>(geneCodingLengths[gene]);
+                tpms[gene] = TPM;
+                scaleTPM += TPM;
+            }
+            // Gene 'detection' depends only on unique reads, discounting duplicates
+            if (counts.uniqueGeneCounts.get(gene) >= options.detectionThreshold) ++genesDetected;
+            double geneBias = bias.getBias(geneList[gene]);
+            assert(geneBias == -1.0 || (geneBias >= 0.0 && geneBias <= 1.0));
+            if (geneBias != -1.0) ratios.push_back(geneBias);
+        }
+        geneReport.close();
+        if (!report.rpkm)
+        {
+            scaleTPM /= 1000000.0;
+            for(unsigned int gene = 0; gene < geneList.size(); ++gene)
+                geneRPKM << geneList[gene] << "\t" << geneNames[gene] << "\t" << tpms[gene] / scaleTPM << endl;
+        }
+        geneRPKM.close();
+
+    }
+
+    //3'/5' coverage ratio calculations
+    double ratioAvg = 0.0, ratioMedDev = 0.0, ratioMedian = 0.0, ratioStd = 0.0, ratio75 = 0.0, ratio25 = 0.0;
+    if (ratios.size() > 1)
+    {
+        statsTuple ratio_stats = getStatistics(ratios);
+        ratioAvg = std::get<StatIdx::avg>(ratio_stats);
+        ratioMedian = std::get<StatIdx::med>(ratio_stats);
+        ratioStd = std::get<StatIdx::std>(ratio_stats);
+        ratioMedDev = std::get<StatIdx::mad>(ratio_stats);
+        //Rounding up can step past the end of small lists, so indices are clamped to the last ratio
+        //Older versions read past the end of the list here, so small samples could report arbitrary values (often 0) for these percentiles
+        auto ratioAt = [&ratios](double index) {
+            return ratios[std::min<std::size_t>(static_cast<std::size_t>(index), ratios.size() - 1)];
+        };
+        double index = .25 * ratios.size();
+        if (index > floor(index))
+        {
+            index = ceil(index);
+            ratio25 = ratioAt(index);
+        }
+        else
+        {
+            index = ceil(index);
+            ratio25 = (ratioAt(index) + ratioAt(index + 1)) / 2.0;
+        }
+        index = .75 * ratios.size();
+        if (index > floor(index))
+        {
+            index = ceil(index);
+            ratio75 = ratioAt(index);
+        }
+        else
+        {
+            index = ceil(index);
+            ratio75 = (ratioAt(index) + ratioAt(index + 1)) / 2.0;
+        }
+    }
+    //exon coverage report generation
+    {
+        ofstream exonReport(outputDir+"/"+report.sampleName+".exon_reads.gct");
+        exonReport << "#1.2" << endl;
+        exonReport << counts.countedExons() << "\t1" << endl;
+        exonReport << "Name\tDescription\t" << (report.labelled ? report.sampleName : "Counts") << endl;
+        exonReport << fixed;
+        for(unsigned int exon = 0; exon < exonList.size(); ++exon)
+        {
+            exonReport << exonList[exon] << "\t" << exonGeneNames[exon] << "\t" << counts.exonCounts.get(exon) << endl;
+        }
+        exonReport.close();
+    }
+
+    // get read length stats.
+    unsigned long long num_uniq_mapped_reads = read_lengths.count();
+    float mean_read_length = read_lengths.lengthSum() / static_cast<float>(num_uniq_mapped_reads);
+    unsigned int max_read_length = read_lengths.max();
+    unsigned int median_read_length = read_lengths.median();
+    unsigned int third_quartile_read_length = read_lengths.at(static_cast<unsigned long long>(0.75 * num_uniq_mapped_reads));
+    unsigned int first_quartile_read_length = read_lengths.at(static_cast<unsigned long long>(0.25 * num_uniq_mapped_reads));
     
-    char tagContents = bam_aux2A(tagPtr);
-    if (!tagContents)
-      return false;
-    result = "";
-    result += tagContents;
-    return true;
+    ofstream output(outputDir+"/"+report.sampleName+".metrics.tsv");
+    //output rates and other fractions to the report
+    output << "Sample\t" << report.sampleName << endl;
+    output << "Mapping Rate\t" << counter.frac(MetricKey::MappedReads, MetricKey::UniqueMappingQCPassedReads) << endl;
+    output << "Unique Rate of Mapped\t" << counter.frac(MetricKey::MappedUniqueReads, MetricKey::MappedReads) << endl;
+    output << "Duplicate Rate of Mapped\t" << counter.frac(MetricKey::MappedDuplicateReads, MetricKey::MappedReads) << endl;
+    output << "Duplicate Rate of Mapped, excluding Globins\t" << counter.frac(MetricKey::NonGlobinDuplicateReads, MetricKey::NonGlobinReads) << endl;
+    output << "Base Mismatch\t" << counter.frac(MetricKey::MismatchedBases, MetricKey::TotalBases) << endl;
+    output << "End 1 Mapping Rate\t"<< 2.0 * counter.frac(MetricKey::End1MappedReads, MetricKey::UniqueMappingQCPassedReads) << endl;
+    output << "End 2 Mapping Rate\t"<< 2.0 * counter.frac(MetricKey::End2MappedReads, MetricKey::UniqueMappingQCPassedReads) << endl;
+    output << "End 1 Mismatch Rate\t" << counter.frac(MetricKey::End1Mismatches, MetricKey::End1Bases) << endl;
+    output << "End 2 Mismatch Rate\t" << counter.frac(MetricKey::End2Mismatches, MetricKey::End2Bases) << endl;
+    output << "Expression Profiling Efficiency\t" << counter.frac(MetricKey::ExonicReads, MetricKey::UniqueMappingQCPassedReads) << endl;
+    output << "High Quality Rate\t" << counter.frac(MetricKey::HighQualityReads, MetricKey::MappedReads) << endl;
+    output << "Exonic Rate\t" << counter.frac(MetricKey::ExonicReads, MetricKey::MappedReads) << endl;
+    output << "Intronic Rate\t" << counter.frac(MetricKey::IntronicReads, MetricKey::MappedReads) << endl;
+    output << "Intergenic Rate\t" << counter.frac(MetricKey::IntergenicReads, MetricKey::MappedReads) << endl;
+    output << "Intragenic Rate\t" << counter.frac(MetricKey::IntragenicReads, MetricKey::MappedReads) << endl;
+    output << "Ambiguous Alignment Rate\t" << counter.frac(MetricKey::AmbiguousReads, MetricKey::MappedReads) << endl;
+    output << "High Quality Exonic Rate\t" << counter.frac(MetricKey::HQExonicReads, MetricKey::HighQualityReads) << endl;
+    output << "High Quality Intronic Rate\t" << counter.frac(MetricKey::HQIntronicReads, MetricKey::HighQualityReads) << endl;
+    output << "High Quality Intergenic Rate\t" << counter.frac(MetricKey::HQIntergenicReads, MetricKey::HighQualityReads) << endl;
+    output << "High Quality Intragenic Rate\t" << counter.frac(MetricKey::HQIntragenicReads, MetricKey::HighQualityReads) << endl;
+    output << "High Quality Ambiguous Alignment Rate\t" << counter.frac(MetricKey::HQAmbiguousReads, MetricKey::HighQualityReads) << endl;
+    output << "Discard Rate\t" << static_cast<double>(counter.get(MetricKey::MappedReads) - counter.get(MetricKey::ReadsUsedForCounts)) / counter.get(MetricKey::MappedReads) << endl;
+    output << "rRNA Rate\t" << counter.frac(MetricKey::RRNAReads, MetricKey::MappedReads) << endl;
+    output << "End 1 Sense Rate\t" << static_cast<double>(counter.get(MetricKey::End1Sense)) / (counter.get(MetricKey::End1Sense) + counter.get(MetricKey::End1Antisense)) << endl;
+    output << "End 2 Sense Rate\t" << static_cast<double>(counter.get(MetricKey::End2Sense)) / (counter.get(MetricKey::End2Sense) + counter.get(MetricKey::End2Antisense)) << endl;
+    output << "Avg. Splits per Read\t" << counter.frac(MetricKey::AlignmentBlocks, MetricKey::MappedReads) - 1.0 << endl;
+    //automatically dump the raw counts of all metrics to the file
+    output << counter;
+    //append metrics that were manually tracked
+    //output << "Read Length\t" << readLength << endl;
+    output << "Mean read length\t" << mean_read_length << endl;
+    output << "Median read length\t" << median_read_length << endl;
+    output << "Third quartile read length\t" << third_quartile_read_length << endl;
+    output << "First quartile read length\t" << first_quartile_read_length << endl;
+    output << "Maximum read length\t" << max_read_length << endl;
+    output << "Genes Detected\t" << genesDetected << endl;
+    output << "Estimated Library Complexity\t" << minReads << endl;
+    output << "Genes used in 3' bias\t" << bias.countGenes() << endl;
+    output << "Mean 3' bias\t" << ratioAvg << endl;
+    output << "Median 3' bias\t" << ratioMedian << endl;
+    output << "3' bias Std\t" << ratioStd << endl;
+    output << "3' bias MAD_Std\t" << ratioMedDev << endl;
+    output << "3' Bias, 25th Percentile\t" << ratio25 << endl;
+    output << "3' Bias, 75th Percentile\t" << ratio75 << endl;
+
+//#ifndef NO_FASTA
+//        if (report.gcContent) output << "Mean Weighted GC Content\t" << gcBias << endl;
+//#endif
+
+    if (fragmentSizes.size())
+    {
+        //If any fragment size samples were taken, also generate a fragment size report
+        // fragments stores {size -> count}, which the statistics work on directly
+        statsTuple fragment_stats = getHistogramStatistics(fragmentSizes);
+        const double fragmentAvg = std::get<StatIdx::avg>(fragment_stats), fragmentStd = std::get<StatIdx::std>(fragment_stats), fragmentMedDev = std::get<StatIdx::mad>(fragment_stats);
+        fragmentMed = std::get<StatIdx::med>(fragment_stats);
+        ofstream fragmentList(outputDir+"/"+report.sampleName+".fragmentSizes.txt"); //raw list of each fragment size recorded
+        fragmentList << "Fragment Size\tCount" << endl;
+        for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
+            fragmentList << fragment->first << "\t" << fragment->second << endl; //record the fragment size into the output list
+        fragmentList.close();
+
+        output << "Average Fragment Length\t" << fragmentAvg << endl;
+        output << "Fragment Length Median\t" << fragmentMed << endl;
+        output << "Fragment Length Std\t" << fragmentStd << endl;
+        output << "Fragment Length MAD_Std\t" << fragmentMedDev << endl;
+    }
+
+    {
+        // Exon CV rows were written out as each gene was computed. Only their summaries are left
+        QuantileSketch &means = baseCoverage.getGeneMeans(), &stdDevs = baseCoverage.getGeneStds(), &cvs = baseCoverage.getGeneCVs(), &exonCVs = baseCoverage.getExonCVs();
+        output << "Median of Avg Transcript Coverage\t" << means.median() << endl;
+        output << "Median of Transcript Coverage Std\t" << stdDevs.median() << endl;
+        output << "Median of Transcript Coverage CV\t" << (cvs.count() ? cvs.median() : 0.0) << endl;
+        output << "Median Exon CV\t" << (exonCVs.count() ? exonCVs.median() : NAN) << endl;
+        output << "Exon CV MAD\t" << (exonCVs.count() ? exonCVs.medianDeviation() * MAD_FACTOR : NAN) << endl;
+    }
+    if (report.gcContent) {
+        ofstream gcReport(outputDir + "/" + report.sampleName + ".gc_content.tsv");
+        gcReport << "Content Bin\tCount" << endl;
+        map<unsigned int, unsigned long> gcHistogram;
+        for (unsigned int i = 0; i < 100; ++i) {
+            gcReport << (double)i/100.0 << "\t" << gcBins[i] << endl;
+            if (gcBins[i]) gcHistogram[i] = gcBins[i];
+        }
+        statsTuple gc_stats = getAdvancedHistogramStatistics(gcHistogram);
+        output << "Fragment GC Content Mean\t" << (double) std::get<StatIdx::avg>(gc_stats)/100.0 << endl;
+        output << "Fragment GC Content Std\t" << (double) std::get<StatIdx::std>(gc_stats)/100.0 << endl;
+        output << "Fragment GC Content Skewness\t" << std::get<StatIdx::skew>(gc_stats) << endl;
+        output << "Fragment GC Content Kurtosis\t" << std::get<StatIdx::kurt>(gc_stats) << endl;
+    }
+
+    output.close();
+}
+
+double reduceDeltaCV(list<double> &deltaCV)
+{
+    sortContainer(deltaCV);
+    return computeMedian(deltaCV.size(), deltaCV.begin());
 }
@@ -0,0 +1,151 @@
+//
+//  Serialize.h
+//  RNA-SeQC
+//
+//  Minimal binary (de)serialization helpers for partial results
+//
+
+#ifndef Serialize_h
+#define Serialize_h
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <type_traits>
+#include <exception>
+#include <stdint.h>
+
+namespace rnaseqc {
+    struct serializationException : public std::exception {
+        std::string error;
+        serializationException(std::string msg) : error(msg) {};
+    };
+
+    class MemoryReader : public std::streambuf {
+        // Lets an istream read straight out of a block of memory (such as a mapped file) without copying it
+    public:
+        MemoryReader(const char *data, std::size_t length)
+        {
+            char *begin = const_cast<char*>(data);
+            this->setg(begin, begin, begin + length);
+        }
+    protected:
+        pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode mode) override
+        {
+            char *target = (direction == std::ios_base::beg ? this->eback() : direction == std::ios_base::cur ? this->gptr() : this->egptr()) + offset;
+            if (!(mode & std::ios_base::in) || target < this->eback() || target > this->egptr()) return pos_type(off_type(-1));
+            this->setg(this->eback(), target, this->egptr());
+            return pos_type(target - this->eback());
+        }
+        pos_type seekpos(pos_type position, std::ios_base::openmode mode) override
+        {
+            return this->seekoff(off_type(position), std::ios_base::beg, mode);
+        }
+    };
+
+    // Values are stored in native byte order. Files carry a marker so that a mismatch is caught on load
+    template <typename T> typename std::enable_if<std::is_arithmetic<T>::value>::type writeBinary(std::ostream &stream, const T &value)
+    {
+        stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T> typename std::enable_if<std::is_arithmetic<T>::value>::type readBinary(std::istream &stream, T &value)
+    {
+        if (!stream.read(reinterpret_cast<char*>(&value), sizeof(T))) throw serializationException("Unexpected end of data");
+    }
+
+    inline void writeBinary(std::ostream &stream, const std::string &value)
+    {
+        writeBinary(stream, static_cast<uint64_t>(value.size()));
+        stream.write(value.data(), value.size());
+    }
+
+    inline void readBinary(std::istream &stream, std::string &value)
+    {
+        uint64_t size;
+        readBinary(stream, size);
+        value.clear();
+        // Read in blocks, so that a corrupt size runs out of data instead of memory
+        char buffer[4096];
+        while (size)
+        {
+            const uint64_t length = size < sizeof(buffer) ? size : sizeof(buffer);
+            if (!stream.read(buffer, length)) throw serializationException("Unexpected end of data");
+            value.append(buffer, length);
+            size -= length;
+        }
+    }
+
+    template <typename T> void writeBinary(std::ostream&, const std::vector<T>&);
+    template <typename T> void readBinary(std::istream&, std::vector<T>&);
+    template <typename T> void writeBinary(std::ostream&, const std::list<T>&);
+    template <typename T> void readBinary(std::istream&, std::list<T>&);
+    template <typename K, typename V> void writeBinary(std::ostream&, const std::map<K, V>&);
+    template <typename K, typename V> void readBinary(std::istream&, std::map<K, V>&);
+
+    template <typename T> void writeBinary(std::ostream &stream, const std::vector<T> &values)
+    {
+        writeBinary(stream, static_cast<uint64_t>(values.size()));
+        for (auto value = values.begin(); value != values.end(); ++value) writeBinary(stream, *value);
+    }
+
+    template <typename T> void readBinary(std::istream &stream, std::vector<T> &values)
+    {
+        uint64_t size;
+        readBinary(stream, size);
+        values.clear();
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            T value;
+            readBinary(stream, value);
+            values.push_back(value);
+        }
+    }
+
+    template <typename T> void writeBinary(std::ostream &stream, const std::list<T> &values)
+    {
+        writeBinary(stream, static_cast<uint64_t>(values.size()));
+        for (auto value = values.begin(); value != values.end(); ++value) writeBinary(stream, *value);
+    }
+
+    template <typename T> void readBinary(std::istream &stream, std::list<T> &values)
+    {
+        uint64_t size;
+        readBinary(stream, size);
+        values.clear();
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            T value;
+            readBinary(stream, value);
+            values.push_back(value);
+        }
+    }
+
+    template <typename K, typename V> void writeBinary(std::ostream &stream, const std::map<K, V> &values)
+    {
+        writeBinary(stream, static_cast<uint64_t>(values.size()));
+        for (auto entry = values.begin(); entry != values.end(); ++entry)
+        {
+            writeBinary(stream, entry->first);
+            writeBinary(stream, entry->second);
+        }
+    }
+
+    template <typename K, typename V> void readBinary(std::istream &stream, std::map<K, V> &values)
+    {
+        uint64_t size;
+        readBinary(stream, size);
+        values.clear();
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            K key;
+            readBinary(stream, key);
+            readBinary(stream, values[key]);
+        }
+    }
+}
+
+#endif /* Serialize_h */